@@ -93,6 +93,8 @@ struct Statue {
 	Texture STexture;
 	DescriptorSet DSS;
 	UniformBufferObject uboStatue;
+	int lod = 0;	// level of detail drawn last frame (see selectLod)
+	uint32_t object = 0;	// in gpuCuller (--gpu-culling)
 };
 
 
@@ -108,10 +110,22 @@ struct Statue_info {
 const std::vector<Statue_info> STATUES_INFO = {
 	{ "models/Venus.obj", "textures/marble_4.jpg" },
 	{ "models/heliosbust.obj","textures/helios.png"},
-	{ "models/stand.obj","textures/marble_4.jpg"},
 	{ "models/flamingo.obj","textures/marble_4.jpg"}
 };
 
+// Pedestals share one mesh and are drawn with a single instanced call:
+// add a transform to pedestalTransforms() for each copy in the gallery
+const Statue_info PEDESTAL_INFO = { "models/stand.obj","textures/marble_4.jpg" };
+
+std::vector<InstanceData> pedestalTransforms() {
+	return {
+		//TV stand
+		{ glm::translate(glm::mat4(1.0f), glm::vec3(1.0f, 0.0f, 0.0f)) *
+		  glm::rotate(glm::mat4(1.0f), glm::radians(150.0f), glm::vec3(0, 1, 0)) *
+		  glm::scale(glm::mat4(1.0f), glm::vec3(1.5f)) }
+	};
+}
+
 // MAIN ! 
 class MyProject : public BaseProject {
 	protected:
@@ -133,6 +147,13 @@ class MyProject : public BaseProject {
 	bool playPausePressed = false;
 	bool firstPlay = true;
 	bool drawCardPressed = false;
+	bool cardVisible = false;
+
+	// Draws of each statue (raised by the recording benchmark)
+	int statueCopies = 1;
+
+	// Model matrix of the museum, the mountains and the pedestals (culling)
+	const glm::mat4 staticWorld = glm::mat4(1.0f);
 
 	// Pixel map value and current text id (used by Card U.I)
 	int pix = 0, textId = 0;
@@ -141,6 +162,7 @@ class MyProject : public BaseProject {
 	DescriptorSetLayout DSLGlobal;			//DSL for global lights 
 	DescriptorSetLayout DSLGlobalModels;	//DSL for global models
 	DescriptorSetLayout DSLObjModels;		//DSL for single models
+	DescriptorSetLayout DSLInstancedModels;	//DSL for instanced models (texture only)
 
 	DescriptorSetLayout DSLCard;			
 	DescriptorSetLayout skyBoxDSL;
@@ -156,13 +178,13 @@ class MyProject : public BaseProject {
 	// Pipelines
 	Pipeline P1; // Pipeline for Museum and Mountains
 	Pipeline PMarble; //Marble for statues
+	Pipeline PMarbleInstanced; //Marble for instanced exhibits (pedestals)
+	Pipeline PMarbleIndirect; //Marble for the exhibits culled on the GPU (--gpu-culling)
 	Pipeline PC; //Pipeline for card U.I.
 
 	//Custom pipeline for skybox
 	Pipeline skyBoxPipeline;
-	std::vector<VkBuffer> SkyBoxUniformBuffers;
-	std::vector<VkDeviceMemory> SkyBoxUniformBuffersMemory;
-	std::vector<VkDescriptorSet> SkyBoxDescriptorSets;	// to access uniforms in the pipeline
+	DescriptorSet skyBoxDS;	// to access uniforms in the pipeline
 
 	//Models and textures
 	Model M1; // Museum
@@ -174,6 +196,21 @@ class MyProject : public BaseProject {
 	Model skyBox;	// Skybox 
 	Texture skyBoxTexture;
 
+	Model pedestalModel;	// Pedestals (instanced)
+	Texture pedestalTexture;
+	DescriptorSet pedestalDS;
+	InstanceBuffer pedestalInstances;
+	int pedestalLod = 0;
+	// Without MarbleInstancedVert.spv every pedestal is drawn on its own by
+	// PMarble, with its model matrix in a uniform
+	bool instancedPedestals = true;
+	std::vector<glm::mat4> pedestalWorlds;
+	std::vector<DescriptorSet> pedestalDSS;
+	std::vector<int> pedestalLods;
+
+	// Vertices and indices of every static model (see loadModels)
+	MeshRegistry meshRegistry;
+
 	Model MC;	//Card 
 	Texture TC[TEXTURE_ARRAY_SIZE]; // Texture Array for all descriptions
 	Texture CardSampler;
@@ -188,9 +225,11 @@ class MyProject : public BaseProject {
 		initialBackgroundColor = {0.0f, 0.0f, 0.0f, 1.0f};
 		
 		// Descriptor pool sizes
-		uniformBlocksInPool = 10; // Museum + Mountain + 4*Statue + Skybox + Card + Global OBJ  + Global lights
-		texturesInPool = 24; // Museum + Mountain + 4*Statue + 6*Skybox + 12*Card
-		setsInPool = 10; // Museum + Mountain + 4*Statue + Skybox + Card + Global OBJ  + Global lights
+		// The pedestals need one set each when they are not instanced
+		int pedestals = static_cast<int>(pedestalTransforms().size());
+		uniformBlocksInPool = 9 + pedestals; // Museum + Mountain + 3*Statue + Skybox + Card + Global OBJ  + Global lights + Pedestals
+		texturesInPool = 23 + pedestals; // Museum + Mountain + 3*Statue + Pedestals + 6*Skybox + 12*Card
+		setsInPool = 9 + pedestals; // Museum + Mountain + 3*Statue + Pedestals + Skybox + Card + Global OBJ  + Global lights
 	}
 	
 	// Here you load and setup all your Vulkan objects
@@ -202,6 +241,9 @@ class MyProject : public BaseProject {
 		// INIT Descriptor Layouts [what will be passed to the shaders]
 		loadDescriptorLayouts();
 
+		//MAP (the rooms split the museum model while it loads)
+		loadMap();
+
 		// INIT Models and textures
 		loadModels();
 
@@ -211,9 +253,6 @@ class MyProject : public BaseProject {
 		// INIT Pipelines
 		loadPipelines();
 
-		//MAP
-		loadMap();
-
 		//Load audio
 		loadAudio();
 	}
@@ -240,25 +279,36 @@ class MyProject : public BaseProject {
 			// second element : the time of element (buffer or texture)
 			// third  element : the pipeline stage where it will be used
 			// fourth  element : #descriptorCount
-			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS, 1}
+			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_ALL_GRAPHICS, 1}
 			});
 
 		DSLGlobalModels.init(this, {
-			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS, 1},
+			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_ALL_GRAPHICS, 1},
 			});
 
 		DSLObjModels.init(this, {
-			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 1},
+			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT, 1},
+			{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1}
+			});
+
+		DSLInstancedModels.init(this, {
 			{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1}
 			});
 
 		DSLCard.init(this, {
-			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 1},
+			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT, 1},
 			{1, VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, VK_SHADER_STAGE_FRAGMENT_BIT, TEXTURE_ARRAY_SIZE},
 			{2, VK_DESCRIPTOR_TYPE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1}
 			});
 
-		skyBoxDSL.initSkybox(this);
+		skyBoxDSL.init(this, {
+			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT, 1},
+			{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1}
+			});
+
+		if (gpuCulling) {
+			gpuCuller.initLayout(this);
+		}
 	}
 
 	void loadDescriptorSets() {
@@ -297,47 +347,164 @@ class MyProject : public BaseProject {
 	// The last array, is a vector of pointer to the layouts of the sets that will
 	// be used in this pipeline. The first element will be set 0, and so on..
 	void loadPipelines() {
+		PROFILE_SCOPE("loadPipelines");
 		P1.init(this, "shaders/vert.spv", "shaders/frag.spv", { &DSLGlobal, &DSLGlobalModels, &DSLObjModels });
 		PMarble.init(this, "shaders/MarbleVert.spv", "shaders/MarbleFrag.spv", { &DSLGlobal, &DSLGlobalModels, &DSLObjModels });
+		if (instancedPedestals) {
+			PMarbleInstanced.init(this, "shaders/MarbleInstancedVert.spv", "shaders/MarbleFrag.spv",
+				{ &DSLGlobal, &DSLGlobalModels, &DSLInstancedModels }, 0, true);
+		}
 		PC.init(this, "shaders/CardVert.spv", "shaders/CardFrag.spv", { &DSLCard });
 		skyBoxPipeline.init(this, "shaders/SkyBoxVert.spv", "shaders/SkyBoxFrag.spv", { &skyBoxDSL });
+		if (gpuCulling) {
+			PMarbleIndirect.init(this, "shaders/MarbleIndirectVert.spv", "shaders/MarbleIndirectFrag.spv",
+				{ &DSLGlobal, &DSLGlobalModels, &gpuCuller.drawSetLayout });
+		}
+
+		// Parts of the frame timed by --gpu-profile
+		gpuProfiler.addSection("museum and mountain", { &P1 });
+		gpuProfiler.addSection("marble statues", { &PMarble, &PMarbleInstanced, &PMarbleIndirect });
+		gpuProfiler.addSection("card", { &PC });
+		gpuProfiler.addSection("skybox", { &skyBoxPipeline });
 	}
 
 	// Models, textures and Descriptors (values assigned to the uniforms)
+	// Files are decoded in parallel on the job system, the main thread
+	// uploads each asset as soon as its decode is done.
 	void loadModels() {
-		
-		M1.init(this, MODEL_PATH);
-		T1.init(this, TEXTURE_PATH);
+		PROFILE_SCOPE("loadModels");
+		AssetLoader loader;
+		loader.begin(this);
+
+		// Every model is packed in meshRegistry, unless --separate-mesh-buffers.
+		// The exhibits always are with --gpu-culling: the culler draws them
+		// from its buffers.
+		MeshRegistry *shared = sharedMeshBuffers ? &meshRegistry : nullptr;
+		MeshRegistry *exhibits = sharedMeshBuffers || gpuCulling ? &meshRegistry : nullptr;
+		M1.registry = shared;
+		mountainModel.registry = shared;
+		MC.registry = shared;
+		skyBox.registry = shared;
+		pedestalModel.registry = exhibits;
+
+		// Museum
+		loader.add(MODEL_PATH, [this]() { M1.decode(MODEL_PATH); splitMuseum(); }, [this]() { M1.upload(this); });
+		loader.add(TEXTURE_PATH, [this]() { T1.decode(TEXTURE_PATH); }, [this]() { T1.upload(this); });
 
 		// Mountain
-		mountainModel.init(this, MODEL_MOUNTAIN);
-		mountainTexture.init(this, TEXTURE_MOUNTAIN);
+		loader.add(MODEL_MOUNTAIN, [this]() { mountainModel.decode(MODEL_MOUNTAIN); },
+			[this]() { mountainModel.upload(this); });
+		loader.add(TEXTURE_MOUNTAIN, [this]() { mountainTexture.decode(TEXTURE_MOUNTAIN); },
+			[this]() { mountainTexture.upload(this); });
 
 		// Card
-		MC.init(this, CARD_MODEL_PATH);
+		loader.add(CARD_MODEL_PATH, [this]() { MC.decode(CARD_MODEL_PATH); }, [this]() { MC.upload(this); });
 		for (int i = 0; i < TEXTURE_ARRAY_SIZE; i++) {
-			TC[i].init(this, CARD_TEXTURE_PATH[i]);
+			loader.add(CARD_TEXTURE_PATH[i], [this, i]() { TC[i].decode(CARD_TEXTURE_PATH[i]); },
+				[this, i]() { TC[i].upload(this); });
+		}
+		//We'll only need the sampler of this Texture struct
+		loader.add("CardSampler", [this]() { CardSampler.decode(TEXTURE_PATH); },
+			[this]() { CardSampler.upload(this); });
+
+		// Statues (sized up front so the workers can fill them in place)
+		// The statues and the pedestals get simplified levels of detail,
+		// the statues also meshlets
+		statues.resize(STATUES_INFO.size());
+		for (size_t i = 0; i < STATUES_INFO.size(); i++) {
+			statues[i].SModel.generateLods = true;
+			statues[i].SModel.generateMeshlets = true;
+			statues[i].SModel.registry = exhibits;
+			loader.add(STATUES_INFO[i].model_p, [i]() { statues[i].SModel.decode(STATUES_INFO[i].model_p); },
+				[this, i]() { statues[i].SModel.upload(this); });
+			loader.add(STATUES_INFO[i].text_p, [i]() { statues[i].STexture.decode(STATUES_INFO[i].text_p); },
+				[this, i]() { statues[i].STexture.upload(this); });
 		}
-		CardSampler.init(this, TEXTURE_PATH); //We'll only need the sampler of this Texture struct
 
-		// Statues
-		for (Statue_info i : STATUES_INFO)
-		{
-			Statue s;
-			s.SModel.init(this, i.model_p);
-			s.STexture.init(this, i.text_p);
+		// Pedestals (instanced only with the glslc output of
+		// shaderMarbleInstanced.vert)
+		instancedPedestals = shadersCompiled({"shaders/MarbleInstancedVert.spv"});
+		if (!instancedPedestals) {
+			std::cout << "MarbleInstancedVert.spv not compiled (run shaders/compile.sh), "
+					  << "the pedestals are drawn one by one\n";
+		}
+		pedestalModel.generateLods = true;
+		loader.add(PEDESTAL_INFO.model_p, [this]() { pedestalModel.decode(PEDESTAL_INFO.model_p); },
+			[this]() {
+				pedestalModel.upload(this);
+				if (instancedPedestals) {
+					pedestalInstances.init(this, pedestalTransforms());
+				}
+			});
+		loader.add(PEDESTAL_INFO.text_p, [this]() { pedestalTexture.decode(PEDESTAL_INFO.text_p); },
+			[this]() { pedestalTexture.upload(this); });
+
+		// Skybox
+		loader.add(SkyBoxToLoad.ObjFile, [this]() { skyBox.decode(SkyBoxToLoad.ObjFile); },
+			[this]() { skyBox.upload(this); });
+		for (int i = 0; i < 6; i++) {
+			loader.add(SkyBoxToLoad.TextureFile[i], [this, i]() { decodeCubeFace(i); }, nullptr);
+		}
+		loader.add("Skybox cubemap", nullptr, [this]() { loadSkyBox(); });
+
+		loader.finish();
+		meshRegistry.upload(this);
+
+		for (Statue& s : statues) {
 			s.DSS.init(this, &DSLObjModels, {
 				{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
 				{1, TEXTURE, 0, &s.STexture}
 				});
-			statues.push_back(s);
 		}
 
-		// Skybox
-		loadSkyBox();
+		if (instancedPedestals) {
+			pedestalDS.init(this, &DSLInstancedModels, {
+					{1, TEXTURE, 0, &pedestalTexture}
+				});
+		} else if (!gpuCulling) {
+			// Sized before init: the sets register their own address
+			std::vector<InstanceData> pedestals = pedestalTransforms();
+			pedestalDSS.resize(pedestals.size());
+			pedestalLods.assign(pedestals.size(), 0);
+			for (size_t i = 0; i < pedestals.size(); i++) {
+				pedestalWorlds.push_back(staticWorld * pedestals[i].model);
+				pedestalDSS[i].init(this, &DSLObjModels, {
+					{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
+					{1, TEXTURE, 0, &pedestalTexture}
+					});
+			}
+		}
+
+		if (gpuCulling) {
+			loadGpuObjects();
+		}
+	}
+
+	// One GPU object per statue and per pedestal; the statues move, their
+	// matrices are set again by updateUniformBuffer
+	void loadGpuObjects() {
+		std::vector<Texture *> textures;
+		for (Statue& s : statues) {
+			textures.push_back(&s.STexture);
+		}
+		textures.push_back(&pedestalTexture);
+		std::vector<InstanceData> pedestals = pedestalTransforms();
+		gpuCuller.init(&meshRegistry, static_cast<uint32_t>(statues.size() + pedestals.size()),
+					   textures);
+
+		for (size_t i = 0; i < statues.size(); i++) {
+			statues[i].object = gpuCuller.addObject(statues[i].SModel.registeredMesh,
+													statues[i].uboStatue.model,
+													static_cast<uint32_t>(i));
+		}
+		for (const InstanceData& pedestal : pedestals) {
+			gpuCuller.addObject(pedestalModel.registeredMesh, staticWorld * pedestal.model,
+								static_cast<uint32_t>(statues.size()));
+		}
 	}
 
 	void loadAudio() {
+		PROFILE_SCOPE("loadAudio");
 		se.addSoundEffect("./audio/footstep.wav");
 		se.addSoundEffect("./audio/footstep2.wav");
 		se.addSoundEffect("./audio/paper.wav");
@@ -353,6 +520,7 @@ class MyProject : public BaseProject {
 		DSLGlobal.cleanup();
 		DSLGlobalModels.cleanup();
 		DSLObjModels.cleanup();
+		DSLInstancedModels.cleanup();
 		DSLCard.cleanup();
 		skyBoxDSL.cleanup();
 
@@ -364,15 +532,18 @@ class MyProject : public BaseProject {
 		P1.cleanup();
 		PC.cleanup();
 		PMarble.cleanup();
+		if (instancedPedestals) {
+			PMarbleInstanced.cleanup();
+		}
+		if (gpuCulling) {
+			PMarbleIndirect.cleanup();
+		}
 		skyBoxPipeline.cleanup();
 		
 		//Skybox
 		skyBox.cleanup();
 		skyBoxTexture.cleanup();
-		for (size_t i = 0; i < swapChainImages.size(); i++) {
-			vkDestroyBuffer(device, SkyBoxUniformBuffers[i], nullptr);
-			vkFreeMemory(device, SkyBoxUniformBuffersMemory[i], nullptr);
-		}
+		skyBoxDS.cleanup();
 
 		// Mountain
 		mountainDS.cleanup();
@@ -392,6 +563,18 @@ class MyProject : public BaseProject {
 			s.DSS.cleanup();
 		}
 		
+		// Pedestals
+		if (instancedPedestals) {
+			pedestalDS.cleanup();
+			pedestalInstances.cleanup();
+		}
+		for (DescriptorSet& ds : pedestalDSS) {
+			ds.cleanup();
+		}
+		pedestalTexture.cleanup();
+		pedestalModel.cleanup();
+		meshRegistry.cleanup();
+
 		// Card		
 		DSC.cleanup();
 		MC.cleanup();
@@ -402,130 +585,95 @@ class MyProject : public BaseProject {
 
 	}
 	
-	// Here it is the creation of the command buffer:
-	// You send to the GPU all the objects you want to draw,
-	// with their buffers and textures
-	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
-	
-	//PIPELINE MUSEUM and MOUNTAINS
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-				P1.graphicsPipeline);
-				
-	   //MUSEUM
-		VkBuffer vertexBuffers[] = {M1.vertexBuffer}; // property .vertexBuffer of models, contains the VkBuffer handle to its vertex buffer
-		VkDeviceSize offsets[] = {0};
-
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-		// property .indexBuffer of models, contains the VkBuffer handle to its index buffer
-		vkCmdBindIndexBuffer(commandBuffer, M1.indexBuffer, 0,
-								VK_INDEX_TYPE_UINT32);
-
-		// property .pipelineLayout of a pipeline contains its layout.
-		// property .descriptorSets of a descriptor set contains its elements.
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			P1.pipelineLayout, 0, 1, &DSGlobal.descriptorSets[currentImage],
-			0, nullptr);
-		vkCmdBindDescriptorSets(commandBuffer,	// Global Descriptor Set Models binding
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			P1.pipelineLayout, 1, 1, &DSGlobalModels.descriptorSets[currentImage],
-			0, nullptr);
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			P1.pipelineLayout, 2, 1, &DS1.descriptorSets[currentImage],
-			0, nullptr);
-						
-		// property .indices.size() of models, contains the number of triangles * 3 of the mesh.
-		vkCmdDrawIndexed(commandBuffer,
-					static_cast<uint32_t>(M1.indices.size()), 1, 0, 0, 0);
-
-	   // MOUNTAIN
-		VkBuffer vertexBuffersM[] = { mountainModel.vertexBuffer };
-		VkDeviceSize offsetsM[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffersM, offsetsM);
-		vkCmdBindIndexBuffer(commandBuffer, mountainModel.indexBuffer, 0,
-			VK_INDEX_TYPE_UINT32);
-
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			P1.pipelineLayout, 0, 1, &DSGlobal.descriptorSets[currentImage],
-			0, nullptr);
-
-		// Global Descriptor Set Models binding
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			P1.pipelineLayout, 1, 1, &DSGlobalModels.descriptorSets[currentImage],
-			0, nullptr);
-
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			P1.pipelineLayout, 2, 1, &mountainDS.descriptorSets[currentImage],
-			0, nullptr);
-
-		vkCmdDrawIndexed(commandBuffer,
-			static_cast<uint32_t>(mountainModel.indices.size()), 1, 0, 0, 0);
-
-	// PIPELINE MARBLE (Statues)
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, PMarble.graphicsPipeline);
-		
-		for each (Statue s in statues)
-		{
-			VkBuffer vertexBuffersS[] = { s.SModel.vertexBuffer };
-			VkDeviceSize offsetsS[] = { 0 };
-
-			vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffersS, offsetsS);
-			vkCmdBindIndexBuffer(commandBuffer, s.SModel.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-
-			// Global Descriptors Set binding
-			vkCmdBindDescriptorSets(commandBuffer,
-				VK_PIPELINE_BIND_POINT_GRAPHICS,
-				PMarble.pipelineLayout, 0, 1, &DSGlobal.descriptorSets[currentImage],
-				0, nullptr);
-			vkCmdBindDescriptorSets(commandBuffer,
-				VK_PIPELINE_BIND_POINT_GRAPHICS,
-				PMarble.pipelineLayout, 1, 1, &DSGlobalModels.descriptorSets[currentImage],
-				0, nullptr);
-			vkCmdBindDescriptorSets(commandBuffer,
-				VK_PIPELINE_BIND_POINT_GRAPHICS,
-				PMarble.pipelineLayout, 2, 1, &s.DSS.descriptorSets[currentImage],
-				0, nullptr);
-			vkCmdDrawIndexed(commandBuffer,
-				static_cast<uint32_t>(s.SModel.indices.size()), 1, 0, 0, 0);
+	// Everything that has to be drawn, grouped by pipeline (the order of the
+	// pipelines is kept by sortDrawList).
+	// Objects that are not visible are left out when the command buffer is
+	// recorded every frame: in the record-once mode they stay in the list
+	// (the card is then hidden by moving it away, see updateUniformBuffer).
+	// Draws given a model matrix are also frustum culled (cullDrawList);
+	// the card and the skybox are always drawn.
+	void buildDrawList() override {
+		drawList.clear();
+
+		//PIPELINE MUSEUM and MOUNTAINS
+		// The museum is drawn room by room (see buildRooms), culled by the portals
+		if (roomGraph.rooms.empty()) {
+			drawList.push_back({ &P1, &M1, { &DSGlobal, &DSGlobalModels, &DS1 }, 3, nullptr, &staticWorld });
+		} else {
+			for (size_t r = 0; r < roomGraph.rooms.size(); r++) {
+				const Room& room = roomGraph.rooms[r];
+				if (room.indexCount > 0) {
+					drawList.push_back({ &P1, &M1, { &DSGlobal, &DSGlobalModels, &DS1 }, 3, nullptr,
+						&staticWorld, (int)r, room.firstIndex, room.indexCount });
+				}
+			}
+			if (roomGraph.sharedIndexCount > 0) {
+				drawList.push_back({ &P1, &M1, { &DSGlobal, &DSGlobalModels, &DS1 }, 3, nullptr,
+					&staticWorld, -1, roomGraph.sharedFirstIndex, roomGraph.sharedIndexCount });
+			}
+		}
+		drawList.push_back({ &P1, &mountainModel, { &DSGlobal, &DSGlobalModels, &mountainDS }, 3,
+			nullptr, &staticWorld });
+
+		// PIPELINE MARBLE (Statues)
+		if (gpuCulling) {
+			// Statues and pedestals are culled and drawn by gpuCuller, once
+			// each: no statueCopies, portal culling or LODs on this path
+			DrawItem exhibits{ &PMarbleIndirect, nullptr, { &DSGlobal, &DSGlobalModels }, 2 };
+			exhibits.gpuObjects = &gpuCuller;
+			drawList.push_back(exhibits);
+		} else {
+			for (int c = 0; c < statueCopies; c++) {
+				for (Statue& s : statues) {
+					drawList.push_back({ &PMarble, &s.SModel, { &DSGlobal, &DSGlobalModels, &s.DSS }, 3,
+						nullptr, &s.uboStatue.model, roomGraph.roomOf(s.SModel, s.uboStatue.model) });
+					lodRange(drawList.back(), selectLod(s.SModel, s.uboStatue.model, s.lod));
+				}
+			}
+			if (instancedPedestals) {
+				drawList.push_back({ &PMarbleInstanced, &pedestalModel,
+					{ &DSGlobal, &DSGlobalModels, &pedestalDS }, 3, &pedestalInstances, &staticWorld });
+				lodRange(drawList.back(), selectLod(pedestalModel, staticWorld, pedestalLod, &pedestalInstances));
+			}
+			for (size_t i = 0; i < pedestalDSS.size(); i++) {
+				drawList.push_back({ &PMarble, &pedestalModel, { &DSGlobal, &DSGlobalModels, &pedestalDSS[i] }, 3,
+					nullptr, &pedestalWorlds[i], roomGraph.roomOf(pedestalModel, pedestalWorlds[i]) });
+				lodRange(drawList.back(), selectLod(pedestalModel, pedestalWorlds[i], pedestalLods[i]));
+			}
 		}
 
+		//PIPELINE CARD UI
+		if (cardVisible || !rerecordCommandBuffers) {
+			drawList.push_back({ &PC, &MC, { &DSC }, 1 });
+		}
 
-	//PIPELINE CARD UI  
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, PC.graphicsPipeline);
+		//PIPELINE SKYBOX
+		drawList.push_back({ &skyBoxPipeline, &skyBox, { &skyBoxDS }, 1 });
+	}
 
-		VkBuffer TvertexBuffers[] = { MC.vertexBuffer };
-		VkDeviceSize Toffsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, TvertexBuffers, Toffsets);
-		vkCmdBindIndexBuffer(commandBuffer, MC.indexBuffer, 0,
-			VK_INDEX_TYPE_UINT32);
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			PC.pipelineLayout, 0, 1, &DSC.descriptorSets[currentImage],
-			0, nullptr);
+	void scaleBenchmarkScene(int copies) override {
+		statueCopies = copies;
+	}
 
-		vkCmdDrawIndexed(commandBuffer,
-			static_cast<uint32_t>(MC.indices.size()), 1, 0, 0, 0);
-		
-	//PIPELINE SKYBOX
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			skyBoxPipeline.graphicsPipeline);
-		VkBuffer vertexBuffersSk[] = { skyBox.vertexBuffer};
-		VkDeviceSize offsetsSk[] = { 0 };
-
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffersSk, offsetsSk);
-		vkCmdBindIndexBuffer(commandBuffer, skyBox.indexBuffer, 0,
-			VK_INDEX_TYPE_UINT32);
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			skyBoxPipeline.pipelineLayout, 0, 1,
-			&SkyBoxDescriptorSets[currentImage],
-			0, nullptr);
-		vkCmdDrawIndexed(commandBuffer,
-			static_cast<uint32_t>(skyBox.indices.size()), 1, 0, 0, 0);
+	// Camera state saved and restored by the input recording (--record-input, --replay)
+	void getCamera(glm::vec3& position, glm::vec3& angles) override {
+		position = CamPos;
+		angles = CamAng;
+	}
+
+	void setCamera(const glm::vec3& position, const glm::vec3& angles) override {
+		CamPos = position;
+		CamAng = angles;
+	}
+
+	// Here it is the creation of the command buffer:
+	// You send to the GPU all the objects you want to draw,
+	// with their buffers and textures
+	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
+		buildDrawList();
+		cullDrawList();
+		sortDrawList();
+		recordDrawList(commandBuffer, currentImage, drawList);
 	}
 
 	// Here is where you update the uniforms.
@@ -533,12 +681,9 @@ class MyProject : public BaseProject {
 	void updateUniformBuffer(uint32_t currentImage) {
 
 		//TIME
-		static auto startTime = std::chrono::high_resolution_clock::now();
 		static float lastTime = 0.0f;
 
-		auto currentTime = std::chrono::high_resolution_clock::now();
-		float time = std::chrono::duration<float, std::chrono::seconds::period>
-			(currentTime - startTime).count();
+		float time = frameTime();
 		float deltaT = time - lastTime;
 		lastTime = time;
 
@@ -594,18 +739,18 @@ class MyProject : public BaseProject {
 		ubo_UI.proj = glm::ortho(-2.0f, 2.0f, -2.0f / aspect_ratio, 2.0f / aspect_ratio, -0.1f, 12.0f);
 		ubo_UI.view = glm::mat4(1.0f);
 		ubo_UI.textureID = textId;
+		cardVisible = false;
 
 
 		//CURSOR POSITION
-		glfwGetCursorPos(window, &xpos, &ypos);
+		getCursorPos(&xpos, &ypos);
 		double m_dx = xpos - old_xpos;
 		double m_dy = ypos - old_ypos;
 		old_xpos = xpos; old_ypos = ypos;
 
 
 		//CURSOR CAMERA MOVEMENT
-		glfwSetInputMode(window, GLFW_STICKY_MOUSE_BUTTONS, GLFW_TRUE);
-		if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
+		if (mouseButtonPressed(GLFW_MOUSE_BUTTON_LEFT)) {
 			CamAng.y += m_dx * ROT_SPEED / MOUSE_RES;	//PITCH
 			CamAng.x += m_dy * ROT_SPEED / MOUSE_RES;	//YAW
 		}
@@ -614,37 +759,40 @@ class MyProject : public BaseProject {
 		//KEY PRESS MOVEMENT
 		static float debounce = time;
 
-		if (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT)) {
+		if (keyPressed(GLFW_KEY_LEFT_SHIFT)) {
 			MOVE_SPEED = 2.5f;
 		}
 
-		bool drawCardCurrentyPressed = (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS);
+		bool drawCardCurrentyPressed = keyPressed(GLFW_KEY_SPACE);
 		int oldTextId = textId;
-		if (glfwGetKey(window, GLFW_KEY_SPACE) && pix!=255 && pix!=0) {
+		if (keyPressed(GLFW_KEY_SPACE) && pix!=255 && pix!=0) {
 			if (pix != 253) { // Hotfix for dispaly card outside museum bug
 				ubo_UI.model = glm::mat4(1);
+				cardVisible = true;
 
 				if (pixel_map[pix] < CARD_TEXTURE_PATH.size()) {
 					textId = pixel_map[pix];
 				}
 
-				if (oldTextId != textId || (!drawCardPressed && drawCardCurrentyPressed))
+				if (oldTextId != textId || (!drawCardPressed && drawCardCurrentyPressed)) {
+					PROFILE_SCOPE("playSoundEffect");
 					se.playSoundEffect(2);
+				}
 			}
 		}
 		drawCardPressed = drawCardCurrentyPressed;
 
 
-		if (glfwGetKey(window, GLFW_KEY_LEFT)) {
+		if (keyPressed(GLFW_KEY_LEFT)) {
 			CamAng.y += deltaT * ROT_SPEED;
 		}
-		if (glfwGetKey(window, GLFW_KEY_RIGHT)) {
+		if (keyPressed(GLFW_KEY_RIGHT)) {
 			CamAng.y -= deltaT * ROT_SPEED;
 		}
-		if (glfwGetKey(window, GLFW_KEY_UP)) {
+		if (keyPressed(GLFW_KEY_UP)) {
 			CamAng.x += deltaT * ROT_SPEED;
 		}
-		if (glfwGetKey(window, GLFW_KEY_DOWN)) {
+		if (keyPressed(GLFW_KEY_DOWN)) {
 			CamAng.x -= deltaT * ROT_SPEED;
 		}
 
@@ -654,36 +802,37 @@ class MyProject : public BaseProject {
 						   glm::mat3(glm::rotate(glm::mat4(1.0f), CamAng.z, glm::vec3(0.0f, 0.0f, 1.0f)));
 
 
-		if (glfwGetKey(window, GLFW_KEY_A)) {
+		if (keyPressed(GLFW_KEY_A)) {
 			CamPos -= MOVE_SPEED * glm::vec3(glm::rotate(glm::mat4(1.0f), CamAng.y,
 				glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(1, 0, 0, 1)) * deltaT;
 			isMoving = true;
 		}
-		if (glfwGetKey(window, GLFW_KEY_D)) {
+		if (keyPressed(GLFW_KEY_D)) {
 			CamPos += MOVE_SPEED * glm::vec3(glm::rotate(glm::mat4(1.0f), CamAng.y,
 				glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(1, 0, 0, 1)) * deltaT;
 			isMoving = true;
 		}
-		if (glfwGetKey(window, GLFW_KEY_S)) {
+		if (keyPressed(GLFW_KEY_S)) {
 			CamPos += MOVE_SPEED * glm::vec3(glm::rotate(glm::mat4(1.0f), CamAng.y,
 				glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(0, 0, 1, 1)) * deltaT;
 			isMoving = true;
 		}
-		if (glfwGetKey(window, GLFW_KEY_W)) {
+		if (keyPressed(GLFW_KEY_W)) {
 			CamPos -= MOVE_SPEED * glm::vec3(glm::rotate(glm::mat4(1.0f), CamAng.y, 
 				glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(0, 0, 1, 1)) * deltaT;
 			isMoving = true;
 		}
-		if (glfwGetKey(window, GLFW_KEY_F)) {
+		if (keyPressed(GLFW_KEY_F)) {
 			CamPos -= MOVE_SPEED * glm::vec3(0, 1, 0) * deltaT;
 		}
-		if (glfwGetKey(window, GLFW_KEY_R)) {
+		if (keyPressed(GLFW_KEY_R)) {
 			CamPos += MOVE_SPEED * glm::vec3(0, 1, 0) * deltaT;
 		}
 
 		// Play/pause music
-		bool playPauseCurrentyPressed = (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS);
+		bool playPauseCurrentyPressed = keyPressed(GLFW_KEY_M);
 		if (!playPausePressed && playPauseCurrentyPressed) { 
+			PROFILE_SCOPE("music play/pause");
 			if (!firstPlay) {
 				sm.playMusicTrack(0);
 				firstPlay = true;
@@ -709,6 +858,7 @@ class MyProject : public BaseProject {
 			differentialSign = (CamPos.y - oldCameraHeitgh) >= 0 ? 1.0f : -1.0f;
 
 			if (oldDifferentialSign != differentialSign && CamPos.y <= characterHeight + 0.025f) {
+				PROFILE_SCOPE("playSoundEffect");
 				se.playSoundEffect(soundEffectIndex);
 				soundEffectIndex += 1;
 				if (soundEffectIndex == 2)
@@ -726,6 +876,7 @@ class MyProject : public BaseProject {
 		glm::mat4 out = glm::perspective(glm::radians(90.0f), aspect_ratio, 0.1f, 100.0f);
 		out[1][1] *= -1;
 		guboObj.proj = out;
+		setView(CamPos, CamMat, out);
 		
 		// SKYBOX
 		UniformBufferObjectSkybox uboSky{};
@@ -734,7 +885,7 @@ class MyProject : public BaseProject {
 		uboSky.mvpMat = out * glm::mat4(glm::mat3(CamMat)) * glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.15f, 0.0f));
 
 		// Statue
-		if (statues.size() == 4) {
+		if (statues.size() == 3) {
 			// Venus
 			statues[0].uboStatue.model = glm::translate(glm::mat4(1.0f), glm::vec3(-7.0f, 0.1f, 4.15f)) *
 				glm::rotate(glm::mat4(1.0f), glm::radians(180.0f), glm::vec3(0, 1, 0)) *
@@ -745,13 +896,8 @@ class MyProject : public BaseProject {
 				glm::rotate(glm::mat4(1.0f), glm::radians(80.0f), glm::vec3(1, 0, 0)) *
 				glm::rotate(glm::mat4(1.0f), glm::radians(90.0f), glm::vec3(0, 1, 0));
 
-			//TV stand
-			statues[2].uboStatue.model = glm::translate(glm::mat4(1.0f), glm::vec3(1.0f, 0.0f, 0.0f)) *
-				glm::rotate(glm::mat4(1.0f), glm::radians(150.0f), glm::vec3(0, 1, 0)) *
-				glm::scale(glm::mat4(1.0f), glm::vec3(1.5f));
-
 			// Flamingo
-			statues[3].uboStatue.model =
+			statues[2].uboStatue.model =
 				glm::rotate(glm::mat4(1.0f), glm::radians(10.0f), glm::vec3(0, 0, 1)) *
 				glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 2.5f + 0.5f * sin(3 * modTime + 1), 5.5f)) *
 				glm::rotate(glm::mat4(1.0f), glm::radians(360.0f * modTime), glm::vec3(0, 1, 0));
@@ -759,53 +905,40 @@ class MyProject : public BaseProject {
 
 
 		//MAPPING - Here is where you actually update your uniforms
-		void* data;
+		// (plain writes into this frame's region of the uniform ring)
 
 		//Museum and paintings
-		vkMapMemory(device, DS1.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(ubo_museum), 0, &data);
-		memcpy(data, &ubo_museum, sizeof(ubo_museum));
-		vkUnmapMemory(device, DS1.uniformBuffersMemory[0][currentImage]);
+		memcpy(DS1.uniformData(0, currentImage), &ubo_museum, sizeof(ubo_museum));
 
 
 		// Mountain
-		vkMapMemory(device, mountainDS.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(mountainUbo), 0, &data);
-		memcpy(data, &mountainUbo, sizeof(mountainUbo));
-		vkUnmapMemory(device, mountainDS.uniformBuffersMemory[0][currentImage]);
+		memcpy(mountainDS.uniformData(0, currentImage), &mountainUbo, sizeof(mountainUbo));
 
 		//STATUES
 		for each(Statue s in statues)
 		{
-			vkMapMemory(device, s.DSS.uniformBuffersMemory[0][currentImage], 0,
-				sizeof(s.uboStatue.model), 0, &data);
-			memcpy(data, &s.uboStatue.model, sizeof(s.uboStatue.model));
-			vkUnmapMemory(device, s.DSS.uniformBuffersMemory[0][currentImage]);
+			memcpy(s.DSS.uniformData(0, currentImage), &s.uboStatue.model, sizeof(s.uboStatue.model));
+		}
+		for (size_t i = 0; i < pedestalDSS.size(); i++) {
+			memcpy(pedestalDSS[i].uniformData(0, currentImage), &pedestalWorlds[i], sizeof(glm::mat4));
+		}
+		if (gpuCulling) {
+			for (Statue& s : statues) {
+				gpuCuller.setObject(s.object, s.uboStatue.model);
+			}
 		}
 
 		//CARD
-		vkMapMemory(device, DSC.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(ubo_UI), 0, &data);
-		memcpy(data, &ubo_UI, sizeof(ubo_UI));
-		vkUnmapMemory(device, DSC.uniformBuffersMemory[0][currentImage]);
+		memcpy(DSC.uniformData(0, currentImage), &ubo_UI, sizeof(ubo_UI));
 
 
 		// SkyBox uniforms
-		vkMapMemory(device, SkyBoxUniformBuffersMemory[currentImage], 0,
-			sizeof(uboSky), 0, &data);
-		memcpy(data, &uboSky, sizeof(uboSky));
-		vkUnmapMemory(device, SkyBoxUniformBuffersMemory[currentImage]);
+		memcpy(skyBoxDS.uniformData(0, currentImage), &uboSky, sizeof(uboSky));
 
 		//GLOBAL
-		vkMapMemory(device, DSGlobal.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(gubo), 0, &data);
-		memcpy(data, &gubo, sizeof(gubo));
-		vkUnmapMemory(device, DSGlobal.uniformBuffersMemory[0][currentImage]);
+		memcpy(DSGlobal.uniformData(0, currentImage), &gubo, sizeof(gubo));
 
-		vkMapMemory(device, DSGlobalModels.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(guboObj), 0, &data);
-		memcpy(data, &guboObj, sizeof(GlobalUniformBufferObject));
-		vkUnmapMemory(device, DSGlobalModels.uniformBuffersMemory[0][currentImage]);
+		memcpy(DSGlobalModels.uniformData(0, currentImage), &guboObj, sizeof(GlobalUniformBufferObject));
 
 	}
 
@@ -828,6 +961,236 @@ class MyProject : public BaseProject {
 		}
 		std::cout << "Station map -> size: " << stationMapWidth
 			<< "x" << stationMapHeight << "\n";
+		buildRooms();
+	}
+
+	// Inverse of the mapping in canStepPoint
+	glm::vec2 mapToWorld(float pixX, float pixY) {
+		return glm::vec2((pixX - stationMapWidth) * 9.0f / stationMapWidth,
+						 pixY * 5.0f / stationMapHeight);
+	}
+
+	// Doorway pixels of the map are marked in buildRooms as closed along
+	// a row (a gap in a horizontal wall) or along a column
+	enum MapCell : uint8_t { MAP_OPEN, MAP_WALL, MAP_ROW_DOOR, MAP_COLUMN_DOOR };
+
+	// Closes the doorways along every row (or column) of the cells: the
+	// gaps of at most maxDoor pixels between two runs of wall longer than
+	// minRun, so that the section of a wall crossing the line does not
+	// count as a wall along it
+	void closeDoorways(std::vector<uint8_t>& cells, int width, int height, bool columns,
+					   int maxDoor, int minRun) {
+		int lines = columns ? width : height, length = columns ? height : width;
+		auto at = [&](int line, int i) -> uint8_t& {
+			return columns ? cells[width * i + line] : cells[width * line + i];
+		};
+		for (int line = 0; line < lines; line++) {
+			int runStart = -1, lastRunStart = -1, lastRunEnd = -1;
+			for (int i = 0; i <= length; i++) {
+				bool wall = i < length && at(line, i) == MAP_WALL;
+				if (wall && runStart < 0) {
+					runStart = i;
+				} else if (!wall && runStart >= 0) {
+					if (i - runStart > minRun && lastRunEnd >= 0 &&
+						lastRunEnd - lastRunStart > minRun && runStart - lastRunEnd <= maxDoor) {
+						for (int j = lastRunEnd; j < runStart; j++) {
+							if (at(line, j) == MAP_OPEN) {
+								at(line, j) = columns ? MAP_COLUMN_DOOR : MAP_ROW_DOOR;
+							}
+						}
+					}
+					lastRunStart = runStart;
+					lastRunEnd = i;
+					runStart = -1;
+				}
+			}
+		}
+	}
+
+	// The rooms are the connected open areas of the map (black is wall)
+	// once the doorways are closed, so the floor plan can have wings of any
+	// shape; the painting regions of pixel_map are open and lie in the room
+	// they hang in. Every wall and doorway pixel then goes to the nearest
+	// room, so that a room reaches to the middle of its walls, and each
+	// doorway becomes a portal between the rooms on its two sides.
+	void buildRooms() {
+		int x0 = stationMapWidth, y0 = stationMapHeight, x1 = -1, y1 = -1;
+		for (int y = 0; y < stationMapHeight; y++) {
+			for (int x = 0; x < stationMapWidth; x++) {
+				if (stationMap[stationMapWidth * y + x] == 0) {
+					x0 = std::min(x0, x); x1 = std::max(x1, x);
+					y0 = std::min(y0, y); y1 = std::max(y1, y);
+				}
+			}
+		}
+		if (x1 < 0) {
+			return;
+		}
+		int width = x1 - x0 + 1, height = y1 - y0 + 1;
+		std::vector<uint8_t> cells(width * height);
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				cells[width * y + x] = stationMap[stationMapWidth * (y0 + y) + x0 + x] == 0 ?
+									   MAP_WALL : MAP_OPEN;
+			}
+		}
+
+		// Wall thickness: the most common length of the wall runs along the
+		// rows, most of them crossing vertical walls
+		std::vector<int> runLengths(width + 1, 0);
+		for (int y = 0; y < height; y++) {
+			int run = 0;
+			for (int x = 0; x <= width; x++) {
+				if (x < width && cells[width * y + x] == MAP_WALL) {
+					run++;
+				} else if (run > 0) {
+					runLengths[run]++;
+					run = 0;
+				}
+			}
+		}
+		int thickness = static_cast<int>(std::max_element(runLengths.begin(), runLengths.end()) -
+										  runLengths.begin());
+		int maxDoor = stationMapWidth / 10;
+		closeDoorways(cells, width, height, false, maxDoor, 2 * thickness);
+		closeDoorways(cells, width, height, true, maxDoor, 2 * thickness);
+
+		// Open areas, without the specks smaller than a doorway
+		std::vector<int> labels(width * height, -1);
+		std::vector<int> pixels;
+		int minArea = maxDoor * maxDoor;
+		const int dx[4] = { 1, -1, 0, 0 }, dy[4] = { 0, 0, 1, -1 };
+		for (int start = 0; start < width * height; start++) {
+			if (cells[start] != MAP_OPEN || labels[start] != -1) {
+				continue;
+			}
+			int room = static_cast<int>(roomGraph.rooms.size());
+			pixels.assign(1, start);
+			labels[start] = room;
+			for (size_t i = 0; i < pixels.size(); i++) {
+				int x = pixels[i] % width, y = pixels[i] / width;
+				for (int n = 0; n < 4; n++) {
+					int nx = x + dx[n], ny = y + dy[n];
+					int next = width * ny + nx;
+					if (nx >= 0 && ny >= 0 && nx < width && ny < height &&
+						cells[next] == MAP_OPEN && labels[next] == -1) {
+						labels[next] = room;
+						pixels.push_back(next);
+					}
+				}
+			}
+			if ((int)pixels.size() < minArea) {
+				for (int pixel : pixels) {
+					labels[pixel] = -2;
+				}
+			} else {
+				roomGraph.rooms.push_back(Room());
+			}
+		}
+		if (roomGraph.rooms.empty()) {
+			return;
+		}
+
+		// Portals, across the middle of each doorway, between the first
+		// rooms found on its two sides
+		std::vector<bool> seen(width * height, false);
+		for (int start = 0; start < width * height; start++) {
+			uint8_t door = cells[start];
+			if ((door != MAP_ROW_DOOR && door != MAP_COLUMN_DOOR) || seen[start]) {
+				continue;
+			}
+			int dx0 = width, dy0 = height, dx1 = -1, dy1 = -1;
+			pixels.assign(1, start);
+			seen[start] = true;
+			for (size_t i = 0; i < pixels.size(); i++) {
+				int x = pixels[i] % width, y = pixels[i] / width;
+				dx0 = std::min(dx0, x); dx1 = std::max(dx1, x);
+				dy0 = std::min(dy0, y); dy1 = std::max(dy1, y);
+				for (int n = 0; n < 4; n++) {
+					int nx = x + dx[n], ny = y + dy[n];
+					int next = width * ny + nx;
+					if (nx >= 0 && ny >= 0 && nx < width && ny < height &&
+						cells[next] == door && !seen[next]) {
+						seen[next] = true;
+						pixels.push_back(next);
+					}
+				}
+			}
+			bool row = door == MAP_ROW_DOOR;
+			auto roomFrom = [&](int x, int y, int stepX, int stepY) {
+				for (int step = 0; step <= 2 * thickness; step++, x += stepX, y += stepY) {
+					if (x < 0 || y < 0 || x >= width || y >= height) {
+						return -1;
+					}
+					if (labels[width * y + x] >= 0) {
+						return labels[width * y + x];
+					}
+				}
+				return -1;
+			};
+			int midX = (dx0 + dx1) / 2, midY = (dy0 + dy1) / 2;
+			int a = row ? roomFrom(midX, dy0 - 1, 0, -1) : roomFrom(dx0 - 1, midY, -1, 0);
+			int b = row ? roomFrom(midX, dy1 + 1, 0, 1) : roomFrom(dx1 + 1, midY, 1, 0);
+			if (a < 0 || b < 0 || a == b) {
+				continue;
+			}
+			float line = row ? y0 + (dy0 + dy1 + 1) * 0.5f : x0 + (dx0 + dx1 + 1) * 0.5f;
+			roomGraph.addPortal(a, b,
+				row ? mapToWorld(x0 + dx0, line) : mapToWorld(line, y0 + dy0),
+				row ? mapToWorld(x0 + dx1 + 1, line) : mapToWorld(line, y0 + dy1 + 1));
+		}
+
+		// Walls, doorways and specks go to the nearest room (breadth first
+		// from every room at once)
+		pixels.clear();
+		for (int pixel = 0; pixel < width * height; pixel++) {
+			if (labels[pixel] >= 0) {
+				pixels.push_back(pixel);
+			}
+		}
+		for (size_t i = 0; i < pixels.size(); i++) {
+			int x = pixels[i] % width, y = pixels[i] / width;
+			for (int n = 0; n < 4; n++) {
+				int nx = x + dx[n], ny = y + dy[n];
+				int next = width * ny + nx;
+				if (nx >= 0 && ny >= 0 && nx < width && ny < height && labels[next] < 0) {
+					labels[next] = labels[pixels[i]];
+					pixels.push_back(next);
+				}
+			}
+		}
+
+		std::vector<glm::ivec4> extents(roomGraph.rooms.size(), glm::ivec4(width, height, -1, -1));
+		for (int y = 0; y < height; y++) {
+			for (int x = 0; x < width; x++) {
+				glm::ivec4& e = extents[labels[width * y + x]];
+				e = glm::ivec4(std::min(e.x, x), std::min(e.y, y), std::max(e.z, x), std::max(e.w, y));
+			}
+		}
+		for (size_t r = 0; r < roomGraph.rooms.size(); r++) {
+			roomGraph.rooms[r].boundsMin = mapToWorld(x0 + extents[r].x, y0 + extents[r].y);
+			roomGraph.rooms[r].boundsMax = mapToWorld(x0 + extents[r].z + 1, y0 + extents[r].w + 1);
+		}
+		roomGraph.cells = std::move(labels);
+		roomGraph.cellColumns = width;
+		roomGraph.cellRows = height;
+		roomGraph.cellOrigin = mapToWorld(x0, y0);
+		roomGraph.cellSize = mapToWorld(x0 + 1, y0 + 1) - roomGraph.cellOrigin;
+		std::cout << "Rooms: " << roomGraph.rooms.size() << ", portals: "
+				  << roomGraph.portals.size() << "\n";
+	}
+
+	// Runs on the worker decoding the museum, before its upload
+	void splitMuseum() {
+		if (roomGraph.rooms.empty()) {
+			return;
+		}
+		roomGraph.floorY = M1.boundsMin.y;
+		roomGraph.ceilingY = M1.boundsMax.y;
+		std::vector<uint32_t> sorted;
+		roomGraph.splitIndices(static_cast<const Vertex*>(M1.vertexSource()),
+							   static_cast<const uint32_t*>(M1.indexSource()), M1.indexCount, sorted);
+		M1.indices = std::move(sorted);
 	}
 
 	bool canStepPoint(float x, float y) {
@@ -854,19 +1217,31 @@ class MyProject : public BaseProject {
 
 
 	// Skybox aux functions
-	void createCubicTextureImage(const char* const FName[6], Texture& TD) {
-		int texWidth, texHeight, texChannels;
-		stbi_uc* pixels[6];
+	stbi_uc* skyBoxPixels[6];
+	int skyBoxFaceWidth[6], skyBoxFaceHeight[6];
+
+	void decodeCubeFace(int i) {
+		int texChannels;
+		skyBoxPixels[i] = stbi_load(SkyBoxToLoad.TextureFile[i], &skyBoxFaceWidth[i],
+			&skyBoxFaceHeight[i], &texChannels, STBI_rgb_alpha);
+		if (!skyBoxPixels[i]) {
+			std::cout << SkyBoxToLoad.TextureFile[i] << "\n";
+			throw std::runtime_error("failed to load texture image!");
+		}
+	}
+
+	void createCubicTextureImage(Texture& TD) {
+		stbi_uc** pixels = skyBoxPixels;
+		int texWidth = skyBoxFaceWidth[0];
+		int texHeight = skyBoxFaceHeight[0];
 
 		for (int i = 0; i < 6; i++) {
-			pixels[i] = stbi_load(FName[i], &texWidth, &texHeight,
-				&texChannels, STBI_rgb_alpha);
-			if (!pixels[i]) {
-				std::cout << FName[i]<< "\n";
-				throw std::runtime_error("failed to load texture image!");
+			if (skyBoxFaceWidth[i] != texWidth || skyBoxFaceHeight[i] != texHeight) {
+				std::cout << SkyBoxToLoad.TextureFile[i] << "\n";
+				throw std::runtime_error("skybox faces must have the same size!");
 			}
-			std::cout << FName[i] << " -> size: " << texWidth
-				<< "x" << texHeight << ", ch: " << texChannels << "\n";
+			std::cout << SkyBoxToLoad.TextureFile[i] << " -> size: " << texWidth
+				<< "x" << texHeight << "\n";
 		}
 
 		VkDeviceSize imageSize = texWidth * texHeight * 4;
@@ -875,18 +1250,15 @@ class MyProject : public BaseProject {
 			std::log2(std::max(texWidth, texHeight)))) + 1;
 
 		VkBuffer stagingBuffer;
-		VkDeviceMemory stagingBufferMemory;
+		Allocation stagingBufferMemory;
 
 		createBuffer(totalImageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 			stagingBuffer, stagingBufferMemory);
-		void* data;
-		vkMapMemory(device, stagingBufferMemory, 0, totalImageSize, 0, &data);
 		for (int i = 0; i < 6; i++) {
-			memcpy(static_cast<char*>(data) + imageSize * i, pixels[i], static_cast<size_t>(imageSize));
+			memcpy(static_cast<char*>(stagingBufferMemory.mapped) + imageSize * i, pixels[i], static_cast<size_t>(imageSize));
 		}
-		vkUnmapMemory(device, stagingBufferMemory);
 
 		for (int i = 0; i < 6; i++) {
 			stbi_image_free(pixels[i]);
@@ -903,11 +1275,11 @@ class MyProject : public BaseProject {
 			texWidth, texHeight, TD.mipLevels, 6);
 
 		vkDestroyBuffer(device, stagingBuffer, nullptr);
-		vkFreeMemory(device, stagingBufferMemory, nullptr);
+		allocator.free(stagingBufferMemory);
 	}
 
 	void createSkyBoxImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkImage& image,
-		VkDeviceMemory& imageMemory) {
+		Allocation& imageMemory) {
 		VkImageCreateInfo imageInfo{};
 		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 		imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -933,17 +1305,9 @@ class MyProject : public BaseProject {
 		VkMemoryRequirements memRequirements;
 		vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-		if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) !=
-			VK_SUCCESS) {
-			throw std::runtime_error("failed to allocate image memory!");
-		}
-
-		vkBindImageMemory(device, image, imageMemory, 0);
+		imageMemory = allocator.allocate(memRequirements,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+		vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
 	}
 
 	void createSkyBoxImageView(Texture& TD) {
@@ -954,88 +1318,26 @@ class MyProject : public BaseProject {
 			VK_IMAGE_VIEW_TYPE_CUBE, 6);
 	}
 
-	void createSkyBoxDescriptorSets() {
-		std::vector<VkDescriptorSetLayout> layouts(swapChainImages.size(),
-			skyBoxDSL.descriptorSetLayout);
-		VkDescriptorSetAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-		allocInfo.descriptorPool = descriptorPool;
-		allocInfo.descriptorSetCount = static_cast<uint32_t>(swapChainImages.size());
-		allocInfo.pSetLayouts = layouts.data();
-
-		SkyBoxDescriptorSets.resize(swapChainImages.size());
-
-		VkResult result = vkAllocateDescriptorSets(device, &allocInfo,
-			SkyBoxDescriptorSets.data());
-		if (result != VK_SUCCESS) {
-			PrintVkError(result);
-			throw std::runtime_error("failed to allocate Skybox descriptor sets!");
-		}
-
-		for (size_t k = 0; k < swapChainImages.size(); k++) {
-			VkDescriptorBufferInfo bufferInfo{};
-			bufferInfo.buffer = SkyBoxUniformBuffers[k];
-			bufferInfo.offset = 0;
-			bufferInfo.range = sizeof(UniformBufferObject);
-
-			VkDescriptorImageInfo imageInfo{};
-			imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-			imageInfo.imageView = skyBoxTexture.textureImageView;
-			imageInfo.sampler = skyBoxTexture.textureSampler;
-
-			std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
-			descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			descriptorWrites[0].dstSet = SkyBoxDescriptorSets[k];
-			descriptorWrites[0].dstBinding = 0;
-			descriptorWrites[0].dstArrayElement = 0;
-			descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			descriptorWrites[0].descriptorCount = 1;
-			descriptorWrites[0].pBufferInfo = &bufferInfo;
-
-			descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			descriptorWrites[1].dstSet = SkyBoxDescriptorSets[k];
-			descriptorWrites[1].dstBinding = 1;
-			descriptorWrites[1].dstArrayElement = 0;
-			descriptorWrites[1].descriptorType =
-				VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			descriptorWrites[1].descriptorCount = 1;
-			descriptorWrites[1].pImageInfo = &imageInfo;
-
-			vkUpdateDescriptorSets(device,
-				static_cast<uint32_t>(descriptorWrites.size()),
-				descriptorWrites.data(), 0, nullptr);
-		}
-	}
-
+	// Expects the skybox model and the 6 faces to be already decoded
 	void loadSkyBox() {
-		skyBox.init(this, SkyBoxToLoad.ObjFile);
-
-		createCubicTextureImage(SkyBoxToLoad.TextureFile, skyBoxTexture);
+		createCubicTextureImage(skyBoxTexture);
 		createSkyBoxImageView(skyBoxTexture);
 		skyBoxTexture.BP = this;
 		skyBoxTexture.createTextureSampler();
 
-		// Skybox createUniformBuffers 
-		VkDeviceSize bufferSize = sizeof(UniformBufferObjectSkybox);
-		SkyBoxUniformBuffers.resize(swapChainImages.size());
-		SkyBoxUniformBuffersMemory.resize(swapChainImages.size());
-
-		for (size_t i = 0; i < swapChainImages.size(); i++) {
-			createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-				VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-				SkyBoxUniformBuffers[i], SkyBoxUniformBuffersMemory[i]);
-		}
-
 		// Skybox descriptor sets
-		createSkyBoxDescriptorSets();
+		skyBoxDS.init(this, &skyBoxDSL, {
+				{0, UNIFORM, sizeof(UniformBufferObjectSkybox), nullptr},
+				{1, TEXTURE, 0, &skyBoxTexture}
+			});
 	}
 };
 
 
 // This is the main: probably you do not need to touch this!
-int main() {
+int main(int argc, char **argv) {
     MyProject app;
+    app.parseArguments(argc, argv);
 
     try {
         app.run();
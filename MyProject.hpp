@@ -1,5 +1,16 @@
 // This has been adapted from the Vulkan tutorial
 
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
@@ -8,25 +19,40 @@
 #include <cstdlib>
 #include <vector>
 #include <cstring>
+#include <cstdio>
 #include <optional>
 #include <set>
 #include <cstdint>
 #include <algorithm>
 #include <fstream>
 #include <array>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <memory>
 
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_ENABLE_EXPERIMENTAL
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtx/hash.hpp>
+
+#include <unordered_map>
 
 #include <chrono>
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
 
+#include <json.hpp>
+
 // New in Lesson 23 - to load images
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
@@ -85,8 +111,63 @@ struct Vertex {
 						
 		return attributeDescriptions;
 	}
+
+	// Instanced pipelines add binding 1, advanced once per instance, with
+	// the InstanceData model matrix in locations 3 to 6 (one per column)
+	static std::array<VkVertexInputBindingDescription, 2> getInstancedBindingDescriptions();
+	static std::array<VkVertexInputAttributeDescription, 7> getInstancedAttributeDescriptions();
+
+	// Used to deduplicate the face corners in Model::loadModel
+	bool operator==(const Vertex& other) const {
+		return pos == other.pos && norm == other.norm &&
+			   texCoord == other.texCoord;
+	}
+};
+
+struct InstanceData {
+	glm::mat4 model;
 };
 
+std::array<VkVertexInputBindingDescription, 2> Vertex::getInstancedBindingDescriptions() {
+	std::array<VkVertexInputBindingDescription, 2> bindingDescriptions{};
+	bindingDescriptions[0] = getBindingDescription();
+
+	bindingDescriptions[1].binding = 1;
+	bindingDescriptions[1].stride = sizeof(InstanceData);
+	bindingDescriptions[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+	return bindingDescriptions;
+}
+
+std::array<VkVertexInputAttributeDescription, 7> Vertex::getInstancedAttributeDescriptions() {
+	std::array<VkVertexInputAttributeDescription, 7> attributeDescriptions{};
+	auto vertexAttributes = getAttributeDescriptions();
+	for (int i = 0; i < 3; i++) {
+		attributeDescriptions[i] = vertexAttributes[i];
+	}
+
+	for (uint32_t c = 0; c < 4; c++) {
+		attributeDescriptions[3 + c].binding = 1;
+		attributeDescriptions[3 + c].location = 3 + c;
+		attributeDescriptions[3 + c].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+		attributeDescriptions[3 + c].offset = offsetof(InstanceData, model) +
+											  c * sizeof(glm::vec4);
+	}
+
+	return attributeDescriptions;
+}
+
+namespace std {
+	template<> struct hash<Vertex> {
+		size_t operator()(Vertex const& vertex) const {
+			size_t seed = hash<glm::vec3>()(vertex.pos);
+			seed ^= hash<glm::vec3>()(vertex.norm) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+			seed ^= hash<glm::vec2>()(vertex.texCoord) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+			return seed;
+		}
+	};
+}
+
 
 // Lesson 13
 struct QueueFamilyIndices {
@@ -179,21 +260,444 @@ void PrintVkError( VkResult result ) {
 	std::cout << "Error: " << result << ", " << meaning << "\n";
 }
 
+// Read-only memory mapping of a whole file (mesh cache, OBJ hashing)
+struct MappedFile {
+	const char *data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE fileHandle = INVALID_HANDLE_VALUE;
+	HANDLE mappingHandle = nullptr;
+#else
+	int fd = -1;
+#endif
+
+	bool open(const std::string& path);
+	void close();
+};
+
+// FNV-1a, used to detect stale caches on disk
+uint64_t hashBytes(const void *data, size_t size) {
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Binary mesh cache, written beside the OBJ as <file>.meshcache
+// Layout: MeshCacheHeader | Vertex[vertexCount] | uint32_t[indexCount] |
+//         Meshlet[meshletCount]
+// indexCount covers every level of detail, stored one after the other.
+const uint32_t MESH_CACHE_MAGIC = 0x4853454D; // "MESH"
+const uint32_t MESH_CACHE_VERSION = 4;
+const uint32_t MAX_MODEL_LODS = 5;
+
+struct MeshCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vertexSize;	// sizeof(Vertex) when the cache was written
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	float boundsRadius;		// around the center of the box
+	uint64_t sourceHash;	// FNV-1a of the OBJ contents
+	float boundsMin[3];
+	float boundsMax[3];
+	uint32_t lodCount;		// 0 when no simplified level was kept, even if requested
+	uint32_t lodIndexCount[MAX_MODEL_LODS];
+	float lodError[MAX_MODEL_LODS];
+	uint32_t meshletCount;
+	uint32_t buildFlags;	// MESH_CACHE_* options the cache was built with
+};
+
+const uint32_t MESH_CACHE_LODS = 1;
+const uint32_t MESH_CACHE_MESHLETS = 2;
+
+// pipeline_cache.bin starts with this header, followed by the data returned
+// by vkGetPipelineCacheData. The cache is thrown away when it was written
+// by another device or driver version.
+const uint32_t PIPELINE_CACHE_MAGIC = 0x45504950; // "PIPE"
+const uint32_t PIPELINE_CACHE_VERSION = 1;
+
+struct PipelineCacheFileHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	uint32_t reserved;
+	uint64_t dataSize;
+	uint64_t dataHash;		// FNV-1a of the cache data
+};
+
+// CPU zones written as a Chrome trace (--cpu-trace FILE, open it in
+// chrome://tracing or Perfetto). Every thread appends to a buffer of its
+// own, so recording takes no lock; the buffers are only read by write(),
+// once the other threads are done. When disabled a zone costs one test.
+struct CpuProfiler {
+	struct Event {
+		const char *name;		// string literal
+		std::string detail;		// shown as args.detail, usually empty
+		uint64_t startNs;
+		uint64_t durationNs;
+	};
+	struct ThreadBuffer {
+		uint32_t id;
+		std::string name;
+		std::vector<Event> events;
+	};
+	static constexpr size_t MAX_EVENTS_PER_THREAD = 1 << 20;
+
+	bool enabled = false;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::mutex mutex;				// only taken the first time a thread records
+	std::vector<std::unique_ptr<ThreadBuffer>> threads;
+
+	uint64_t nowNs() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count();
+	}
+	ThreadBuffer *threadBuffer();
+	void setThreadName(const std::string& name);
+	void add(const char *name, std::string detail, uint64_t startNs, uint64_t endNs);
+	void write(const std::string& file);
+};
+
+CpuProfiler cpuProfiler;
+
+struct CpuProfileScope {
+	const char *name;
+	std::string detail;
+	uint64_t startNs = 0;
+	bool active;
+
+	CpuProfileScope(const char *zone) : name(zone), active(cpuProfiler.enabled) {
+		if (active) {
+			startNs = cpuProfiler.nowNs();
+		}
+	}
+	CpuProfileScope(const char *zone, const std::string& zoneDetail)
+			: name(zone), active(cpuProfiler.enabled) {
+		if (active) {
+			detail = zoneDetail;
+			startNs = cpuProfiler.nowNs();
+		}
+	}
+	~CpuProfileScope() {
+		if (active) {
+			cpuProfiler.add(name, std::move(detail), startNs, cpuProfiler.nowNs());
+		}
+	}
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+// Times the rest of the enclosing scope as a zone called name
+#define PROFILE_SCOPE(name) CpuProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+// Same, with a detail string (e.g. the asset) shown in the trace
+#define PROFILE_SCOPE_DETAIL(name, detail) \
+	CpuProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name, detail)
+
+// Worker threads used to run CPU work (asset decoding) off the main thread.
+// Vulkan calls stay on the main thread.
+struct JobSystem {
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> jobs;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	void init(unsigned int threadCount);
+	std::future<void> submit(std::function<void()> job);
+	unsigned int size() const { return static_cast<unsigned int>(workers.size()); }
+	void cleanup();
+};
+
+// Frame times collected by BaseProject::mainLoop for benchmarks
+struct FrameStats {
+	std::vector<float> frameMs;
+
+	void add(float ms) { frameMs.push_back(ms); }
+	size_t count() const { return frameMs.size(); }
+	void print(const std::string& label, size_t warmup) const;
+};
+
+// Input recording (--record-input) and replay (--replay): the camera at
+// the start of the frame and every key, button and cursor position the
+// application read during it. The file is an InputRecordHeader followed
+// by frameCount InputFrames.
+const uint32_t INPUT_RECORD_MAGIC = 0x54504E49; // "INPT"
+const uint32_t INPUT_RECORD_VERSION = 1;
+
+// Time step of a replayed frame, whatever its real duration
+const float REPLAY_TIMESTEP = 1.0f / 60.0f;
+
+struct InputRecordHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t frameSize;		// sizeof(InputFrame) when the file was written
+	uint32_t frameCount;
+};
+
+struct InputFrame {
+	glm::vec3 camPos = glm::vec3(0.0f);
+	glm::vec3 camAng = glm::vec3(0.0f);
+	double cursorX = 0.0, cursorY = 0.0;
+	uint32_t mouseButtons = 0;
+	uint32_t reserved = 0;
+	uint64_t keys[(GLFW_KEY_LAST + 64) / 64] = {};
+
+	bool key(int k) const { return (keys[k / 64] >> (k % 64)) & 1; }
+	void setKey(int k) { keys[k / 64] |= 1ULL << (k % 64); }
+};
+
 class BaseProject;
 
+// Sub-range of a GpuAllocator block. HOST_VISIBLE blocks are persistently
+// mapped, so mapped points straight at this range.
+struct Allocation {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	void *mapped = nullptr;
+
+	// What goes back to the free list: the range including alignment padding
+	int pool = -1;
+	int block = -1;
+	VkDeviceSize rangeOffset = 0;
+	VkDeviceSize rangeSize = 0;
+};
+
+// Block based sub-allocator, replacing one vkAllocateMemory per resource.
+// There is a list of blocks per memory type, with buffers (linear) and
+// images (optimal tiling) kept in separate blocks so that neighbours never
+// violate bufferImageGranularity. Free space is a first-fit free list,
+// coalesced when ranges are returned.
+struct GpuAllocator {
+	struct Range {
+		VkDeviceSize offset;
+		VkDeviceSize size;
+	};
+	struct Block {
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkDeviceSize size = 0;
+		void *mapped = nullptr;
+		bool dedicated = false;
+		uint32_t allocationCount = 0;
+		std::vector<Range> freeRanges;	// sorted by offset
+	};
+
+	BaseProject *BP;
+	VkPhysicalDeviceMemoryProperties memProperties;
+	VkDeviceSize deviceBlockSize = 64 * 1024 * 1024;
+	VkDeviceSize hostBlockSize = 16 * 1024 * 1024;
+	// pools[memoryType * 2 + (linear ? 0 : 1)]
+	std::vector<std::vector<Block>> pools;
+	std::mutex mutex;
+
+	// Stats
+	VkDeviceSize bytesUsed = 0;		// requested by the resources
+	VkDeviceSize bytesWasted = 0;	// alignment padding
+	VkDeviceSize bytesReserved = 0;	// size of all live blocks
+	uint32_t blockCount = 0;
+	uint32_t allocationCount = 0;
+
+	void init(BaseProject *bp);
+	Allocation allocate(const VkMemoryRequirements& req,
+						VkMemoryPropertyFlags properties, bool linear);
+	void free(Allocation& alloc);
+	void printStats();
+	void cleanup();
+
+	private:
+	VkDeviceSize blockSizeFor(uint32_t memoryType);
+	bool suballocate(Block& block, const VkMemoryRequirements& req,
+					 Allocation& alloc);
+};
+
+// Per-frame uniform storage: one persistently mapped buffer split in one
+// region per swapchain image. Every UNIFORM element of a DescriptorSet owns
+// a fixed slot in all regions and is bound as UNIFORM_BUFFER_DYNAMIC, so
+// updating a uniform is a plain memcpy and the dynamic offset picks the frame.
+// Slots given back by release() are reused by the next reserve() that fits.
+struct UniformRing {
+	BaseProject *BP;
+	VkBuffer buffer;
+	Allocation memory;
+	VkDeviceSize alignment;		// minUniformBufferOffsetAlignment
+	VkDeviceSize frameSize;		// size of one region
+	VkDeviceSize used = 0;		// end of the last slot in every region
+	std::vector<GpuAllocator::Range> freeSlots;	// released below used, sorted
+	uint32_t frameCount;
+
+	void init(BaseProject *bp, VkDeviceSize size, uint32_t frames);
+	void resize(uint32_t frames);
+	uint32_t reserve(VkDeviceSize size);
+	void release(uint32_t slot, VkDeviceSize size);
+	uint32_t offset(uint32_t currentImage, uint32_t slot);
+	void *data(uint32_t currentImage, uint32_t slot);
+	void cleanup();
+};
+
+// Indirect draw commands written by the CPU while recording, laid out like
+// UniformRing: one persistently mapped buffer with a region per swapchain
+// image. Recording threads take their commands from the region of the
+// image being recorded with an atomic add; begin() empties it.
+struct IndirectRing {
+	BaseProject *BP;
+	VkBuffer buffer = VK_NULL_HANDLE;
+	Allocation memory;
+	uint32_t frameCommands;		// commands in one region
+	uint32_t frameCount;
+	std::atomic<uint32_t> used{0};
+
+	void init(BaseProject *bp, uint32_t commands, uint32_t frames);
+	void begin();
+	// Returns nullptr when the region is full
+	VkDrawIndexedIndirectCommand *reserve(uint32_t currentImage, uint32_t count,
+										  VkDeviceSize& offset);
+	void cleanup();
+};
+
+// Decode/upload times of one asset, in ms since AssetLoader::begin
+struct AssetTiming {
+	std::string name;
+	float decodeStart = 0.0f, decodeEnd = 0.0f;
+	float uploadStart = 0.0f, uploadEnd = 0.0f;
+};
+
+// Runs the decode step of every asset on the job system, while the main
+// thread records the GPU uploads in submission order as decodes complete.
+struct AssetLoader {
+	struct Entry {
+		AssetTiming timing;
+		std::function<void()> upload;
+		std::future<void> decoded;
+	};
+
+	BaseProject *BP;
+	std::deque<Entry> entries;	// deque: workers keep pointers to their timing
+	std::chrono::high_resolution_clock::time_point start;
+
+	void begin(BaseProject *bp);
+	// decode runs on a worker, upload on the main thread (either can be empty)
+	void add(const std::string& name, std::function<void()> decode,
+			 std::function<void()> upload);
+	void finish();
+	float elapsedMs();
+};
+
+// One level of detail: a range of the model index buffer, over the same
+// vertices as the full mesh. error is how far (in model units) the level
+// may stray from the full mesh.
+struct ModelLod {
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	float error;
+};
+
+// A cluster of neighbouring triangles of the full mesh, drawn as one index
+// range. center and radius bound it. Every triangle faces away from a
+// viewer at p when dot(center - p, coneAxis) >= coneCutoff * |center - p| + radius
+// (coneCutoff 1: the normals spread too much, never back facing).
+const uint32_t MESHLET_MAX_VERTICES = 64;
+const uint32_t MESHLET_MAX_TRIANGLES = 124;
+
+struct Meshlet {
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	glm::vec3 center;
+	float radius;
+	glm::vec3 coneAxis;
+	float coneCutoff;
+};
+
+// Quadric error metric simplifier (Garland-Heckbert). Collapses edges onto
+// one of their endpoints until the triangle list is down to targetIndexCount
+// indices or nothing can be collapsed any more, and returns the new list:
+// the vertices are not touched, so every level shares the vertex buffer.
+// Vertices on open borders and on attribute seams (several vertices at the
+// same position) never move, which keeps the silhouette and the UVs.
+// error receives the square root of the largest collapse cost, the RMS
+// distance of the worst moved vertex from the planes it used to touch.
+std::vector<uint32_t> simplifyMesh(const Vertex *vertices, size_t vertexCount,
+								   const uint32_t *indices, size_t indexCount,
+								   size_t targetIndexCount, float& error);
+
+struct MeshRegistry;
+
 struct Model {
 	BaseProject *BP;
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
 	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
+	Allocation vertexBufferMemory;
 	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
+	Allocation indexBufferMemory;
+
+	// Deduplication report (filled by loadModel)
+	size_t rawVertexCount = 0;
+	float dedupMs = 0.0f;
+
+	// Filled both from the OBJ and from the mesh cache.
+	// On a cache hit vertices/indices stay empty and the buffers are
+	// filled straight from the mapped cache file.
+	uint32_t vertexCount = 0;
+	uint32_t indexCount = 0;
+	glm::vec3 boundsMin = glm::vec3(0.0f);
+	glm::vec3 boundsMax = glm::vec3(0.0f);
+	float boundsRadius = 0.0f;	// sphere centered in the box, tighter than its half diagonal
+	MappedFile meshCache;
+
+	// Levels of detail, built by decode() when generateLods is set: lods[0]
+	// is the full mesh (indexCount indices), every other level about half of
+	// the one before, appended after it in the index buffer. Empty when the
+	// model has a single level.
+	bool generateLods = false;
+	std::vector<ModelLod> lods;
+
+	// Meshlets of the full mesh, built by decode() when generateMeshlets is
+	// set: the first indexCount indices are reordered so that each meshlet
+	// is a contiguous range (see BaseProject::recordMeshletDraws)
+	bool generateMeshlets = false;
+	std::vector<Meshlet> meshlets;
+
+	// Static meshes live in DEVICE_LOCAL memory filled through a staging
+	// buffer. Set before upload() to keep a HOST_VISIBLE buffer instead
+	// (meshes rewritten by the CPU).
+	bool dynamic = false;
+
+	// Set before upload() (static meshes only) to pack the model in the
+	// shared buffers of registry instead of its own: vertexBuffer and
+	// indexBuffer are then those of the registry, valid after its upload(),
+	// and the vertices and indices of the model start at vertexOffset and
+	// baseIndex (index values stay local to the model).
+	MeshRegistry *registry = nullptr;
+	uint32_t registeredMesh = 0;
+	int32_t vertexOffset = 0;
+	uint32_t baseIndex = 0;
 	
 	void loadModel(std::string file);
+	void computeBounds();
+	void buildLods();
+	void buildMeshlets();
+	uint32_t totalIndexCount() const;
+	uint32_t cacheBuildFlags() const;
+	const ModelLod lod(int level) const;
+	bool loadMeshCache(const std::string& file, uint64_t sourceHash);
+	void writeMeshCache(const std::string& file, uint64_t sourceHash);
+	static uint64_t hashFile(const std::string& file);
+	const void *vertexSource();
+	const void *indexSource();
 	void createIndexBuffer();
 	void createVertexBuffer();
 
+	// decode() is CPU only and can run on a worker thread,
+	// upload() creates the Vulkan buffers (main thread)
+	void decode(std::string file);
+	void upload(BaseProject *bp);
 	void init(BaseProject *bp, std::string file);
 
 	void cleanup();
@@ -203,15 +707,21 @@ struct Texture {
 	BaseProject *BP;
 	uint32_t mipLevels;
 	VkImage textureImage;
-	VkDeviceMemory textureImageMemory;
+	Allocation textureImageMemory;
 	VkImageView textureImageView;
 	VkSampler textureSampler;
 
-	void createTextureImage(std::string file);
+	// Decoded RGBA pixels, released once uploaded
+	stbi_uc *pixels = nullptr;
+	int texWidth = 0, texHeight = 0;
+
+	void createTextureImage();
 	void createTextureImageView();
 	void createTextureSampler();
 
-
+	// Same split as Model: decode() on a worker, upload() on the main thread
+	void decode(std::string file);
+	void upload(BaseProject *bp);
 	void init(BaseProject *bp, std::string file);
 	void cleanup();
 };
@@ -230,7 +740,6 @@ struct DescriptorSetLayout {
  	VkDescriptorSetLayout descriptorSetLayout;
  	
  	void init(BaseProject *bp, std::vector<DescriptorSetLayoutBinding> B);
-	void initSkybox(BaseProject* bp);
 	void cleanup();
 };
 
@@ -240,12 +749,25 @@ struct Pipeline {
   	VkPipelineLayout pipelineLayout;
   	
 	//USA METODI STATIC DI VERTEX! Non possiamo cambiare i vari attributi 
+	// (instanced: uses Vertex::getInstanced...Descriptions)
   	void init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
-  			  std::vector<DescriptorSetLayout *> D, int pushConstantRangeCount);
+  			  std::vector<DescriptorSetLayout *> D, int pushConstantRangeCount,
+  			  bool instanced);
 
   	VkShaderModule createShaderModule(const std::vector<char>& code);
   	static std::vector<char> readFile(const std::string& filename);  	
+	void rebuild();
 	void cleanup();
+	int compatibleSets(const Pipeline& other) const;
+
+	int profilerSection = 0;	// GpuProfiler section of its draws
+
+	// What init was called with, for rebuild()
+	std::string vertShaderFile;
+	std::string fragShaderFile;
+	std::vector<DescriptorSetLayout *> setLayouts;
+	int pushConstantRanges = 0;
+	bool instancedInput = false;
 };
 
 enum DescriptorSetElementType {UNIFORM, TEXTURE, TEXTURE_ARRAY, SAMPLER};
@@ -257,17 +779,396 @@ struct DescriptorSetElement {
 	Texture *tex;
 };
 
+// UNIFORM elements live in the BaseProject uniform ring: their layout
+// bindings must be VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC and the set has
+// to be bound with bind() so that the right frame offsets are passed.
+// Every set is listed in BaseProject::descriptorSets until cleanup(), so
+// that allocateSets() can give it one set per image again when the
+// swapchain image count changes.
 struct DescriptorSet {
-	BaseProject *BP;
+	BaseProject *BP = nullptr;
 
-	std::vector<std::vector<VkBuffer>> uniformBuffers;
-	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemory;
 	std::vector<VkDescriptorSet> descriptorSets;
-	
-	std::vector<bool> toFree;
+
+	// Ring slot and size of every element (only used by UNIFORMs, size 0
+	// otherwise) and the dynamic offsets of each swapchain image, in
+	// binding order
+	std::vector<uint32_t> uniformSlots;
+	std::vector<VkDeviceSize> uniformSizes;
+	std::vector<std::vector<uint32_t>> dynamicOffsets;
 
 	void init(BaseProject *bp, DescriptorSetLayout *L,
 		std::vector<DescriptorSetElement> E);
+	void allocateSets();
+	void *uniformData(int element, int currentImage);
+	void bind(VkCommandBuffer commandBuffer, Pipeline &P, int setId,
+			  int currentImage);
+	void cleanup();
+
+	// What init was called with, for allocateSets()
+	DescriptorSetLayout *layout = nullptr;
+	std::vector<DescriptorSetElement> elements;
+};
+
+// Per-instance data of an instanced draw, uploaded once to DEVICE_LOCAL
+// memory (bound at binding 1 of instanced pipelines)
+struct InstanceBuffer {
+	BaseProject *BP;
+	VkBuffer buffer;
+	Allocation bufferMemory;
+	uint32_t instanceCount = 0;
+	std::vector<InstanceData> instances;	// CPU copy, for culling
+
+	void init(BaseProject *bp, const std::vector<InstanceData>& instances);
+	void cleanup();
+};
+
+// One indexed draw of a Model: its pipeline and the descriptor sets bound
+// at set 0, 1, ... setCount - 1. With instances set it draws every instance
+// of the buffer (the pipeline must be instanced).
+// world is the model matrix the bounds of the model are culled with (times
+// the instance matrices, if any); draws without it are never culled.
+// A draw in a room (see RoomGraph) is skipped when the room is not visible.
+// indexCount 0 draws the full mesh of the model (its first level of
+// detail), otherwise the range starting at firstIndex (see BaseProject::lodRange).
+// With gpuObjects set the item has no model: it draws the objects of that
+// GpuCuller, its sets being bound before the culler's own.
+struct GpuCuller;
+
+const int MAX_DRAW_SETS = 4;
+struct DrawItem {
+	Pipeline *pipeline;
+	Model *model;
+	std::array<DescriptorSet *, MAX_DRAW_SETS> sets;
+	int setCount;
+	InstanceBuffer *instances = nullptr;
+	const glm::mat4 *world = nullptr;
+	int room = -1;
+	uint32_t firstIndex = 0;
+	uint32_t indexCount = 0;
+	GpuCuller *gpuObjects = nullptr;
+};
+
+// View frustum for culling: the left, right, bottom, top, near and far
+// planes of a view-projection matrix, normals pointing inside. They are
+// kept as a structure of arrays padded to 8 planes (the last two accept
+// everything), so every test is one branch-free loop over 8 lanes that
+// the compiler vectorizes.
+struct Frustum {
+	static constexpr int PLANES = 8;
+	alignas(32) float nx[PLANES];
+	alignas(32) float ny[PLANES];
+	alignas(32) float nz[PLANES];
+	alignas(32) float d[PLANES];
+	bool valid = false;		// until update(), everything is visible
+
+	void update(const glm::mat4& viewProj);
+	bool sphereVisible(const glm::vec3& center, float radius) const;
+	bool boxVisible(const glm::vec3& boxMin, const glm::vec3& boxMax) const;
+	bool modelVisible(const Model& model, const glm::mat4& world) const;
+};
+
+// Rooms of an interior and the portals (doorways) between them. Rooms are
+// boxes on the ground plane (x, z) that own the triangles of a model lying
+// entirely inside them, as a contiguous index range; the triangles in no
+// single room (floors or ceilings spanning rooms, door frames) are the
+// shared range, always drawn.
+// findVisible starts from the room of the camera and follows every portal
+// that is on screen, narrowing the screen rectangle to the portal at each
+// step, so only the rooms actually seen through doorways are marked.
+struct Portal {
+	int rooms[2];
+	glm::vec2 from, to;		// ends on the ground plane (x, z)
+};
+
+struct Room {
+	glm::vec2 boundsMin, boundsMax;		// (x, z), of its cells
+	std::vector<int> portals;
+	uint32_t firstIndex = 0;
+	uint32_t indexCount = 0;
+};
+
+struct RoomGraph {
+	// Closer than this to a portal the camera sees through it whatever its
+	// projection (standing in a doorway, the portal is seen edge-on)
+	static constexpr float PORTAL_MARGIN = 0.25f;
+
+	std::vector<Room> rooms;
+	std::vector<Portal> portals;
+	// Room of every cell of a grid on the ground plane (-1: none), so
+	// rooms can have any shape. Cell (0, 0) starts at cellOrigin.
+	std::vector<int> cells;
+	int cellColumns = 0, cellRows = 0;
+	glm::vec2 cellOrigin = glm::vec2(0.0f);
+	glm::vec2 cellSize = glm::vec2(1.0f);
+	float floorY = 0.0f;		// portal bottom and top
+	float ceilingY = 0.0f;
+	uint32_t sharedFirstIndex = 0;
+	uint32_t sharedIndexCount = 0;
+
+	// Result of the last findVisible (empty before the first one)
+	std::vector<bool> visible;
+	int cameraRoom = -1;		// -1: outside every room, all are visible
+	uint32_t visibleCount = 0;
+
+	void addPortal(int a, int b, const glm::vec2& from, const glm::vec2& to);
+	int roomAt(const glm::vec2& p) const;
+	int roomOf(const Model& model, const glm::mat4& world) const;
+	void splitIndices(const Vertex *vertices, const uint32_t *indices, uint32_t indexCount,
+					  std::vector<uint32_t>& sorted);
+	void findVisible(const glm::vec3& eye, const glm::mat4& viewProj);
+	// rect is the screen area (NDC min x, min y, max x, max y) room is seen through
+	void visit(int room, const glm::vec4& rect, const glm::vec3& eye,
+			   const glm::mat4& viewProj, std::vector<bool>& onPath);
+};
+
+// Static meshes packed in one vertex buffer and one index buffer, each mesh
+// a vertexOffset/firstIndex range of them, so that draws of different
+// meshes need no buffer rebinds (see BaseProject::recordDrawList). add() is
+// called by Model::upload for the models given a registry, while their
+// data is still on the CPU: it copies all the indices of the model, the
+// levels of detail following the full mesh (indexCount). upload() creates
+// the buffers once every mesh is in and hands them to the models.
+// center/radius bound the full mesh, like Model::boundsRadius.
+struct RegisteredMesh {
+	glm::vec3 center;
+	float radius;
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	int32_t vertexOffset;
+	uint32_t pad;
+};
+
+struct MeshRegistry {
+	BaseProject *BP;
+	std::vector<RegisteredMesh> meshes;
+	std::vector<Model *> models;		// waiting for the buffers
+	std::vector<Vertex> vertices;		// released by upload()
+	std::vector<uint32_t> indices;
+	VkBuffer vertexBuffer = VK_NULL_HANDLE;
+	Allocation vertexBufferMemory;
+	VkBuffer indexBuffer = VK_NULL_HANDLE;
+	Allocation indexBufferMemory;
+
+	uint32_t add(Model& model);
+	void upload(BaseProject *bp);
+	void cleanup();
+};
+
+// Orders a draw list by the state its draws need. Every draw gets a 64 bit
+// key, from the most significant bits:
+//   pipeline (8) | material (16) | mesh (16) | depth (24)
+// and the keys are radix sorted (stable, equal keys keep their order).
+// Pipelines, materials (the last descriptor set of a draw, the one that
+// changes between objects) and meshes are numbered in the order they first
+// appear, so the pipelines stay in the order the application listed them
+// (the skybox last, once the depth is filled). depth is the distance from
+// the eye to the center of the draw's bounds, or of its room, as the top
+// bits of a positive float, which sort like the float: each run of equal
+// state is drawn front to back. Draws without a world matrix get 0.
+struct RenderQueue {
+	struct Entry {
+		uint64_t key;
+		uint32_t item;
+	};
+	std::vector<Entry> entries;
+	std::vector<Entry> scratch;
+	std::vector<DrawItem> sorted;
+	std::unordered_map<const void *, uint32_t> pipelineRanks;
+	std::unordered_map<const void *, uint32_t> materialRanks;
+	std::unordered_map<const void *, uint32_t> meshRanks;
+
+	void sort(std::vector<DrawItem>& items, const glm::vec3& eye, const RoomGraph& rooms);
+	static void radixSort(std::vector<Entry>& entries, std::vector<Entry>& scratch);
+};
+
+// GPU driven drawing (--gpu-culling): every object (a registered mesh, a
+// model matrix and a texture) lives in a storage buffer. Each frame the
+// compute shader shaders/CullObjects.comp tests the objects against the
+// frustum and appends one VkDrawIndexedIndirectCommand per visible object
+// (firstInstance is the object index, read back by the vertex shader) and
+// the number of them; draw() then submits them all with a single
+// vkCmdDrawIndexedIndirectCount. The CPU work per frame does not depend on
+// the number of objects: only those moved by setObject() are copied.
+// Buffers and descriptor sets have one region per swapchain image.
+const uint32_t GPU_CULLER_MAX_TEXTURES = 16;
+
+struct GpuObject {
+	glm::mat4 model;
+	uint32_t mesh;
+	uint32_t texture;		// index in the texture list given to init()
+	uint32_t pad[2];
+};
+
+// Start of each region of the object buffer (std430, see CullObjects.comp)
+struct GpuObjectsHeader {
+	glm::vec4 planes[6];	// left, right, bottom, top, near, far: xyz normal, w distance
+	glm::mat4 viewProj;		// occlusion culling: projects the bounds on the Hi-Z pyramid
+	uint32_t objectCount;
+	uint32_t hiZReady;		// the pyramid holds the depth of an earlier frame
+	uint32_t pad[2];
+};
+
+// Start of each region of the draw buffer. drawCount and draws[] are those
+// of the early pass (the only one without occlusion culling),
+// lateDrawCount and the second half of draws[] those of the late pass.
+struct GpuDrawCounts {
+	uint32_t drawCount;
+	uint32_t lateDrawCount;
+	uint32_t occludedCount;		// still hidden after the late pass
+	uint32_t pad;
+};
+
+// Occlusion culling (--occlusion-culling) is done in two passes, on top of
+// the frustum test:
+// - early: before the render pass, the objects are tested against
+//   BaseProject::hiZ, built from the depth of the previous frame, and the
+//   visible ones are drawn with the rest of the scene. The hidden ones are
+//   flagged in the draw buffer.
+// - late: after the render pass hiZ is rebuilt from the new depth and only
+//   the flagged objects are tested again; those visible now (they were
+//   hidden by the camera motion, or moved) are drawn in a second render
+//   pass that keeps the color and depth of the first one.
+// The depth of the previous frame is seen from a slightly different
+// camera, so it can hide objects that are visible now: the late pass is
+// what makes the culling exact, one frame never misses an object.
+struct GpuCuller {
+	static constexpr uint32_t EARLY_PASS = 0;
+	static constexpr uint32_t LATE_PASS = 1;
+
+	BaseProject *BP = nullptr;
+	MeshRegistry *registry;
+	uint32_t maxObjects = 0;
+	std::vector<GpuObject> objects;
+	std::vector<std::vector<uint32_t>> dirtyObjects;	// per image, to copy by update()
+
+	VkDeviceSize objectRegionSize;
+	VkBuffer objectBuffer = VK_NULL_HANDLE;		// HOST_VISIBLE
+	Allocation objectBufferMemory;
+	VkBuffer meshBuffer = VK_NULL_HANDLE;		// HOST_VISIBLE, written once
+	Allocation meshBufferMemory;
+	VkDeviceSize meshBytes;
+	std::vector<Texture *> textures;	// of the draw sets
+	VkDeviceSize drawRegionSize;	// counts, early and late commands, occlusion flags
+	VkDeviceSize flagsOffset;		// in a region
+	VkBuffer drawBuffer = VK_NULL_HANDLE;
+	Allocation drawBufferMemory;
+	VkBuffer countsBuffer = VK_NULL_HANDLE;		// HOST_VISIBLE copy of the counts, per image
+	Allocation countsBufferMemory;
+	GpuDrawCounts lastCounts{};		// of the last frame read back by collect()
+
+	// Set 0 of the compute shader: objects, meshes, draws and, with
+	// occlusion culling, the Hi-Z pyramid and the flags
+	VkDescriptorSetLayout cullSetLayout;
+	VkPipelineLayout cullPipelineLayout;
+	VkPipeline cullPipeline = VK_NULL_HANDLE;
+	// Set of the graphics pipelines that draw the objects: objects (vertex
+	// shader) and the textures (fragment shader)
+	DescriptorSetLayout drawSetLayout;
+	VkDescriptorPool descriptorPool;
+	std::vector<VkDescriptorSet> cullSets;
+	std::vector<VkDescriptorSet> drawSets;
+
+	PFN_vkCmdDrawIndexedIndirectCountKHR cmdDrawIndexedIndirectCount = nullptr;
+
+	// initLayout() comes first, so that pipelines can use drawSetLayout
+	void initLayout(BaseProject *bp);
+	void init(MeshRegistry *meshes, uint32_t capacity, const std::vector<Texture *>& textures);
+	void createImageResources(uint32_t imageCount);
+	void destroyImageResources();
+	void resize(uint32_t imageCount);
+	uint32_t addObject(uint32_t mesh, const glm::mat4& model, uint32_t texture);
+	void setObject(uint32_t object, const glm::mat4& model);
+	void update(uint32_t currentImage, const Frustum& frustum, const glm::mat4& viewProj);
+	void recordCull(VkCommandBuffer commandBuffer, uint32_t currentImage,
+					uint32_t pass = EARLY_PASS);
+	void draw(VkCommandBuffer commandBuffer, uint32_t currentImage, Pipeline& pipeline,
+			  uint32_t drawSet, uint32_t pass = EARLY_PASS);
+	void writeHiZ();
+	void collect(uint32_t currentImage);
+	void cleanup();
+};
+
+// Hierarchical depth for the occlusion culling: level 0 is half the
+// resolution of the depth buffer and every texel of a level holds the
+// farthest depth of the 2x2 texels below it, reduced by the compute shader
+// shaders/HiZReduce.comp. A box whose nearest depth is farther than the
+// (at most) 2x2 texels covering its screen rectangle, at the level where
+// a texel is as large as the rectangle, is hidden.
+// Levels have power of two sizes, but only the part covering the rendered
+// area (renderExtent, which changes with the render scale) is filled:
+// each level is ceil(half) the previous one, so texel x of level l covers
+// the depth pixels [x, x + 1) * 2^(l + 1).
+struct HiZPyramid {
+	BaseProject *BP = nullptr;
+	VkImage image = VK_NULL_HANDLE;		// R32_SFLOAT, GENERAL layout
+	Allocation imageMemory;
+	VkImageView view;					// every level, sampled by the culling
+	std::vector<VkImageView> levelViews;
+	uint32_t levels = 0;
+	VkSampler sampler;					// nearest, for texelFetch
+	VkExtent2D builtExtent{};			// depth area of the last recorded build
+	bool ready = false;					// a build was submitted since create()
+
+	VkDescriptorSetLayout setLayout;	// source (sampled), destination (storage)
+	VkPipelineLayout pipelineLayout;
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+	std::vector<VkDescriptorSet> sets;	// one per level
+
+	void init(BaseProject *bp);
+	void create();
+	void destroy();
+	void record(VkCommandBuffer commandBuffer);
+	void cleanup();
+};
+
+// GPU time of each part of the frame (--gpu-profile). A section groups
+// some pipelines: every run of consecutive draws with one of them is
+// bracketed by two timestamps and, optionally, a pipeline statistics
+// query. The results of a swapchain image are read once its fence has
+// signalled, without waiting, and averaged over the last ROLLING_FRAMES.
+struct GpuProfiler {
+	static constexpr uint32_t MAX_RUNS = 64;		// per swapchain image
+	static constexpr uint32_t ROLLING_FRAMES = 60;
+	// Input assembly primitives, vertex shader invocations, clipping
+	// output primitives, fragment shader invocations
+	static constexpr int STATISTICS_COUNT = 4;
+	typedef std::array<uint64_t, STATISTICS_COUNT> Statistics;
+
+	struct Section {
+		std::string name;
+		std::vector<float> ms;				// one per rolling frame
+		std::vector<Statistics> statistics;
+	};
+
+	BaseProject *BP;
+	bool enabled = false;
+	bool statisticsEnabled = false;
+	VkQueryPool timestampPool = VK_NULL_HANDLE;
+	VkQueryPool statisticsPool = VK_NULL_HANDLE;
+	std::vector<Section> sections;				// 0 is everything unregistered
+
+	// Runs written in the command buffer of each image. Several threads
+	// may start runs at once (parallel recording), hence the atomic count.
+	std::vector<std::array<int, MAX_RUNS>> runSections;
+	std::unique_ptr<std::atomic<uint32_t>[]> runCounts;
+	std::vector<bool> pending;
+	uint32_t rollingFrame = 0;
+	uint32_t rollingCount = 0;
+
+	void init(BaseProject *bp, uint32_t imageCount, bool withStatistics);
+	void createQueries(uint32_t imageCount);
+	void resize(uint32_t imageCount);
+	int addSection(const std::string& name, std::initializer_list<Pipeline *> pipelines);
+	void beginFrame(VkCommandBuffer commandBuffer, uint32_t currentImage);
+	int beginRun(VkCommandBuffer commandBuffer, uint32_t currentImage, int section);
+	void endRun(VkCommandBuffer commandBuffer, uint32_t currentImage, int run);
+	void submitted(uint32_t currentImage);
+	void collect(uint32_t currentImage);
+	float averageMs(int section) const;
+	Statistics averageStatistics(int section) const;
+	void print() const;
 	void cleanup();
 };
 
@@ -275,17 +1176,155 @@ struct DescriptorSet {
 class BaseProject {
 	friend class Model;
 	friend class Texture;
+	friend class InstanceBuffer;
+	friend class AssetLoader;
+	friend class GpuAllocator;
+	friend class UniformRing;
+	friend class IndirectRing;
+	friend class MeshRegistry;
+	friend class GpuCuller;
+	friend class HiZPyramid;
+	friend class GpuProfiler;
 	friend class Pipeline;
 	friend class DescriptorSetLayout;
 	friend class DescriptorSet;
 public:
 	virtual void setWindowParameters() = 0;
+
+	// Command line options
+	//   --bench-frames N        render N frames, print frame time stats and exit
+	//   --host-visible-meshes   keep every mesh in HOST_VISIBLE memory (A/B against staging)
+	//   --rerecord              record the command buffer again every frame
+	//   --record-threads N      jobs recording secondary command buffers when
+	//                           re-recording (0: record inline, default: all workers)
+	//   --bench-recording       time command buffer recording for growing scenes
+	//                           and thread counts, then exit
+	//   --cold-pipeline-cache   ignore the pipeline cache on disk (it is still
+	//                           written back at exit)
+	//   --headless N            render N frames into offscreen images, without
+	//                           a window, surface or present, then exit
+	//   --bench-csv FILE        write the CPU and GPU time of every benchmark
+	//                           frame to FILE
+	//   --record-input FILE     save the camera path and input of every frame
+	//                           to FILE at exit
+	//   --replay FILE           play back a recorded path with a fixed time
+	//                           step, print the benchmark statistics and exit
+	//   --gpu-profile N         time every pipeline section on the GPU and
+	//                           print the averages every N frames
+	//   --pipeline-statistics   also count primitives and shader invocations
+	//                           per section (implies --gpu-profile 300)
+	//   --cpu-trace FILE        record CPU zones and write them to FILE at
+	//                           exit, in Chrome trace format
+	//   --render-scale S        render the scene at S times the window size
+	//                           (0.25 to 1) and upscale it
+	//   --target-fps N          adapt the render scale every frame to keep the
+	//                           GPU time under 1000 / N ms (implies --rerecord)
+	//   --min-render-scale S    lowest scale --target-fps may pick (default 0.5)
+	//   --no-frustum-culling    draw everything even when re-recording
+	//   --no-portal-culling     draw every room even when re-recording
+	//   --lod-error PX          largest simplification error allowed on
+	//                           screen, in pixels (default 1)
+	//   --no-lod                always draw the full meshes
+	//   --no-meshlet-culling    draw whole meshes instead of their visible
+	//                           meshlets
+	//   --gpu-culling           cull the exhibits in a compute shader and
+	//                           draw them with one indirect draw
+	//   --occlusion-culling     also cull the exhibits hidden by what is in
+	//                           front of them (implies --gpu-culling)
+	//   --separate-mesh-buffers give every model its own vertex and index
+	//                           buffers instead of the shared ones (A/B)
+	//   --no-draw-sorting       record the draws in the order they are listed
+	//                           instead of sorting them by state (A/B)
+	void parseArguments(int argc, char **argv) {
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			if (arg == "--bench-frames" && i + 1 < argc) {
+				benchFrames = std::atoi(argv[++i]);
+			} else if (arg == "--host-visible-meshes") {
+				hostVisibleMeshes = true;
+			} else if (arg == "--rerecord") {
+				rerecordCommandBuffers = true;
+			} else if (arg == "--record-threads" && i + 1 < argc) {
+				recordThreads = std::atoi(argv[++i]);
+			} else if (arg == "--bench-recording") {
+				benchRecording = true;
+				rerecordCommandBuffers = true;
+			} else if (arg == "--cold-pipeline-cache") {
+				coldPipelineCache = true;
+			} else if (arg == "--headless" && i + 1 < argc) {
+				headless = true;
+				benchFrames = std::atoi(argv[++i]);
+			} else if (arg == "--bench-csv" && i + 1 < argc) {
+				benchCsvFile = argv[++i];
+			} else if (arg == "--record-input" && i + 1 < argc) {
+				recordInputFile = argv[++i];
+			} else if (arg == "--replay" && i + 1 < argc) {
+				replayFile = argv[++i];
+			} else if (arg == "--gpu-profile" && i + 1 < argc) {
+				gpuProfileInterval = std::max(1, std::atoi(argv[++i]));
+			} else if (arg == "--cpu-trace" && i + 1 < argc) {
+				cpuTraceFile = argv[++i];
+				cpuProfiler.enabled = true;
+			} else if (arg == "--render-scale" && i + 1 < argc) {
+				renderScale = std::clamp((float)std::atof(argv[++i]), 0.25f, 1.0f);
+				sceneTarget = true;
+			} else if (arg == "--target-fps" && i + 1 < argc) {
+				targetFrameMs = 1000.0f / std::max(1, std::atoi(argv[++i]));
+				sceneTarget = true;
+				rerecordCommandBuffers = true;
+			} else if (arg == "--min-render-scale" && i + 1 < argc) {
+				minRenderScale = std::clamp((float)std::atof(argv[++i]), 0.25f, 1.0f);
+			} else if (arg == "--no-frustum-culling") {
+				frustumCulling = false;
+			} else if (arg == "--no-portal-culling") {
+				portalCulling = false;
+			} else if (arg == "--lod-error" && i + 1 < argc) {
+				lodPixelError = std::max(0.01f, (float)std::atof(argv[++i]));
+			} else if (arg == "--no-lod") {
+				lodSelection = false;
+			} else if (arg == "--no-meshlet-culling") {
+				meshletCulling = false;
+			} else if (arg == "--gpu-culling") {
+				gpuCulling = true;
+			} else if (arg == "--separate-mesh-buffers") {
+				sharedMeshBuffers = false;
+			} else if (arg == "--no-draw-sorting") {
+				drawSorting = false;
+			} else if (arg == "--occlusion-culling") {
+				gpuCulling = true;
+				occlusionCulling = true;
+			} else if (arg == "--pipeline-statistics") {
+				pipelineStatistics = true;
+				if (gpuProfileInterval == 0) {
+					gpuProfileInterval = 300;
+				}
+			} else {
+				std::cout << "Unknown argument: " << arg << "\n";
+			}
+		}
+	}
+
     void run() {
+    	if (cpuProfiler.enabled) {
+    		cpuProfiler.setThreadName("main");
+    	}
+    	if (!replayFile.empty()) {
+    		loadInputRecording();
+    	}
     	setWindowParameters();
-        initWindow();
+        if (!headless) {
+        	initWindow();
+        }
         initVulkan();
-        mainLoop();
+        if (benchRecording) {
+        	benchmarkRecording();
+        } else {
+        	mainLoop();
+        }
         cleanup();
+        if (!cpuTraceFile.empty()) {
+        	cpuProfiler.write(cpuTraceFile);
+        }
     }
 
 protected:
@@ -296,13 +1335,17 @@ protected:
 	int uniformBlocksInPool;
 	int texturesInPool;
 	int setsInPool;
+	// Bytes of uniforms per frame (raise it from setWindowParameters if needed)
+	VkDeviceSize uniformRingFrameSize = 64 * 1024;
+	// Indirect draw commands per frame (meshlet draws)
+	uint32_t indirectRingFrameCommands = 16 * 1024;
 
 	// Lesson 12
-    GLFWwindow* window;
+    GLFWwindow* window = nullptr;
     VkInstance instance;
 
     // Lesson 13
-	VkSurfaceKHR surface;
+	VkSurfaceKHR surface = VK_NULL_HANDLE;
     VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
     VkDevice device;
     VkQueue graphicsQueue;
@@ -324,11 +1367,11 @@ protected:
 
 	// Lesson 22
 	// L22.0 --- Debugging
-	VkDebugUtilsMessengerEXT debugMessenger;
+	VkDebugUtilsMessengerEXT debugMessenger = VK_NULL_HANDLE;
 	
 	// L22.1 --- depth buffer allocation (Z-buffer)
 	VkImage depthImage;
-	VkDeviceMemory depthImageMemory;
+	Allocation depthImageMemory;
 	VkImageView depthImageView;
 
 	// L22.2 --- Frame buffers
@@ -336,6 +1379,16 @@ protected:
 	size_t currentFrame = 0;
 	bool framebufferResized = false;
 
+	// Every initialized Pipeline, rebuilt if the swapchain format changes
+	std::vector<Pipeline *> pipelines;
+	// Every initialized DescriptorSet, reallocated if the swapchain image
+	// count changes
+	std::vector<DescriptorSet *> descriptorSets;
+	// Swapchains replaced by recreateSwapChain, with the frameNumber they
+	// were retired at. Their last presents may still be pending, so they
+	// are destroyed MAX_FRAMES_IN_FLIGHT frames later.
+	std::vector<std::pair<VkSwapchainKHR, uint32_t>> retiredSwapChains;
+
 	// L22.3 --- Synchronization objects
 	std::vector<VkSemaphore> imageAvailableSemaphores;
 	std::vector<VkSemaphore> renderFinishedSemaphores;
@@ -344,21 +1397,188 @@ protected:
 
 	//TEXT PIPELINE---------------------------------------------------------------------------------
 	std::vector<VkBuffer> TextUniformBuffers;
-	std::vector<VkDeviceMemory> TextUniformBuffersMemory;
+	std::vector<Allocation> TextUniformBuffersMemory;
 	// to access uniforms in the pipeline
 	std::vector<VkDescriptorSet> TextDescriptorSets;
+
+	// Worker threads for asset decoding
+	JobSystem jobs;
+
+	// Every buffer and image is sub-allocated from here
+	GpuAllocator allocator;
+	UniformRing uniformRing;
+	IndirectRing indirectRing;
+
+	// Staging uploads: copies recorded between beginUploadBatch() and
+	// flushUploadBatch() go to the GPU in a single submission
+	VkCommandBuffer uploadCommandBuffer = VK_NULL_HANDLE;
+	std::vector<VkBuffer> uploadStagingBuffers;
+	std::vector<Allocation> uploadStagingBuffersMemory;
+	VkDeviceSize uploadBatchBytes = 0;
+
+	// When true the command buffer of a swapchain image is recorded again
+	// every frame (from a pool of its own, reset rather than freed), so
+	// populateCommandBuffer can skip hidden objects. Otherwise it is
+	// recorded once in createCommandBuffers and replayed forever.
+	bool rerecordCommandBuffers = false;
+	std::vector<VkCommandPool> frameCommandPools;
+
+	// Parallel recording (re-record mode only): the draw list is cut at
+	// every pipeline change and in pieces of at most drawList / threads
+	// draws. Each piece is a secondary command buffer recorded by one job,
+	// from a pool owned by that job slot for that swapchain image.
+	int recordThreads = -1;		// < 0: one per worker thread
+	std::vector<std::vector<VkCommandPool>> secondaryCommandPools;
+	std::vector<std::vector<VkCommandBuffer>> secondaryCommandBuffers;
+	std::vector<DrawItem> drawList;
+
+	// Benchmark options (see parseArguments)
+	int benchFrames = 0;
+	bool hostVisibleMeshes = false;
+	bool sharedMeshBuffers = true;		// static meshes in one MeshRegistry
+	bool coldPipelineCache = false;
+	bool benchRecording = false;
+	FrameStats frameStats;
+	FrameStats cpuStats;
+	FrameStats gpuStats;
+	std::string benchCsvFile;
+
+	// Draw calls and triangles recorded in each swapchain image's command
+	// buffer, and bytes sent to the GPU (uniforms and staging copies) per frame
+	std::atomic<uint32_t> recordedDraws{0};
+	std::atomic<uint64_t> recordedTriangles{0};
+	std::vector<uint32_t> imageDrawCounts;
+	std::vector<uint64_t> imageTriangleCounts;
+	std::vector<uint32_t> frameDrawCounts;
+	std::vector<uint64_t> frameTriangleCounts;
+	std::vector<VkDeviceSize> frameUploadBytes;
+	VkDeviceSize uploadedBytes = 0;		// staging copies since startup
+	// Host writes to mapped GPU memory since startup: the uniforms handed
+	// out by DescriptorSet::uniformData and the GpuCuller objects
+	VkDeviceSize writtenBytes = 0;
+
+	// State sorting of the draw list (see RenderQueue) and the binds of
+	// pipelines, descriptor sets and vertex and index buffers recorded by
+	// recordDrawList in the last command buffer, and the descriptor set
+	// binds it skipped because the same set was still bound
+	bool drawSorting = true;
+	RenderQueue renderQueue;
+	std::atomic<uint32_t> recordedBinds{0};
+	std::atomic<uint32_t> avoidedBinds{0};
+
+	std::string cpuTraceFile;
+
+	// Per section GPU times, printed every gpuProfileInterval frames
+	GpuProfiler gpuProfiler;
+	int gpuProfileInterval = 0;		// 0: profiler off
+	bool pipelineStatistics = false;
+
+	// Input recording and replay, see InputFrame
+	std::string recordInputFile;
+	std::string replayFile;
+	std::vector<InputFrame> inputFrames;
+	InputFrame inputFrame;				// the frame being recorded or replayed
+
+	// Headless mode: no window, surface or swapchain. swapChainImages are
+	// plain images in offscreenImagesMemory, rendered in turn, and
+	// benchFrames frames are drawn before exiting.
+	bool headless = false;
+	bool validationEnabled = true;
+	std::vector<Allocation> offscreenImagesMemory;
+
+	// GPU frame time: a timestamp at the start and at the end of every
+	// command buffer, two queries per swapchain image. The results of an
+	// image are read once its fence has been waited on.
+	VkQueryPool frameQueryPool = VK_NULL_HANDLE;
+	float timestampPeriod = 0.0f;	// ns per tick
+	uint64_t timestampMask = 0;		// 0 if timestamps are unsupported
+	std::vector<bool> frameQueriesPending;
+	std::vector<uint32_t> frameQueriesFrame;	// frameNumber that wrote them
+
+	uint32_t frameNumber = 0;	// frames drawn so far
+	float lastCpuMs = 0.0f;		// drawFrame time, without the fence waits
+
+	// Resolution scaling (--render-scale, --target-fps): the render pass
+	// draws into the top left renderExtent() of sceneImages, full size
+	// color targets (one per swapchain image), and recordUpscale blits
+	// that to the swapchain image. Changing renderScale only changes the
+	// viewport and render area, nothing is reallocated.
+	bool sceneTarget = false;
+	float renderScale = 1.0f;
+	float minRenderScale = 0.5f;
+	float targetFrameMs = 0.0f;		// 0: renderScale stays fixed
+	std::vector<VkImage> sceneImages;
+	std::vector<Allocation> sceneImagesMemory;
+	std::vector<VkImageView> sceneImageViews;
+	std::vector<float> frameRenderScales;	// benchmark frames only
+
+	// Frustum culling of the draw list (re-record mode only, the command
+	// buffers recorded once must draw everything). The application
+	// updates frustum with its view-projection every frame; the counts are
+	// those of the last cullDrawList.
+	Frustum frustum;
+	bool frustumCulling = true;
+	uint32_t cullTested = 0;
+	uint32_t cullCulled = 0;		// by the frustum or the portals
+	uint32_t cullDrawn = 0;
+	uint32_t portalCulled = 0;
+
+	// Rooms and portals, filled by the application (empty: no portal
+	// culling), which calls roomGraph.findVisible every frame
+	RoomGraph roomGraph;
+	bool portalCulling = true;
+	std::vector<uint32_t> frameCulledCounts;	// benchmark frames only
+
+	// Level of detail selection (re-record mode only), see selectLod. The
+	// application passes its camera to setView every frame.
+	bool lodSelection = true;
+	float lodPixelError = 1.0f;
+	glm::vec3 viewEye = glm::vec3(0.0f);
+	glm::mat4 viewProj = glm::mat4(1.0f);
+	float pixelsPerUnit = 0.0f;		// on screen, one unit away from the eye
+
+	// Meshlet culling (re-record mode only, see recordMeshletDraws).
+	// Counts of the last recorded frame.
+	bool meshletCulling = true;
+	bool multiDrawIndirect = false;		// device feature
+	std::atomic<uint32_t> meshletsTested{0};
+	std::atomic<uint32_t> meshletsCulled{0};
+
+	// GPU driven drawing of the objects the application gives to gpuCuller
+	// (--gpu-culling). Needs VK_KHR_draw_indirect_count and the
+	// multiDrawIndirect and drawIndirectFirstInstance features, otherwise
+	// createLogicalDevice turns it off.
+	bool gpuCulling = false;
+	GpuCuller gpuCuller;
+
+	// Two pass occlusion culling of the gpuCuller objects (--occlusion-
+	// culling, implies --gpu-culling). The depth buffer is kept after the
+	// render pass to build hiZ, and lateRenderPass draws the objects found
+	// visible by the late pass over the frame.
+	bool occlusionCulling = false;
+	HiZPyramid hiZ;
+	VkRenderPass lateRenderPass = VK_NULL_HANDLE;
+
+	// Shared by every Pipeline::init, loaded from and saved to
+	// pipelineCacheFile so that later runs skip shader compilation
+	VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+	std::string pipelineCacheFile = "pipeline_cache.bin";
+	bool pipelineCacheWarm = false;
+	double pipelineCreationMs = 0.0;
+	int pipelineCount = 0;
 	
 	// Lesson 12
     void initWindow() {
         glfwInit();
 
         glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-        glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+        glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
         window = glfwCreateWindow(windowWidth, windowHeight, windowTitle.c_str(), nullptr, nullptr);
 
 		glfwSetWindowUserPointer(window, this);
 		glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+		glfwSetInputMode(window, GLFW_STICKY_MOUSE_BUTTONS, GLFW_TRUE);
     }
 
 	static void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
@@ -367,24 +1587,167 @@ protected:
 		app->framebufferResized = true;
 	}
 
+	// Input goes through these, so that without a window (headless) the
+	// application sees nothing pressed and a still cursor
+	bool keyPressed(int key) {
+		if (!replayFile.empty()) {
+			return inputFrame.key(key);
+		}
+		bool pressed = window != nullptr && glfwGetKey(window, key) == GLFW_PRESS;
+		if (pressed) {
+			inputFrame.setKey(key);
+		}
+		return pressed;
+	}
+
+	bool mouseButtonPressed(int button) {
+		if (!replayFile.empty()) {
+			return (inputFrame.mouseButtons >> button) & 1;
+		}
+		bool pressed = window != nullptr && glfwGetMouseButton(window, button) == GLFW_PRESS;
+		if (pressed) {
+			inputFrame.mouseButtons |= 1u << button;
+		}
+		return pressed;
+	}
+
+	void getCursorPos(double *x, double *y) {
+		if (replayFile.empty()) {
+			inputFrame.cursorX = inputFrame.cursorY = 0.0;
+			if (window != nullptr) {
+				glfwGetCursorPos(window, &inputFrame.cursorX, &inputFrame.cursorY);
+			}
+		}
+		*x = inputFrame.cursorX;
+		*y = inputFrame.cursorY;
+	}
+
+	// Seconds since the first frame. Replays advance by REPLAY_TIMESTEP
+	// per frame so that every run computes the same animation.
+	float frameTime() {
+		if (!replayFile.empty()) {
+			return frameNumber * REPLAY_TIMESTEP;
+		}
+		static auto startTime = std::chrono::high_resolution_clock::now();
+		return std::chrono::duration<float, std::chrono::seconds::period>
+			(std::chrono::high_resolution_clock::now() - startTime).count();
+	}
+
+	// The camera the application renders from, saved and restored by the
+	// input recording
+	virtual void getCamera(glm::vec3& position, glm::vec3& angles) {}
+	virtual void setCamera(const glm::vec3& position, const glm::vec3& angles) {}
+
+	// Called before updateUniformBuffer: starts recording a new frame, or
+	// loads the next recorded one and moves the camera where it was
+	void beginInputFrame() {
+		if (!replayFile.empty()) {
+			inputFrame = inputFrames[std::min<size_t>(frameNumber, inputFrames.size() - 1)];
+			setCamera(inputFrame.camPos, inputFrame.camAng);
+		} else {
+			inputFrame = InputFrame();
+			getCamera(inputFrame.camPos, inputFrame.camAng);
+		}
+	}
+
+	void endInputFrame() {
+		if (!recordInputFile.empty()) {
+			inputFrames.push_back(inputFrame);
+		}
+	}
+
+	void loadInputRecording() {
+		std::ifstream in(replayFile, std::ios::binary);
+		InputRecordHeader header{};
+		in.read(reinterpret_cast<char *>(&header), sizeof(header));
+		if (!in || header.magic != INPUT_RECORD_MAGIC ||
+			header.version != INPUT_RECORD_VERSION ||
+			header.frameSize != sizeof(InputFrame) || header.frameCount == 0) {
+			throw std::runtime_error("failed to read input recording " + replayFile);
+		}
+		inputFrames.resize(header.frameCount);
+		in.read(reinterpret_cast<char *>(inputFrames.data()),
+				header.frameCount * sizeof(InputFrame));
+		if (!in) {
+			throw std::runtime_error("input recording " + replayFile + " is truncated");
+		}
+
+		// A replay is a benchmark of the recorded length (or shorter)
+		if (benchFrames <= 0 || benchFrames > (int)header.frameCount) {
+			benchFrames = header.frameCount;
+		}
+		std::cout << "Replaying " << benchFrames << " frames from " << replayFile << "\n";
+	}
+
+	void saveInputRecording() {
+		InputRecordHeader header{};
+		header.magic = INPUT_RECORD_MAGIC;
+		header.version = INPUT_RECORD_VERSION;
+		header.frameSize = sizeof(InputFrame);
+		header.frameCount = static_cast<uint32_t>(inputFrames.size());
+
+		std::ofstream out(recordInputFile, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char *>(inputFrames.data()),
+				  inputFrames.size() * sizeof(InputFrame));
+		if (!out) {
+			std::cout << "Could not write " << recordInputFile << "\n";
+			return;
+		}
+		std::cout << "Recorded " << inputFrames.size() << " frames to " << recordInputFile << "\n";
+	}
+
 	virtual void localInit() = 0;
 
 	// Lesson 12
     void initVulkan() {
 		createInstance();				// L12
-		setupDebugMessenger();			// L22.0
-		createSurface();				// L13
+		if (validationEnabled) {
+			setupDebugMessenger();		// L22.0
+		}
+		if (!headless) {
+			createSurface();			// L13
+		}
 		pickPhysicalDevice();			// L14
 		createLogicalDevice();			// L14
-		createSwapChain();				// L15
+		allocator.init(this);
+		createPipelineCache();
+		if (headless) {
+			createOffscreenImages();
+		} else {
+			createSwapChain();			// L15
+		}
 		createImageViews();				// L15
+		createSceneImages();
 		createRenderPass();				// L19
 		createCommandPool();			// L13
 		createDepthResources();			// L22.1
+		if (occlusionCulling) {
+			hiZ.init(this);
+			hiZ.create();
+		}
 		createFramebuffers();			// L22.2
 		createDescriptorPool();			// L21
+		uniformRing.init(this, uniformRingFrameSize,
+						 static_cast<uint32_t>(swapChainImages.size()));
+		if (rerecordCommandBuffers && meshletCulling) {
+			indirectRing.init(this, indirectRingFrameCommands,
+							  static_cast<uint32_t>(swapChainImages.size()));
+		}
+		initTimestamps();
+		gpuProfiler.init(this, static_cast<uint32_t>(swapChainImages.size()),
+						 pipelineStatistics);
 
-		localInit();
+		unsigned int cores = std::thread::hardware_concurrency();
+		jobs.init(cores > 1 ? cores - 1 : 1);
+
+		{
+			PROFILE_SCOPE("localInit");
+			localInit();
+		}
+		allocator.printStats();
+		std::cout << pipelineCount << " pipelines created in " << pipelineCreationMs
+				  << " ms (" << (pipelineCacheWarm ? "warm" : "cold") << " cache)\n";
 		/*
 		createDescriptorSetLayouts();
 		createPipelines();
@@ -394,6 +1757,7 @@ protected:
 		createDescriptorSets();
 		*/
 
+		createFrameQueryPool();
 		createCommandBuffers();			// L22.5 (13)
 		createSyncObjects();			// L22.3 
 
@@ -405,6 +1769,15 @@ protected:
     	VkApplicationInfo appInfo{};
        	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
     	appInfo.pApplicationName = windowTitle.c_str();
+		// Headless runs (CI boxes) often have no validation layers installed
+		validationEnabled = checkValidationLayerSupport();
+		if (!validationEnabled) {
+			if (!headless) {
+				throw std::runtime_error("validation layers requested, but not available!");
+			}
+			std::cout << "Validation layers not available, running without them\n";
+		}
+
     	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     	appInfo.pEngineName = "No Engine";
     	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
@@ -414,13 +1787,6 @@ protected:
 		createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
 		createInfo.pApplicationInfo = &appInfo;
 
-		uint32_t glfwExtensionCount = 0;
-		const char** glfwExtensions;
-		glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-				
-		createInfo.enabledExtensionCount = glfwExtensionCount;
-		createInfo.ppEnabledExtensionNames = glfwExtensions;
-
 		createInfo.enabledLayerCount = 0;
 
 		auto extensions = getRequiredExtensions();
@@ -429,11 +1795,8 @@ protected:
 		createInfo.ppEnabledExtensionNames = extensions.data();		
 		
 		// For debugging [Lesson 22] - Start
-		if (!checkValidationLayerSupport()) {
-			throw std::runtime_error("validation layers requested, but not available!");
-		}
-
 		VkDebugUtilsMessengerCreateInfoEXT debugCreateInfo;
+		if (validationEnabled) {
 			createInfo.enabledLayerCount =
 				static_cast<uint32_t>(validationLayers.size());
 			createInfo.ppEnabledLayerNames = validationLayers.data();
@@ -441,6 +1804,7 @@ protected:
 			populateDebugMessengerCreateInfo(debugCreateInfo);
 			createInfo.pNext = (VkDebugUtilsMessengerCreateInfoEXT*)
 									&debugCreateInfo;
+		}
 		// For debugging [Lesson 22] - End
 		
 		VkResult result = vkCreateInstance(&createInfo, nullptr, &instance);
@@ -453,17 +1817,28 @@ protected:
     
     // Lesson 12 and L22.0
     std::vector<const char*> getRequiredExtensions() {
-		uint32_t glfwExtensionCount = 0;
-		const char** glfwExtensions;
-		glfwExtensions =
-			glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-		std::vector<const char*> extensions(glfwExtensions,
-			glfwExtensions + glfwExtensionCount);
+		std::vector<const char*> extensions;
+		if (!headless) {
+			uint32_t glfwExtensionCount = 0;
+			const char** glfwExtensions;
+			glfwExtensions =
+				glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+			extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+		}
+		if (validationEnabled) {
 			extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+		}
 		
 		return extensions;
 	}
+
+	// Headless runs present nothing, so they need no swapchain extension
+	std::vector<const char*> getDeviceExtensions() {
+		if (headless) {
+			return {};
+		}
+		return deviceExtensions;
+	}
 	
 	// Lesson 22.0 - debug support
 	bool checkValidationLayerSupport() {
@@ -571,8 +1946,8 @@ protected:
 
 		bool extensionsSupported = checkDeviceExtensionSupport(device);
 
-		bool swapChainAdequate = false;
-		if (extensionsSupported) {
+		bool swapChainAdequate = headless;
+		if (extensionsSupported && !headless) {
 			SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
 			swapChainAdequate = !swapChainSupport.formats.empty() &&
 								!swapChainSupport.presentModes.empty();
@@ -604,8 +1979,13 @@ protected:
 			}
 				
 			VkBool32 presentSupport = false;
-			vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
-												 &presentSupport);
+			if (headless) {
+				// Nothing is presented: the present queue is the graphics one
+				indices.presentFamily = indices.graphicsFamily;
+			} else {
+				vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
+													 &presentSupport);
+			}
 			if (presentSupport) {
 			 	indices.presentFamily = i;
 			}
@@ -629,8 +2009,9 @@ protected:
 		vkEnumerateDeviceExtensionProperties(device, nullptr,
 					&extensionCount, availableExtensions.data());
 					
-		std::set<std::string> requiredExtensions(deviceExtensions.begin(),
-					deviceExtensions.end());
+		std::vector<const char*> extensions = getDeviceExtensions();
+		std::set<std::string> requiredExtensions(extensions.begin(),
+					extensions.end());
 					
 		for (const auto& extension : availableExtensions){
 			requiredExtensions.erase(extension.extensionName);
@@ -669,6 +2050,17 @@ protected:
 		return details;
 	}
 
+	// The SPIR-V of the optional paths is built by shaders/compile.sh (or
+	// compile.bat) and may be missing from a checkout
+	static bool shadersCompiled(std::initializer_list<const char *> files) {
+		for (const char *file : files) {
+			if (!std::ifstream(file, std::ios::binary)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
 	// Lesson 13
 	void createLogicalDevice() {
 		QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
@@ -689,6 +2081,79 @@ protected:
 		
 		VkPhysicalDeviceFeatures deviceFeatures{};
 		deviceFeatures.samplerAnisotropy = VK_TRUE;
+
+		// Without it every meshlet range is its own indirect draw
+		{
+			VkPhysicalDeviceFeatures supportedFeatures;
+			vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+			multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+			deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+
+			// Asked for explicitly: a run without it would measure another path
+			if (gpuCulling && !shadersCompiled({"shaders/CullObjectsComp.spv",
+												"shaders/MarbleIndirectVert.spv",
+												"shaders/MarbleIndirectFrag.spv"})) {
+				throw std::runtime_error("--gpu-culling needs CullObjectsComp.spv, MarbleIndirectVert.spv "
+										 "and MarbleIndirectFrag.spv: run shaders/compile.sh");
+			}
+			if (gpuCulling) {
+				uint32_t extensionCount;
+				vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr,
+							&extensionCount, nullptr);
+				std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+				vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr,
+							&extensionCount, availableExtensions.data());
+				bool drawIndirectCount = false;
+				for (const auto& extension : availableExtensions) {
+					drawIndirectCount |= strcmp(extension.extensionName,
+							VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME) == 0;
+				}
+				if (drawIndirectCount && supportedFeatures.multiDrawIndirect &&
+					supportedFeatures.drawIndirectFirstInstance &&
+					supportedFeatures.shaderSampledImageArrayDynamicIndexing) {
+					deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+					deviceFeatures.shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+				} else {
+					std::cout << "GPU culling not supported by this device, disabled\n";
+					gpuCulling = false;
+				}
+			}
+
+			// The depth buffer is sampled to build the Hi-Z pyramid, a
+			// storage image
+			if (occlusionCulling && gpuCulling &&
+				!shadersCompiled({"shaders/CullObjectsOcclusionComp.spv",
+								  "shaders/HiZReduceComp.spv"})) {
+				throw std::runtime_error("--occlusion-culling needs CullObjectsOcclusionComp.spv "
+										 "and HiZReduceComp.spv: run shaders/compile.sh");
+			}
+			if (occlusionCulling) {
+				VkFormatProperties depthProperties, pyramidProperties;
+				vkGetPhysicalDeviceFormatProperties(physicalDevice, VK_FORMAT_D32_SFLOAT,
+													&depthProperties);
+				vkGetPhysicalDeviceFormatProperties(physicalDevice, VK_FORMAT_R32_SFLOAT,
+													&pyramidProperties);
+				VkFormatFeatureFlags pyramidFeatures = VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT |
+													   VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+				if (!gpuCulling ||
+					!(depthProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) ||
+					(pyramidProperties.optimalTilingFeatures & pyramidFeatures) != pyramidFeatures) {
+					std::cout << "Occlusion culling not supported by this device, disabled\n";
+					occlusionCulling = false;
+				}
+			}
+		}
+
+		if (pipelineStatistics) {
+			VkPhysicalDeviceFeatures supportedFeatures;
+			vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+			if (supportedFeatures.pipelineStatisticsQuery) {
+				deviceFeatures.pipelineStatisticsQuery = VK_TRUE;
+			} else {
+				std::cout << "Pipeline statistics queries not supported\n";
+				pipelineStatistics = false;
+			}
+		}
 		
 		VkDeviceCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -698,13 +2163,19 @@ protected:
 			static_cast<uint32_t>(queueCreateInfos.size());
 		
 		createInfo.pEnabledFeatures = &deviceFeatures;
+		std::vector<const char*> extensions = getDeviceExtensions();
+		if (gpuCulling) {
+			extensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
+		}
 		createInfo.enabledExtensionCount =
-				static_cast<uint32_t>(deviceExtensions.size());
-		createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+				static_cast<uint32_t>(extensions.size());
+		createInfo.ppEnabledExtensionNames = extensions.data();
 
+		if (validationEnabled) {
 			createInfo.enabledLayerCount = 
 					static_cast<uint32_t>(validationLayers.size());
 			createInfo.ppEnabledLayerNames = validationLayers.data();
+		}
 		
 		VkResult result = vkCreateDevice(physicalDevice, &createInfo, nullptr, &device);
 		
@@ -716,9 +2187,111 @@ protected:
 		vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
 		vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
 	}
+
+	// Creates pipelineCache, seeded from pipelineCacheFile when it was
+	// written by this device and driver
+	void createPipelineCache() {
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+		std::vector<char> initialData;
+		MappedFile file;
+		if (!coldPipelineCache && file.open(pipelineCacheFile)) {
+			const PipelineCacheFileHeader *header =
+					reinterpret_cast<const PipelineCacheFileHeader *>(file.data);
+			const char *data = file.data + sizeof(PipelineCacheFileHeader);
+			const VkPipelineCacheHeaderVersionOne *vkHeader =
+					reinterpret_cast<const VkPipelineCacheHeaderVersionOne *>(data);
+
+			const char *reason = nullptr;
+			if (file.size < sizeof(PipelineCacheFileHeader) + sizeof(VkPipelineCacheHeaderVersionOne) ||
+				header->magic != PIPELINE_CACHE_MAGIC ||
+				header->version != PIPELINE_CACHE_VERSION ||
+				file.size != sizeof(PipelineCacheFileHeader) + header->dataSize) {
+				reason = "unreadable";
+			} else if (header->vendorID != properties.vendorID ||
+					   header->deviceID != properties.deviceID ||
+					   memcmp(header->pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0 ||
+					   vkHeader->vendorID != properties.vendorID ||
+					   vkHeader->deviceID != properties.deviceID ||
+					   memcmp(vkHeader->pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+				reason = "written by another device";
+			} else if (header->driverVersion != properties.driverVersion) {
+				reason = "written by another driver version";
+			} else if (hashBytes(data, header->dataSize) != header->dataHash) {
+				reason = "corrupted";
+			} else {
+				initialData.assign(data, data + header->dataSize);
+			}
+			file.close();
+
+			if (reason != nullptr) {
+				std::cout << pipelineCacheFile << " " << reason << ", starting with an empty pipeline cache\n";
+			}
+		}
+		pipelineCacheWarm = !initialData.empty();
+
+		VkPipelineCacheCreateInfo cacheInfo{};
+		cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+		cacheInfo.initialDataSize = initialData.size();
+		cacheInfo.pInitialData = initialData.empty() ? nullptr : initialData.data();
+
+		VkResult result = vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to create pipeline cache!");
+		}
+	}
+
+	// Writes pipelineCache back to disk. A failure only costs the next
+	// run a cold start, so it is reported but not fatal.
+	void savePipelineCache() {
+		size_t dataSize = 0;
+		VkResult result = vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr);
+		std::vector<char> data(dataSize);
+		if (result == VK_SUCCESS && dataSize > 0) {
+			result = vkGetPipelineCacheData(device, pipelineCache, &dataSize, data.data());
+		}
+		if (result != VK_SUCCESS || dataSize == 0) {
+			std::cout << "Pipeline cache not saved\n";
+			return;
+		}
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+		PipelineCacheFileHeader header{};
+		header.magic = PIPELINE_CACHE_MAGIC;
+		header.version = PIPELINE_CACHE_VERSION;
+		header.vendorID = properties.vendorID;
+		header.deviceID = properties.deviceID;
+		header.driverVersion = properties.driverVersion;
+		memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+		header.dataSize = dataSize;
+		header.dataHash = hashBytes(data.data(), dataSize);
+
+		// Write beside the old file and swap, so an interrupted write never
+		// leaves a truncated cache behind
+		std::string tmpFile = pipelineCacheFile + ".tmp";
+		std::ofstream out(tmpFile, std::ios::binary | std::ios::trunc);
+		out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		out.write(data.data(), dataSize);
+		out.close();
+		bool written = static_cast<bool>(out);
+		if (written) {
+			std::remove(pipelineCacheFile.c_str());
+			written = std::rename(tmpFile.c_str(), pipelineCacheFile.c_str()) == 0;
+		}
+		if (!written) {
+			std::cout << "Could not write " << pipelineCacheFile << "\n";
+			std::remove(tmpFile.c_str());
+		}
+	}
 	
 	// Lesson 14
-	void createSwapChain() {
+	// When recreating, oldSwapChain is the one being replaced, and the
+	// same number of images as before is requested
+	void createSwapChain(VkSwapchainKHR oldSwapChain = VK_NULL_HANDLE) {
 		SwapChainSupportDetails swapChainSupport =
 				querySwapChainSupport(physicalDevice);
 		VkSurfaceFormatKHR surfaceFormat =
@@ -728,6 +2301,10 @@ protected:
 		VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
 		
 		uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+		if (!swapChainImages.empty()) {
+			imageCount = std::max(swapChainSupport.capabilities.minImageCount,
+								  static_cast<uint32_t>(swapChainImages.size()));
+		}
 		
 		if (swapChainSupport.capabilities.maxImageCount > 0 &&
 				imageCount > swapChainSupport.capabilities.maxImageCount) {
@@ -743,6 +2320,14 @@ protected:
 		createInfo.imageExtent = extent;
 		createInfo.imageArrayLayers = 1;
 		createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+		if (sceneTarget) {
+			// Written by the upscaling blit
+			if (!(swapChainSupport.capabilities.supportedUsageFlags &
+				  VK_IMAGE_USAGE_TRANSFER_DST_BIT)) {
+				throw std::runtime_error("swapchain images cannot be blitted to, render scaling not supported!");
+			}
+			createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		}
 		
 		QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
 		uint32_t queueFamilyIndices[] = {indices.graphicsFamily.value(),
@@ -761,7 +2346,7 @@ protected:
 		 createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 		 createInfo.presentMode = presentMode;
 		 createInfo.clipped = VK_TRUE;
-		 createInfo.oldSwapchain = VK_NULL_HANDLE;
+		 createInfo.oldSwapchain = oldSwapChain;
 		 
 		 VkResult result = vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain);
 		 if (result != VK_SUCCESS) {
@@ -778,24 +2363,220 @@ protected:
 		swapChainExtent = extent;
 	}
 
-	// Lesson 14
-	VkSurfaceFormatKHR chooseSwapSurfaceFormat(
-				const std::vector<VkSurfaceFormatKHR>& availableFormats)
-	{
-		for (const auto& availableFormat : availableFormats) {
-			if (availableFormat.format == VK_FORMAT_B8G8R8A8_SRGB &&
-				availableFormat.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
-				return availableFormat;
+	// Called when the window was resized or the swapchain went out of date.
+	// Only the frames in flight are waited for (not the whole device): the
+	// old swapchain is handed to the new one and destroyed later.
+	void recreateSwapChain() {
+		int width = 0, height = 0;
+		glfwGetFramebufferSize(window, &width, &height);
+		while (width == 0 || height == 0) {
+			// Minimized: nothing to render until the window comes back
+			if (glfwWindowShouldClose(window)) {
+				return;
 			}
+			glfwWaitEvents();
+			glfwGetFramebufferSize(window, &width, &height);
 		}
-		
-		return availableFormats[0];
-	}
 
-	// Lesson 14
-	VkPresentModeKHR chooseSwapPresentMode(
-			const std::vector<VkPresentModeKHR>& availablePresentModes) {
-		for (const auto& availablePresentMode : availablePresentModes) {
+		{
+			PROFILE_SCOPE("vkWaitForFences (recreate)");
+			vkWaitForFences(device, static_cast<uint32_t>(inFlightFences.size()),
+							inFlightFences.data(), VK_TRUE, UINT64_MAX);
+		}
+		cleanupSwapChain();
+
+		VkSwapchainKHR oldSwapChain = swapChain;
+		size_t oldImageCount = swapChainImages.size();
+		VkFormat oldFormat = swapChainImageFormat;
+		createSwapChain(oldSwapChain);
+		retiredSwapChains.push_back({oldSwapChain, frameNumber});
+
+		// Descriptor sets, uniforms, queries... are allocated per image
+		bool imageCountChanged = swapChainImages.size() != oldImageCount;
+		if (imageCountChanged) {
+			recreateImageResources(oldImageCount);
+		}
+		// The viewport is dynamic, so the pipelines are rebuilt only when
+		// the new render pass is not compatible with the old one
+		if (swapChainImageFormat != oldFormat) {
+			vkDestroyRenderPass(device, renderPass, nullptr);
+			if (lateRenderPass != VK_NULL_HANDLE) {
+				vkDestroyRenderPass(device, lateRenderPass, nullptr);
+			}
+			createRenderPass();
+			for (Pipeline *pipeline : pipelines) {
+				pipeline->rebuild();
+			}
+		}
+
+		createImageViews();
+		createSceneImages();
+		createDepthResources();
+		if (occlusionCulling) {
+			hiZ.create();
+			if (gpuCuller.cullPipeline != VK_NULL_HANDLE) {
+				gpuCuller.writeHiZ();
+			}
+		}
+		createFramebuffers();
+		if (!rerecordCommandBuffers || imageCountChanged) {
+			createCommandBuffers();
+		}
+		imagesInFlight.assign(swapChainImages.size(), VK_NULL_HANDLE);
+		framebufferResized = false;
+
+		std::cout << "Swapchain recreated at " << swapChainExtent.width << "x"
+				  << swapChainExtent.height << "\n";
+	}
+
+	// The swapchain came back with another number of images: everything
+	// kept per image is made again for the new count. The frames in flight
+	// have completed, so their queries are read first.
+	void recreateImageResources(size_t oldImageCount) {
+		for (uint32_t i = 0; i < oldImageCount; i++) {
+			collectGpuTime(i);
+			gpuProfiler.collect(i);
+		}
+		uint32_t imageCount = static_cast<uint32_t>(swapChainImages.size());
+
+		if (rerecordCommandBuffers) {
+			destroyFrameCommandPools();
+		}
+		uniformRing.resize(imageCount);
+		if (indirectRing.buffer != VK_NULL_HANDLE) {
+			indirectRing.cleanup();
+			indirectRing.init(this, indirectRingFrameCommands, imageCount);
+		}
+
+		VkDescriptorPool oldPool = descriptorPool;
+		createDescriptorPool();
+		for (DescriptorSet *set : descriptorSets) {
+			set->allocateSets();
+		}
+		vkDestroyDescriptorPool(device, oldPool, nullptr);
+		if (gpuCuller.objectBuffer != VK_NULL_HANDLE) {
+			gpuCuller.resize(imageCount);
+		}
+
+		if (frameQueryPool != VK_NULL_HANDLE) {
+			vkDestroyQueryPool(device, frameQueryPool, nullptr);
+			frameQueryPool = VK_NULL_HANDLE;
+			createFrameQueryPool();
+		}
+		gpuProfiler.resize(imageCount);
+
+		imageDrawCounts.clear();
+		imageTriangleCounts.clear();
+		std::cout << "Swapchain image count changed from " << oldImageCount << " to "
+				  << imageCount << "\n";
+	}
+
+	// Pools of the command buffers recorded every frame (rerecord mode)
+	void destroyFrameCommandPools() {
+		for (VkCommandPool pool : frameCommandPools) {
+			vkDestroyCommandPool(device, pool, nullptr);
+		}
+		frameCommandPools.clear();
+		for (std::vector<VkCommandPool>& pools : secondaryCommandPools) {
+			for (VkCommandPool pool : pools) {
+				if (pool != VK_NULL_HANDLE) {
+					vkDestroyCommandPool(device, pool, nullptr);
+				}
+			}
+		}
+		secondaryCommandPools.clear();
+		secondaryCommandBuffers.clear();
+	}
+
+	// Everything that depends on the swapchain images or their size,
+	// except the swapchain itself and the pipelines
+	void cleanupSwapChain() {
+		hiZ.destroy();
+		vkDestroyImageView(device, depthImageView, nullptr);
+		vkDestroyImage(device, depthImage, nullptr);
+		allocator.free(depthImageMemory);
+
+		for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
+			vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
+		}
+
+		if (!rerecordCommandBuffers) {
+			vkFreeCommandBuffers(device, commandPool,
+					static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+		}
+
+		for (size_t i = 0; i < swapChainImageViews.size(); i++){
+			vkDestroyImageView(device, swapChainImageViews[i], nullptr);
+		}
+
+		for (size_t i = 0; i < sceneImages.size(); i++) {
+			vkDestroyImageView(device, sceneImageViews[i], nullptr);
+			vkDestroyImage(device, sceneImages[i], nullptr);
+			allocator.free(sceneImagesMemory[i]);
+		}
+		sceneImages.clear();
+		sceneImagesMemory.clear();
+		sceneImageViews.clear();
+	}
+
+	// Destroys the retired swapchains that are old enough (all of them when
+	// force is set, once the device is idle)
+	void destroyRetiredSwapChains(bool force) {
+		for (size_t i = 0; i < retiredSwapChains.size(); ) {
+			if (force || frameNumber >= retiredSwapChains[i].second + MAX_FRAMES_IN_FLIGHT) {
+				vkDestroySwapchainKHR(device, retiredSwapChains[i].first, nullptr);
+				retiredSwapChains.erase(retiredSwapChains.begin() + i);
+			} else {
+				i++;
+			}
+		}
+	}
+
+	// Headless replacement for createSwapChain: plain images, as many and
+	// in the same format as a swapchain would usually give
+	void createOffscreenImages() {
+		swapChainImageFormat = VK_FORMAT_B8G8R8A8_SRGB;
+		swapChainExtent = {windowWidth, windowHeight};
+
+		swapChainImages.resize(MAX_FRAMES_IN_FLIGHT + 1);
+		offscreenImagesMemory.resize(swapChainImages.size());
+		for (size_t i = 0; i < swapChainImages.size(); i++) {
+			createImage(swapChainExtent.width, swapChainExtent.height, 1,
+						swapChainImageFormat, VK_IMAGE_TILING_OPTIMAL,
+						VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+						VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
+						VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+						VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+						swapChainImages[i], offscreenImagesMemory[i]);
+		}
+	}
+
+	// Lesson 14
+	VkSurfaceFormatKHR chooseSwapSurfaceFormat(
+				const std::vector<VkSurfaceFormatKHR>& availableFormats)
+	{
+		for (const auto& availableFormat : availableFormats) {
+			if (availableFormat.format == VK_FORMAT_B8G8R8A8_SRGB &&
+				availableFormat.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+				return availableFormat;
+			}
+		}
+		
+		return availableFormats[0];
+	}
+
+	// Lesson 14
+	VkPresentModeKHR chooseSwapPresentMode(
+			const std::vector<VkPresentModeKHR>& availablePresentModes) {
+		// Benchmarks must not be capped by v-sync
+		if (benchFrames > 0) {
+			for (const auto& availablePresentMode : availablePresentModes) {
+				if (availablePresentMode == VK_PRESENT_MODE_IMMEDIATE_KHR) {
+					return availablePresentMode;
+				}
+			}
+		}
+		for (const auto& availablePresentMode : availablePresentModes) {
 			if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
 				return availablePresentMode;
 			}
@@ -834,12 +2615,44 @@ protected:
 		}
 	}
 	
+	// Color targets of the scaled scene, same format and size as the
+	// swapchain images so the render pass and pipelines do not change
+	void createSceneImages() {
+		if (!sceneTarget) {
+			return;
+		}
+		VkFormatProperties formatProperties;
+		vkGetPhysicalDeviceFormatProperties(physicalDevice, swapChainImageFormat,
+											&formatProperties);
+		VkFormatFeatureFlags blitFeatures = VK_FORMAT_FEATURE_BLIT_SRC_BIT |
+											VK_FORMAT_FEATURE_BLIT_DST_BIT |
+											VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+		if ((formatProperties.optimalTilingFeatures & blitFeatures) != blitFeatures) {
+			throw std::runtime_error("swapchain format does not support linear blitting, render scaling not supported!");
+		}
+
+		sceneImages.resize(swapChainImages.size());
+		sceneImagesMemory.resize(swapChainImages.size());
+		sceneImageViews.resize(swapChainImages.size());
+		for (size_t i = 0; i < swapChainImages.size(); i++) {
+			createImage(swapChainExtent.width, swapChainExtent.height, 1,
+						swapChainImageFormat, VK_IMAGE_TILING_OPTIMAL,
+						VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+						VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+						VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+						sceneImages[i], sceneImagesMemory[i]);
+			sceneImageViews[i] = createImageView(sceneImages[i], swapChainImageFormat,
+												 VK_IMAGE_ASPECT_COLOR_BIT, 1);
+		}
+	}
+
 	// Lesson 14
 	VkImageView createImageView(VkImage image, VkFormat format,
 								VkImageAspectFlags aspectFlags,
 								uint32_t mipLevels, 
 								VkImageViewType type = VK_IMAGE_VIEW_TYPE_2D, 
-								int layerCount = 1 // New in Lesson 23
+								int layerCount = 1, // New in Lesson 23
+								uint32_t baseMipLevel = 0
 								) {
 		VkImageViewCreateInfo viewInfo{};
 		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -847,7 +2660,7 @@ protected:
 		viewInfo.viewType = type;
 		viewInfo.format = format;
 		viewInfo.subresourceRange.aspectMask = aspectFlags;
-		viewInfo.subresourceRange.baseMipLevel = 0;
+		viewInfo.subresourceRange.baseMipLevel = baseMipLevel;
 		viewInfo.subresourceRange.levelCount = mipLevels;
 		viewInfo.subresourceRange.baseArrayLayer = 0;
 		viewInfo.subresourceRange.layerCount = layerCount;
@@ -868,7 +2681,9 @@ protected:
 		depthAttachment.format = VK_FORMAT_D32_SFLOAT;
 		depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
 		depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-		depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		// Kept for the Hi-Z pyramid of the occlusion culling
+		depthAttachment.storeOp = occlusionCulling ? VK_ATTACHMENT_STORE_OP_STORE :
+													 VK_ATTACHMENT_STORE_OP_DONT_CARE;
 		depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 		depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 		depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -888,7 +2703,11 @@ protected:
 		colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 		colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 		colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-		colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		// Offscreen images are never presented (and PRESENT_SRC needs the
+		// swapchain extension), they are left ready to be copied instead.
+		// So is the scaled scene, which is blitted to the swapchain image.
+		colorAttachment.finalLayout = headless || sceneTarget ?
+				VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 		
 		VkAttachmentReference colorAttachmentRef{};
 		colorAttachmentRef.attachment = 0;
@@ -909,6 +2728,17 @@ protected:
 		dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 		dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 
+		// The upscaling blit reads the scene after the render pass
+		VkSubpassDependency blitDependency{};
+		blitDependency.srcSubpass = 0;
+		blitDependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+		blitDependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		blitDependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		blitDependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+		blitDependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+		std::array<VkSubpassDependency, 2> dependencies = {dependency, blitDependency};
+
 		std::array<VkAttachmentDescription, 2> attachments =
 								{colorAttachment, depthAttachment};
 
@@ -918,8 +2748,8 @@ protected:
 		renderPassInfo.pAttachments = attachments.data();
 		renderPassInfo.subpassCount = 1;
 		renderPassInfo.pSubpasses = &subpass;
-		renderPassInfo.dependencyCount = 1;
-		renderPassInfo.pDependencies = &dependency;
+		renderPassInfo.dependencyCount = sceneTarget ? 2 : 1;
+		renderPassInfo.pDependencies = dependencies.data();
 
 		VkResult result = vkCreateRenderPass(device, &renderPassInfo, nullptr,
 					&renderPass);
@@ -927,6 +2757,35 @@ protected:
 		 	PrintVkError(result);
 			throw std::runtime_error("failed to create render pass!");
 		}		
+
+		// The late pass of the occlusion culling draws over the frame:
+		// compatible with renderPass (same framebuffers and pipelines), but
+		// it loads the attachments instead of clearing them
+		if (occlusionCulling) {
+			colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+			colorAttachment.initialLayout = colorAttachment.finalLayout;
+			depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+			// hiZ is built once per frame, before this pass, since the late
+			// culling tests against it; the next frame's early culling reuses
+			// it. Nothing reads the depth afterwards (the next frame clears
+			// it), so it is not stored: the objects drawn here are simply not
+			// occluders until they are drawn by an early pass, which can
+			// only make the culling keep more objects, never fewer.
+			depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+			depthAttachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+			attachments = {colorAttachment, depthAttachment};
+
+			dependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+			dependencies[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+			dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+											VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+			result = vkCreateRenderPass(device, &renderPassInfo, nullptr, &lateRenderPass);
+			if (result != VK_SUCCESS) {
+			 	PrintVkError(result);
+				throw std::runtime_error("failed to create late render pass!");
+			}
+		}
 	}
 
 	// Lesson 22.2 
@@ -934,7 +2793,7 @@ protected:
 		swapChainFramebuffers.resize(swapChainImageViews.size());
 		for (size_t i = 0; i < swapChainImageViews.size(); i++) {
 			std::array<VkImageView, 2> attachments = {
-				swapChainImageViews[i],
+				sceneTarget ? sceneImageViews[i] : swapChainImageViews[i],
 				depthImageView
 			};
 
@@ -981,7 +2840,8 @@ protected:
 		
 		createImage(swapChainExtent.width, swapChainExtent.height, 1, depthFormat,
 					VK_IMAGE_TILING_OPTIMAL,
-					VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+					VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT |
+					(occlusionCulling ? VK_IMAGE_USAGE_SAMPLED_BIT : 0),
 					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
 					depthImage, depthImageMemory);
 		depthImageView = createImageView(depthImage, depthFormat,
@@ -994,7 +2854,7 @@ protected:
 					 VkFormat format,
 				 	 VkImageTiling tiling, VkImageUsageFlags usage,
 				 	 VkMemoryPropertyFlags properties, VkImage& image,
-				 	 VkDeviceMemory& imageMemory) {		
+				 	 Allocation& imageMemory) {		
 		VkImageCreateInfo imageInfo{};
 		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 		imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1020,17 +2880,9 @@ protected:
 		VkMemoryRequirements memRequirements;
 		vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-											properties);
-		if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) !=
-								VK_SUCCESS) {
-			throw std::runtime_error("failed to allocate image memory!");
-		}
-
-		vkBindImageMemory(device, image, imageMemory, 0);
+		imageMemory = allocator.allocate(memRequirements, properties,
+										 tiling == VK_IMAGE_TILING_LINEAR);
+		vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
 	}
 
 	// New - Lesson 23
@@ -1208,7 +3060,74 @@ protected:
 		
 		vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
 	}
-	
+
+	void beginUploadBatch() {
+		if (uploadCommandBuffer == VK_NULL_HANDLE) {
+			uploadCommandBuffer = beginSingleTimeCommands();
+			uploadBatchBytes = 0;
+		}
+	}
+
+	// Copies size bytes from src into dst (a TRANSFER_DST buffer) through a
+	// staging buffer. Outside of a batch the copy is submitted immediately.
+	void uploadBuffer(VkBuffer dst, const void *src, VkDeviceSize size) {
+		bool standalone = (uploadCommandBuffer == VK_NULL_HANDLE);
+		beginUploadBatch();
+
+		VkBuffer stagingBuffer;
+		Allocation stagingBufferMemory;
+		createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 stagingBuffer, stagingBufferMemory);
+		memcpy(stagingBufferMemory.mapped, src, (size_t) size);
+
+		VkBufferCopy copyRegion{};
+		copyRegion.srcOffset = 0;
+		copyRegion.dstOffset = 0;
+		copyRegion.size = size;
+		vkCmdCopyBuffer(uploadCommandBuffer, stagingBuffer, dst, 1, &copyRegion);
+
+		uploadStagingBuffers.push_back(stagingBuffer);
+		uploadStagingBuffersMemory.push_back(stagingBufferMemory);
+		uploadBatchBytes += size;
+		uploadedBytes += size;
+
+		if (standalone) {
+			flushUploadBatch();
+		}
+	}
+
+	void flushUploadBatch() {
+		if (uploadCommandBuffer == VK_NULL_HANDLE) {
+			return;
+		}
+
+		// Make the copies visible to every later vertex/index fetch
+		VkMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+								VK_ACCESS_INDEX_READ_BIT;
+		vkCmdPipelineBarrier(uploadCommandBuffer,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+							 1, &barrier, 0, nullptr, 0, nullptr);
+
+		endSingleTimeCommands(uploadCommandBuffer);
+		uploadCommandBuffer = VK_NULL_HANDLE;
+
+		if (uploadStagingBuffers.size() > 1) {
+			std::cout << "Uploaded " << uploadStagingBuffers.size() << " buffers ("
+					  << uploadBatchBytes / 1024 << " KB) in one submission\n";
+		}
+		for (size_t i = 0; i < uploadStagingBuffers.size(); i++) {
+			vkDestroyBuffer(device, uploadStagingBuffers[i], nullptr);
+			allocator.free(uploadStagingBuffersMemory[i]);
+		}
+		uploadStagingBuffers.clear();
+		uploadStagingBuffersMemory.clear();
+	}
 
 
 	// Lesson 22.4
@@ -1216,7 +3135,7 @@ protected:
 	// Lesson 21
 	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 					  VkMemoryPropertyFlags properties,
-					  VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+					  VkBuffer& buffer, Allocation& bufferMemory) {
 		VkBufferCreateInfo bufferInfo{};
 		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 		bufferInfo.size = size;
@@ -1233,20 +3152,8 @@ protected:
 		VkMemoryRequirements memRequirements;
 		vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 		
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex =
-				findMemoryType(memRequirements.memoryTypeBits, properties);
-
-		result = vkAllocateMemory(device, &allocInfo, nullptr,
-				&bufferMemory);
-		if (result != VK_SUCCESS) {
-		 	PrintVkError(result);
-			throw std::runtime_error("failed to allocate vertex buffer memory!");
-		}
-		
-		vkBindBufferMemory(device, buffer, bufferMemory, 0);	
+		bufferMemory = allocator.allocate(memRequirements, properties, true);
+		vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
 	}
 	
 	// Lesson 21
@@ -1269,7 +3176,7 @@ protected:
     // Lesson 21
 	void createDescriptorPool() {
 		std::array<VkDescriptorPoolSize, 2> poolSizes{};
-		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		poolSizes[0].descriptorCount = static_cast<uint32_t>(uniformBlocksInPool *
 															 swapChainImages.size());
 		// New - Lesson 23
@@ -1298,6 +3205,39 @@ protected:
     void createCommandBuffers() {
     	// Lesson 13
     	commandBuffers.resize(swapChainFramebuffers.size());
+
+		if (rerecordCommandBuffers) {
+			// One transient pool per swapchain image, reset before recording
+			frameCommandPools.resize(commandBuffers.size());
+			for (size_t i = 0; i < commandBuffers.size(); i++) {
+				VkCommandPoolCreateInfo poolInfo{};
+				poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+				poolInfo.queueFamilyIndex = findQueueFamilies(physicalDevice).graphicsFamily.value();
+				poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+				VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr,
+													  &frameCommandPools[i]);
+				if (result != VK_SUCCESS) {
+				 	PrintVkError(result);
+					throw std::runtime_error("failed to create frame command pool!");
+				}
+
+				VkCommandBufferAllocateInfo allocInfo{};
+				allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+				allocInfo.commandPool = frameCommandPools[i];
+				allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+				allocInfo.commandBufferCount = 1;
+
+				result = vkAllocateCommandBuffers(device, &allocInfo,
+												  &commandBuffers[i]);
+				if (result != VK_SUCCESS) {
+				 	PrintVkError(result);
+					throw std::runtime_error("failed to allocate command buffers!");
+				}
+			}
+			// Recorded in drawFrame
+			return;
+		}
     	
     	VkCommandBufferAllocateInfo allocInfo{};
 		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -1312,341 +3252,3848 @@ protected:
 			throw std::runtime_error("failed to allocate command buffers!");
 		}
 		
-		// Lesson 22.5 --- Draw calls
-		// This is where the commands that actually draw something on screen are!
 		for (size_t i = 0; i < commandBuffers.size(); i++) {
-			VkCommandBufferBeginInfo beginInfo{};
-			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-			beginInfo.flags = 0; // Optional
-			beginInfo.pInheritanceInfo = nullptr; // Optional
-
-			if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
-						VK_SUCCESS) {
-				throw std::runtime_error("failed to begin recording command buffer!");
-			}
-			
-			VkRenderPassBeginInfo renderPassInfo{};
-			renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-			renderPassInfo.renderPass = renderPass; 
-			renderPassInfo.framebuffer = swapChainFramebuffers[i];
-			renderPassInfo.renderArea.offset = {0, 0};
-			renderPassInfo.renderArea.extent = swapChainExtent;
-	
-			std::array<VkClearValue, 2> clearValues{};
-			clearValues[0].color = initialBackgroundColor;
-			clearValues[1].depthStencil = {1.0f, 0};
-	
-			renderPassInfo.clearValueCount =
-							static_cast<uint32_t>(clearValues.size());
-			renderPassInfo.pClearValues = clearValues.data();
-			
-			vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
-					VK_SUBPASS_CONTENTS_INLINE);			
-	
-
-			populateCommandBuffer(commandBuffers[i], i);
-			
+			recordCommandBuffer(i);
+		}
+	}
 
-			vkCmdEndRenderPass(commandBuffers[i]);
+	// Lesson 22.5 --- Draw calls
+	// This is where the commands that actually draw something on screen are!
+	void recordCommandBuffer(size_t i) {
+		PROFILE_SCOPE("recordCommandBuffer");
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = rerecordCommandBuffers ?
+						  VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT : 0;
+		beginInfo.pInheritanceInfo = nullptr; // Optional
 
-			if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-				throw std::runtime_error("failed to record command buffer!");
-			}
+		if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
+					VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording command buffer!");
 		}
-	}
-    
-    // Lesson 22.5
-    void createSyncObjects() {
-    	imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    	renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
-    	imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
-    	    	
-    	VkSemaphoreCreateInfo semaphoreInfo{};
-		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 		
-		VkFenceCreateInfo fenceInfo{};
-		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+		VkRenderPassBeginInfo renderPassInfo{};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = renderPass; 
+		renderPassInfo.framebuffer = swapChainFramebuffers[i];
+		renderPassInfo.renderArea.offset = {0, 0};
+		renderPassInfo.renderArea.extent = renderExtent();
+
+		std::array<VkClearValue, 2> clearValues{};
+		clearValues[0].color = initialBackgroundColor;
+		clearValues[1].depthStencil = {1.0f, 0};
+
+		renderPassInfo.clearValueCount =
+						static_cast<uint32_t>(clearValues.size());
+		renderPassInfo.pClearValues = clearValues.data();
 		
-		for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-			VkResult result1 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
-								&imageAvailableSemaphores[i]);
-			VkResult result2 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
-								&renderFinishedSemaphores[i]);
-			VkResult result3 = vkCreateFence(device, &fenceInfo, nullptr,
-								&inFlightFences[i]);
-			if (result1 != VK_SUCCESS ||
-				result2 != VK_SUCCESS ||
-				result3 != VK_SUCCESS) {
-			 	PrintVkError(result1);
-			 	PrintVkError(result2);
-			 	PrintVkError(result3);
-				throw std::runtime_error("failed to create synchronization objects for a frame!!");
-			}
+		if (frameQueryPool != VK_NULL_HANDLE) {
+			vkCmdResetQueryPool(commandBuffers[i], frameQueryPool, 2 * i, 2);
+			vkCmdWriteTimestamp(commandBuffers[i], VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+								frameQueryPool, 2 * i);
 		}
-	}
-    
-    // Lesson 22.6 --- Main Rendering Loop
-    void mainLoop() {
-        while (!glfwWindowShouldClose(window)) {
-            glfwPollEvents();
-            drawFrame();
-        }
-        
-        vkDeviceWaitIdle(device);
-    }
-    
-    // Lesson 22.6
-    void drawFrame() {
-		vkWaitForFences(device, 1, &inFlightFences[currentFrame],
-						VK_TRUE, UINT64_MAX);
-		
-		uint32_t imageIndex;
-		
-		VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
-				imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
 
-		if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
-			vkWaitForFences(device, 1, &imagesInFlight[imageIndex],
-							VK_TRUE, UINT64_MAX);
-		}
-		imagesInFlight[imageIndex] = inFlightFences[currentFrame];
-		
-		updateUniformBuffer(imageIndex);
-		
-		VkSubmitInfo submitInfo{};
-		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-		VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
-		VkPipelineStageFlags waitStages[] =
-			{VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-		submitInfo.waitSemaphoreCount = 1;
-		submitInfo.pWaitSemaphores = waitSemaphores;
-		submitInfo.pWaitDstStageMask = waitStages;
-		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
-		VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
-		submitInfo.signalSemaphoreCount = 1;
-		submitInfo.pSignalSemaphores = signalSemaphores;
-		
-		vkResetFences(device, 1, &inFlightFences[currentFrame]);
+		gpuProfiler.beginFrame(commandBuffers[i], static_cast<uint32_t>(i));
 
-		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo,
-				inFlightFences[currentFrame]) != VK_SUCCESS) {
-			throw std::runtime_error("failed to submit draw command buffer!");
+		if (gpuCuller.cullPipeline != VK_NULL_HANDLE) {
+			gpuCuller.recordCull(commandBuffers[i], static_cast<uint32_t>(i));
 		}
-		
-		VkPresentInfoKHR presentInfo{};
-		presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-		presentInfo.waitSemaphoreCount = 1;
-		presentInfo.pWaitSemaphores = signalSemaphores;
-		
-		VkSwapchainKHR swapChains[] = {swapChain};
-		presentInfo.swapchainCount = 1;
-		presentInfo.pSwapchains = swapChains;
-		presentInfo.pImageIndices = &imageIndex;
-		presentInfo.pResults = nullptr; // Optional
-		
-		result = vkQueuePresentKHR(presentQueue, &presentInfo);
 
-		currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
-    }
-
-	virtual void updateUniformBuffer(uint32_t currentImage) = 0;
+		recordedDraws = 0;
+		recordedTriangles = 0;
+		recordedBinds = 0;
+		avoidedBinds = 0;
+		meshletsTested = 0;
+		meshletsCulled = 0;
+		if (indirectRing.buffer != VK_NULL_HANDLE) {
+			indirectRing.begin();
+		}
+		bool secondaries = rerecordCommandBuffers && recordThreadCount() > 0;
+		vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
+				secondaries ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS :
+							  VK_SUBPASS_CONTENTS_INLINE);			
 
-	virtual void localCleanup() = 0;
-	
-	// All lessons
+		if (secondaries) {
+			recordSecondaryCommandBuffers(i);
+		} else {
+			setViewport(commandBuffers[i]);
+			populateCommandBuffer(commandBuffers[i], i);
+		}
+		
 
-	
-    void cleanup() {
-		vkDestroyImageView(device, depthImageView, nullptr);
-		vkDestroyImage(device, depthImage, nullptr);
-		vkFreeMemory(device, depthImageMemory, nullptr);
+		vkCmdEndRenderPass(commandBuffers[i]);
+		if (occlusionCulling && gpuCuller.cullPipeline != VK_NULL_HANDLE) {
+			recordLateDraws(commandBuffers[i], i);
+		}
+		if (sceneTarget) {
+			recordUpscale(commandBuffers[i], i);
+		}
+		imageDrawCounts.resize(commandBuffers.size());
+		imageDrawCounts[i] = recordedDraws;
+		imageTriangleCounts.resize(commandBuffers.size());
+		imageTriangleCounts[i] = recordedTriangles;
+
+		if (frameQueryPool != VK_NULL_HANDLE) {
+			vkCmdWriteTimestamp(commandBuffers[i], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+								frameQueryPool, 2 * i + 1);
+		}
 
-		for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
-			vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
+		if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
 		}
-		
-		vkFreeCommandBuffers(device, commandPool,
-				static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+	}
 
-		vkDestroyRenderPass(device, renderPass, nullptr);
+	// Late pass of the occlusion culling (see GpuCuller): rebuilds hiZ from
+	// the depth just rendered, tests again the objects the early pass found
+	// hidden and draws those visible now over the frame, with the pipeline
+	// and sets of the gpuCuller item of drawList
+	void recordLateDraws(VkCommandBuffer commandBuffer, size_t i) {
+		hiZ.record(commandBuffer);
+		const DrawItem *objects = nullptr;
+		for (const DrawItem& item : drawList) {
+			if (item.gpuObjects == &gpuCuller) {
+				objects = &item;
+			}
+		}
+		if (objects == nullptr) {
+			return;
+		}
+		uint32_t image = static_cast<uint32_t>(i);
+		gpuCuller.recordCull(commandBuffer, image, GpuCuller::LATE_PASS);
+
+		VkRenderPassBeginInfo renderPassInfo{};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = lateRenderPass;
+		renderPassInfo.framebuffer = swapChainFramebuffers[i];
+		renderPassInfo.renderArea.offset = {0, 0};
+		renderPassInfo.renderArea.extent = renderExtent();
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+		setViewport(commandBuffer);
+		int run = gpuProfiler.beginRun(commandBuffer, image, objects->pipeline->profilerSection);
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+						  objects->pipeline->graphicsPipeline);
+		for (int s = 0; s < objects->setCount; s++) {
+			objects->sets[s]->bind(commandBuffer, *objects->pipeline, s, image);
+		}
+		gpuCuller.draw(commandBuffer, image, *objects->pipeline, objects->setCount,
+					   GpuCuller::LATE_PASS);
+		gpuProfiler.endRun(commandBuffer, image, run);
+		vkCmdEndRenderPass(commandBuffer);
+		recordedDraws++;
+	}
 
-		for (size_t i = 0; i < swapChainImageViews.size(); i++){
-			vkDestroyImageView(device, swapChainImageViews[i], nullptr);
+	// Area of the framebuffer the scene is rendered to
+	VkExtent2D renderExtent() {
+		if (!sceneTarget) {
+			return swapChainExtent;
 		}
+		return {
+			std::max(1u, static_cast<uint32_t>(swapChainExtent.width * renderScale + 0.5f)),
+			std::max(1u, static_cast<uint32_t>(swapChainExtent.height * renderScale + 0.5f))
+		};
+	}
+
+	// Stretches the renderExtent() part of sceneImages[i] over swapchain
+	// image i, with bilinear filtering
+	void recordUpscale(VkCommandBuffer commandBuffer, size_t i) {
+		VkImageMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = swapChainImages[i];
+		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		barrier.subresourceRange.baseMipLevel = 0;
+		barrier.subresourceRange.levelCount = 1;
+		barrier.subresourceRange.baseArrayLayer = 0;
+		barrier.subresourceRange.layerCount = 1;
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+		// COLOR_ATTACHMENT_OUTPUT is the stage the acquire semaphore is
+		// waited at, so the blit cannot start before the image is ours
+		vkCmdPipelineBarrier(commandBuffer,
+							 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+							 0, nullptr, 0, nullptr,
+							 1, &barrier);
+
+		VkExtent2D extent = renderExtent();
+		VkImageBlit blit{};
+		blit.srcOffsets[0] = { 0, 0, 0 };
+		blit.srcOffsets[1] = { (int32_t)extent.width, (int32_t)extent.height, 1 };
+		blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		blit.srcSubresource.mipLevel = 0;
+		blit.srcSubresource.baseArrayLayer = 0;
+		blit.srcSubresource.layerCount = 1;
+		blit.dstOffsets[0] = { 0, 0, 0 };
+		blit.dstOffsets[1] = { (int32_t)swapChainExtent.width,
+							   (int32_t)swapChainExtent.height, 1 };
+		blit.dstSubresource = blit.srcSubresource;
+
+		vkCmdBlitImage(commandBuffer, sceneImages[i],
+					   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+					   swapChainImages[i], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+					   &blit, VK_FILTER_LINEAR);
+
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL :
+									   VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = 0;
+		vkCmdPipelineBarrier(commandBuffer,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+							 0, nullptr, 0, nullptr,
+							 1, &barrier);
+	}
+
+	// --target-fps: GPU cost is roughly proportional to the pixel count,
+	// so the scale that would take gpuMs to the target is
+	// renderScale * sqrt(target / gpuMs). The measure is a few frames late
+	// (frames in flight), so the scale only moves a quarter of the way
+	// there, and not at all while gpuMs is within 85-100% of the target.
+	void updateRenderScale(float gpuMs) {
+		if (targetFrameMs <= 0.0f || gpuMs <= 0.0f) {
+			return;
+		}
+		if (gpuMs <= targetFrameMs && gpuMs >= 0.85f * targetFrameMs) {
+			return;
+		}
+		float wanted = renderScale * std::sqrt(0.925f * targetFrameMs / gpuMs);
+		renderScale += 0.25f * (wanted - renderScale);
+		renderScale = std::clamp(renderScale, minRenderScale, 1.0f);
+	}
+
+	// Sets the dynamic viewport and scissor of the pipelines to renderExtent()
+	void setViewport(VkCommandBuffer commandBuffer) {
+		VkExtent2D extent = renderExtent();
+
+		VkViewport viewport{};
+		viewport.x = 0.0f;
+		viewport.y = 0.0f;
+		viewport.width = (float) extent.width;
+		viewport.height = (float) extent.height;
+		viewport.minDepth = 0.0f;
+		viewport.maxDepth = 1.0f;
+		vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+		VkRect2D scissor{};
+		scissor.offset = {0, 0};
+		scissor.extent = extent;
+		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+	}
+
+	// Fills drawList with what populateCommandBuffer would draw. Needed
+	// only for the parallel recording.
+	virtual void buildDrawList() {}
+
+	// Camera of the frame: updates frustum and the visible rooms, and
+	// keeps what selectLod needs
+	void setView(const glm::vec3& eye, const glm::mat4& view, const glm::mat4& proj) {
+		viewProj = proj * view;
+		frustum.update(viewProj);
+		if (!roomGraph.rooms.empty()) {
+			roomGraph.findVisible(eye, viewProj);
+		}
+		viewEye = eye;
+		pixelsPerUnit = std::abs(proj[1][1]) * renderExtent().height * 0.5f;
+	}
+
+	// Level of detail to draw model with: the coarsest whose error, seen
+	// from viewEye, stays under lodPixelError pixels on screen. lod is the
+	// level picked last time for the same object: the error must go
+	// LOD_HYSTERESIS below the threshold to switch to a coarser level and
+	// LOD_HYSTERESIS above it to come back, so an object at a boundary does
+	// not flip between two levels every frame. For an instanced draw the
+	// nearest instance decides.
+	int selectLod(const Model& model, const glm::mat4& world, int& lod,
+				  const InstanceBuffer *instances = nullptr) {
+		const float LOD_HYSTERESIS = 0.2f;
+		if (model.lods.empty() || !lodSelection || !rerecordCommandBuffers ||
+			pixelsPerUnit == 0.0f) {
+			lod = 0;
+			return lod;
+		}
+
+		// Pixels per model unit at the nearest point of the bounding sphere
+		glm::vec3 center = (model.boundsMin + model.boundsMax) * 0.5f;
+		float pixels = 0.0f;
+		auto measure = [&](const glm::mat4& m) {
+			float scale = std::sqrt(std::max({glm::dot(glm::vec3(m[0]), glm::vec3(m[0])),
+											  glm::dot(glm::vec3(m[1]), glm::vec3(m[1])),
+											  glm::dot(glm::vec3(m[2]), glm::vec3(m[2]))}));
+			float distance = glm::length(glm::vec3(m * glm::vec4(center, 1.0f)) - viewEye) -
+							 model.boundsRadius * scale;
+			pixels = std::max(pixels, scale * pixelsPerUnit / std::max(distance, 0.01f));
+		};
+		if (instances != nullptr) {
+			for (const InstanceData& instance : instances->instances) {
+				measure(world * instance.model);
+			}
+		} else {
+			measure(world);
+		}
+
+		int last = static_cast<int>(model.lods.size()) - 1;
+		lod = std::clamp(lod, 0, last);
+		while (lod < last &&
+			   model.lods[lod + 1].error * pixels < lodPixelError * (1.0f - LOD_HYSTERESIS)) {
+			lod++;
+		}
+		while (lod > 0 &&
+			   model.lods[lod].error * pixels > lodPixelError * (1.0f + LOD_HYSTERESIS)) {
+			lod--;
+		}
+		return lod;
+	}
+
+	// Sets the index range of item to level lod of its model
+	void lodRange(DrawItem& item, int lod) {
+		const ModelLod range = item.model->lod(lod);
+		item.firstIndex = range.firstIndex;
+		item.indexCount = range.indexCount;
+	}
+
+	// Removes from drawList the draws in rooms that are not visible and
+	// those whose bounds are outside frustum. An instanced draw stays as
+	// long as one of its instances is visible.
+	void cullDrawList() {
+		cullTested = cullCulled = portalCulled = 0;
+		bool useFrustum = frustumCulling && frustum.valid;
+		bool usePortals = portalCulling && !roomGraph.visible.empty();
+		if (rerecordCommandBuffers && (useFrustum || usePortals)) {
+			PROFILE_SCOPE("cullDrawList");
+			size_t kept = 0;
+			for (size_t d = 0; d < drawList.size(); d++) {
+				const DrawItem& item = drawList[d];
+				bool inRoom = usePortals && item.room >= 0;
+				bool bounded = useFrustum && item.world != nullptr;
+				if (inRoom || bounded) {
+					cullTested++;
+				}
+				bool visible = true;
+				if (inRoom && !roomGraph.visible[item.room]) {
+					visible = false;
+					portalCulled++;
+				}
+				if (visible && bounded) {
+					if (item.instances != nullptr) {
+						visible = false;
+						for (const InstanceData& instance : item.instances->instances) {
+							if (frustum.modelVisible(*item.model, *item.world * instance.model)) {
+								visible = true;
+								break;
+							}
+						}
+					} else {
+						visible = frustum.modelVisible(*item.model, *item.world);
+					}
+				}
+				if (visible) {
+					drawList[kept++] = item;
+				} else {
+					cullCulled++;
+				}
+			}
+			drawList.resize(kept);
+		}
+		cullDrawn = static_cast<uint32_t>(drawList.size());
+	}
+
+	// Orders drawList so that draws sharing state are recorded together
+	void sortDrawList() {
+		if (drawSorting && drawList.size() > 1) {
+			PROFILE_SCOPE("sortDrawList");
+			renderQueue.sort(drawList, viewEye, roomGraph);
+		}
+	}
+
+	// Multiplies the repeated objects of the scene for benchmarkRecording
+	virtual void scaleBenchmarkScene(int copies) {}
+
+	int recordThreadCount() {
+		int workers = static_cast<int>(jobs.size());
+		return recordThreads < 0 ? workers : std::min(recordThreads, workers);
+	}
+
+	// Pools are created the first time a piece index is used, then reset
+	VkCommandBuffer acquireSecondaryCommandBuffer(size_t image, size_t piece) {
+		secondaryCommandPools.resize(swapChainImages.size());
+		secondaryCommandBuffers.resize(swapChainImages.size());
+		std::vector<VkCommandPool>& pools = secondaryCommandPools[image];
+		std::vector<VkCommandBuffer>& buffers = secondaryCommandBuffers[image];
+
+		if (piece >= pools.size()) {
+			pools.resize(piece + 1, VK_NULL_HANDLE);
+			buffers.resize(piece + 1, VK_NULL_HANDLE);
+		}
+		if (pools[piece] == VK_NULL_HANDLE) {
+			VkCommandPoolCreateInfo poolInfo{};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.queueFamilyIndex = findQueueFamilies(physicalDevice).graphicsFamily.value();
+			poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+			VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr,
+												  &pools[piece]);
+			if (result != VK_SUCCESS) {
+			 	PrintVkError(result);
+				throw std::runtime_error("failed to create secondary command pool!");
+			}
+
+			VkCommandBufferAllocateInfo allocInfo{};
+			allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+			allocInfo.commandPool = pools[piece];
+			allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+			allocInfo.commandBufferCount = 1;
+
+			result = vkAllocateCommandBuffers(device, &allocInfo, &buffers[piece]);
+			if (result != VK_SUCCESS) {
+			 	PrintVkError(result);
+				throw std::runtime_error("failed to allocate secondary command buffer!");
+			}
+		} else {
+			vkResetCommandPool(device, pools[piece], 0);
+		}
+		return buffers[piece];
+	}
+
+	void recordSecondaryCommandBuffers(size_t i) {
+		buildDrawList();
+		cullDrawList();
+		sortDrawList();
+		if (drawList.empty()) {
+			return;
+		}
+
+		// Cut the list at pipeline changes and every maxDraws draws
+		size_t threads = recordThreadCount();
+		size_t maxDraws = (drawList.size() + threads - 1) / threads;
+		std::vector<std::pair<size_t, size_t>> pieces;	// first, count
+		size_t first = 0;
+		for (size_t k = 1; k <= drawList.size(); k++) {
+			if (k == drawList.size() ||
+				drawList[k].pipeline != drawList[first].pipeline ||
+				k - first == maxDraws) {
+				pieces.push_back({first, k - first});
+				first = k;
+			}
+		}
+
+		std::vector<VkCommandBuffer> buffers(pieces.size());
+		for (size_t p = 0; p < pieces.size(); p++) {
+			buffers[p] = acquireSecondaryCommandBuffer(i, p);
+		}
+
+		auto record = [this, i, &buffers, &pieces](size_t p) {
+			PROFILE_SCOPE("record secondary command buffer");
+			VkCommandBufferInheritanceInfo inheritanceInfo{};
+			inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+			inheritanceInfo.renderPass = renderPass;
+			inheritanceInfo.subpass = 0;
+			inheritanceInfo.framebuffer = swapChainFramebuffers[i];
+
+			VkCommandBufferBeginInfo beginInfo{};
+			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+			beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+							  VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+			beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+			if (vkBeginCommandBuffer(buffers[p], &beginInfo) != VK_SUCCESS) {
+				throw std::runtime_error("failed to begin recording secondary command buffer!");
+			}
+			// Dynamic state is not inherited from the primary
+			setViewport(buffers[p]);
+			recordDrawList(buffers[p], i, &drawList[pieces[p].first], pieces[p].second);
+			if (vkEndCommandBuffer(buffers[p]) != VK_SUCCESS) {
+				throw std::runtime_error("failed to record secondary command buffer!");
+			}
+		};
+
+		if (threads > 1 && pieces.size() > 1) {
+			std::vector<std::future<void>> pending;
+			for (size_t p = 0; p < pieces.size(); p++) {
+				pending.push_back(jobs.submit([&record, p]() { record(p); }));
+			}
+			for (std::future<void>& f : pending) {
+				f.get();
+			}
+		} else {
+			for (size_t p = 0; p < pieces.size(); p++) {
+				record(p);
+			}
+		}
+
+		vkCmdExecuteCommands(commandBuffers[i], static_cast<uint32_t>(buffers.size()),
+							 buffers.data());
+	}
+
+	// Records the command buffer of image 0 over and over for several scene
+	// sizes and thread counts (nothing is submitted)
+	void benchmarkRecording() {
+		vkDeviceWaitIdle(device);
+		const int runs = 50;
+
+		std::vector<int> threadCounts = { 0 };
+		for (int t = 1; t < (int)jobs.size(); t *= 2) {
+			threadCounts.push_back(t);
+		}
+		threadCounts.push_back(jobs.size());
+
+		for (int copies : { 1, 16, 64, 256 }) {
+			scaleBenchmarkScene(copies);
+			for (int threads : threadCounts) {
+				recordThreads = threads;
+				float totalMs = 0.0f;
+				for (int r = 0; r < runs + 5; r++) {
+					auto start = std::chrono::high_resolution_clock::now();
+					vkResetCommandPool(device, frameCommandPools[0], 0);
+					recordCommandBuffer(0);
+					float ms = std::chrono::duration<float, std::chrono::milliseconds::period>
+						(std::chrono::high_resolution_clock::now() - start).count();
+					if (r >= 5) {
+						totalMs += ms;
+					}
+				}
+				buildDrawList();
+				std::cout << "Recording: " << drawList.size() << " draws, "
+						  << threads << (threads == 0 ? " threads (inline)" : " threads")
+						  << ", " << totalMs / runs << " ms\n";
+			}
+		}
+		scaleBenchmarkScene(1);
+	}
+
+	// Records a draw list, binding a pipeline, a descriptor set or a buffer
+	// only when it is not the one already bound
+	void recordDrawList(VkCommandBuffer commandBuffer, int currentImage,
+						const std::vector<DrawItem>& items) {
+		recordDrawList(commandBuffer, currentImage, items.data(), items.size());
+	}
+
+	void recordDrawList(VkCommandBuffer commandBuffer, int currentImage,
+						const DrawItem *items, size_t count) {
+		Pipeline *boundPipeline = nullptr;
+		// Models packed in a MeshRegistry share their buffers: they are
+		// bound again only when the next draw uses different ones
+		VkBuffer boundVertexBuffer = VK_NULL_HANDLE;
+		VkBuffer boundInstanceBuffer = VK_NULL_HANDLE;
+		VkBuffer boundIndexBuffer = VK_NULL_HANDLE;
+		// Sets still bound, by set number. A pipeline switch keeps those
+		// the two layouts agree on (Pipeline::compatibleSets)
+		std::array<DescriptorSet *, MAX_DRAW_SETS> boundSets{};
+		// Only the skipped set binds count as avoided: pipelines and
+		// buffers were already bound only on change before the sets were
+		// tracked
+		uint32_t binds = 0, avoided = 0;
+		auto bindSets = [&](const DrawItem& item) {
+			for (int s = 0; s < item.setCount; s++) {
+				if (item.sets[s] == boundSets[s]) {
+					avoided++;
+					continue;
+				}
+				item.sets[s]->bind(commandBuffer, *item.pipeline, s, currentImage);
+				boundSets[s] = item.sets[s];
+				binds++;
+			}
+		};
+		int run = -1;
+		uint64_t triangles = 0;
+		for (size_t d = 0; d < count; d++) {
+			const DrawItem& item = items[d];
+			if (item.pipeline != boundPipeline) {
+				if (boundPipeline == nullptr ||
+					item.pipeline->profilerSection != boundPipeline->profilerSection) {
+					gpuProfiler.endRun(commandBuffer, currentImage, run);
+					run = gpuProfiler.beginRun(commandBuffer, currentImage,
+											   item.pipeline->profilerSection);
+				}
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+								  item.pipeline->graphicsPipeline);
+				int kept = boundPipeline ? boundPipeline->compatibleSets(*item.pipeline) : 0;
+				for (int s = kept; s < MAX_DRAW_SETS; s++) {
+					boundSets[s] = nullptr;
+				}
+				boundPipeline = item.pipeline;
+				binds++;
+			}
+
+			if (item.gpuObjects != nullptr) {
+				bindSets(item);
+				// The culler binds its own buffers and the set after the item's
+				item.gpuObjects->draw(commandBuffer, currentImage, *item.pipeline, item.setCount);
+				for (int s = item.setCount; s < MAX_DRAW_SETS; s++) {
+					boundSets[s] = nullptr;
+				}
+				boundVertexBuffer = item.gpuObjects->registry->vertexBuffer;
+				boundIndexBuffer = item.gpuObjects->registry->indexBuffer;
+				continue;
+			}
+
+			const Model& model = *item.model;
+			VkBuffer instanceBuffer = item.instances ? item.instances->buffer : VK_NULL_HANDLE;
+			if (model.vertexBuffer != boundVertexBuffer ||
+				(instanceBuffer != VK_NULL_HANDLE && instanceBuffer != boundInstanceBuffer)) {
+				VkBuffer vertexBuffers[] = { model.vertexBuffer, instanceBuffer };
+				VkDeviceSize offsets[] = { 0, 0 };
+				vkCmdBindVertexBuffers(commandBuffer, 0, item.instances ? 2 : 1,
+									   vertexBuffers, offsets);
+				boundVertexBuffer = model.vertexBuffer;
+				if (instanceBuffer != VK_NULL_HANDLE) {
+					boundInstanceBuffer = instanceBuffer;
+				}
+				binds++;
+			}
+			if (model.indexBuffer != boundIndexBuffer) {
+				vkCmdBindIndexBuffer(commandBuffer, model.indexBuffer, 0,
+									 VK_INDEX_TYPE_UINT32);
+				boundIndexBuffer = model.indexBuffer;
+				binds++;
+			}
+
+			bindSets(item);
+
+			uint32_t indexCount = item.indexCount ? item.indexCount : model.indexCount;
+			uint32_t instanceCount = item.instances ? item.instances->instanceCount : 1;
+			uint32_t meshletIndices = 0;
+			if (recordMeshletDraws(commandBuffer, currentImage, item, meshletIndices)) {
+				triangles += meshletIndices / 3;
+				continue;
+			}
+			vkCmdDrawIndexed(commandBuffer, indexCount, instanceCount,
+							 model.baseIndex + item.firstIndex, model.vertexOffset, 0);
+			triangles += (uint64_t)indexCount / 3 * instanceCount;
+		}
+		gpuProfiler.endRun(commandBuffer, currentImage, run);
+		recordedDraws += static_cast<uint32_t>(count);
+		recordedTriangles += triangles;
+		recordedBinds += binds;
+		avoidedBinds += avoided;
+	}
+    
+	// Draws the meshlets of a full mesh draw (not instanced, with a world
+	// matrix) that may be visible: those facing the eye and, when frustum
+	// culling is on, inside the frustum. Runs of consecutive visible
+	// meshlets become one indirect command. Returns false, recording
+	// nothing, when the draw does not qualify or indirectRing is full;
+	// indices is set to the number of indices drawn.
+	bool recordMeshletDraws(VkCommandBuffer commandBuffer, int currentImage,
+							const DrawItem& item, uint32_t& indices) {
+		const Model& model = *item.model;
+		if (indirectRing.buffer == VK_NULL_HANDLE || !meshletCulling ||
+			model.meshlets.empty() || item.instances != nullptr || item.world == nullptr ||
+			item.firstIndex != 0 || (item.indexCount != 0 && item.indexCount != model.indexCount)) {
+			return false;
+		}
+		VkDeviceSize offset;
+		VkDrawIndexedIndirectCommand *commands = indirectRing.reserve(currentImage,
+				static_cast<uint32_t>(model.meshlets.size()), offset);
+		if (commands == nullptr) {
+			return false;
+		}
+
+		// The cone test needs a world matrix that keeps the winding
+		const glm::mat4& world = *item.world;
+		glm::mat3 linear(world);
+		bool coneTest = glm::determinant(linear) > 0.0f;
+		float scale = std::sqrt(std::max({glm::dot(linear[0], linear[0]),
+										  glm::dot(linear[1], linear[1]),
+										  glm::dot(linear[2], linear[2])}));
+		bool useFrustum = frustumCulling && frustum.valid;
+
+		uint32_t count = 0;
+		uint32_t culled = 0;
+		indices = 0;
+		for (const Meshlet& meshlet : model.meshlets) {
+			glm::vec3 center = glm::vec3(world * glm::vec4(meshlet.center, 1.0f));
+			float radius = meshlet.radius * scale;
+			bool visible = !useFrustum || frustum.sphereVisible(center, radius);
+			if (visible && coneTest && meshlet.coneCutoff < 1.0f) {
+				glm::vec3 axis = glm::normalize(linear * meshlet.coneAxis);
+				glm::vec3 view = center - viewEye;
+				visible = glm::dot(view, axis) < meshlet.coneCutoff * glm::length(view) + radius;
+			}
+			if (!visible) {
+				culled++;
+				continue;
+			}
+			uint32_t firstIndex = model.baseIndex + meshlet.firstIndex;
+			if (count > 0 && commands[count - 1].firstIndex +
+							 commands[count - 1].indexCount == firstIndex) {
+				commands[count - 1].indexCount += meshlet.indexCount;
+			} else {
+				commands[count++] = { meshlet.indexCount, 1, firstIndex, model.vertexOffset, 0 };
+			}
+			indices += meshlet.indexCount;
+		}
+		meshletsTested += static_cast<uint32_t>(model.meshlets.size());
+		meshletsCulled += culled;
+
+		if (multiDrawIndirect) {
+			if (count > 0) {
+				vkCmdDrawIndexedIndirect(commandBuffer, indirectRing.buffer, offset, count,
+										 sizeof(VkDrawIndexedIndirectCommand));
+			}
+		} else {
+			for (uint32_t c = 0; c < count; c++) {
+				vkCmdDrawIndexedIndirect(commandBuffer, indirectRing.buffer,
+										 offset + c * sizeof(VkDrawIndexedIndirectCommand), 1,
+										 sizeof(VkDrawIndexedIndirectCommand));
+			}
+		}
+		return true;
+	}
+
+	// Sets timestampPeriod and timestampMask for the graphics queue
+	void initTimestamps() {
+		uint32_t queueFamilyCount = 0;
+		vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+						nullptr);
+		std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+		vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount,
+						queueFamilies.data());
+		uint32_t validBits = queueFamilies[
+				findQueueFamilies(physicalDevice).graphicsFamily.value()].timestampValidBits;
+		timestampMask = validBits == 0 ? 0 :
+						validBits >= 64 ? ~0ULL : (1ULL << validBits) - 1;
+
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		timestampPeriod = properties.limits.timestampPeriod;
+	}
+
+	// Timestamp queries for the GPU frame time. Only benchmarks and
+	// --target-fps read them, so only they record them.
+	void createFrameQueryPool() {
+		if (benchFrames <= 0 && targetFrameMs <= 0.0f) {
+			return;
+		}
+		if (timestampMask == 0) {
+			std::cout << "Timestamps not supported, GPU times will not be measured\n";
+			if (targetFrameMs > 0.0f) {
+				std::cout << "The render scale will stay at " << renderScale << "\n";
+			}
+			return;
+		}
+
+		VkQueryPoolCreateInfo queryInfo{};
+		queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		queryInfo.queryCount = static_cast<uint32_t>(2 * swapChainImages.size());
+
+		VkResult result = vkCreateQueryPool(device, &queryInfo, nullptr, &frameQueryPool);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to create query pool!");
+		}
+		frameQueriesPending.assign(swapChainImages.size(), false);
+		frameQueriesFrame.assign(swapChainImages.size(), 0);
+	}
+
+	// Returns the GPU time of the last submission of swapchain image i (or
+	// a negative value if there is none) and, in benchmarks, stores it in
+	// gpuStats. The caller guarantees that submission has completed.
+	float collectGpuTime(uint32_t i) {
+		if (frameQueryPool == VK_NULL_HANDLE || !frameQueriesPending[i]) {
+			return -1.0f;
+		}
+		frameQueriesPending[i] = false;
+
+		uint64_t ticks[2];
+		VkResult result = vkGetQueryPoolResults(device, frameQueryPool, 2 * i, 2,
+				sizeof(ticks), ticks, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+		if (result != VK_SUCCESS) {
+			return -1.0f;
+		}
+		float ms = ((ticks[1] - ticks[0]) & timestampMask) * timestampPeriod / 1e6f;
+		if (benchFrames > 0) {
+			uint32_t frame = frameQueriesFrame[i];
+			if (gpuStats.frameMs.size() <= frame) {
+				gpuStats.frameMs.resize(frame + 1, 0.0f);
+			}
+			gpuStats.frameMs[frame] = ms;
+		}
+		return ms;
+	}
+
+	// One line per benchmark frame: total, CPU and GPU time in ms, draw
+	// calls, bytes uploaded, render scale and culled objects
+	void writeBenchCsv() {
+		std::ofstream out(benchCsvFile);
+		out << "frame,frame_ms,cpu_ms,gpu_ms,draws,upload_bytes,render_scale,culled,triangles\n";
+		for (size_t i = 0; i < frameStats.count(); i++) {
+			out << i << "," << frameStats.frameMs[i] << "," << cpuStats.frameMs[i] << ",";
+			if (i < gpuStats.count()) {
+				out << gpuStats.frameMs[i];
+			}
+			out << "," << frameDrawCounts[i] << "," << frameUploadBytes[i] << ","
+				<< frameRenderScales[i] << "," << frameCulledCounts[i] << ","
+				<< frameTriangleCounts[i] << "\n";
+		}
+		if (!out) {
+			std::cout << "Could not write " << benchCsvFile << "\n";
+		}
+	}
+
+    // Lesson 22.5
+    void createSyncObjects() {
+    	imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+    	renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+    	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+    	imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
+    	    	
+    	VkSemaphoreCreateInfo semaphoreInfo{};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 		
-		vkDestroySwapchainKHR(device, swapChain, nullptr);
-		
-		vkDestroyDescriptorPool(device, descriptorPool, nullptr);
-    	
-    	
-		localCleanup();
-    	
-    	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-			vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
-			vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-			vkDestroyFence(device, inFlightFences[i], nullptr);
-    	}
-    	
-    	vkDestroyCommandPool(device, commandPool, nullptr);
-    	
- 		vkDestroyDevice(device, nullptr);
-		
-		DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
+		VkFenceCreateInfo fenceInfo{};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 		
-		vkDestroySurfaceKHR(instance, surface, nullptr);
-    	vkDestroyInstance(instance, nullptr);
+		for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+			VkResult result1 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+								&imageAvailableSemaphores[i]);
+			VkResult result2 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+								&renderFinishedSemaphores[i]);
+			VkResult result3 = vkCreateFence(device, &fenceInfo, nullptr,
+								&inFlightFences[i]);
+			if (result1 != VK_SUCCESS ||
+				result2 != VK_SUCCESS ||
+				result3 != VK_SUCCESS) {
+			 	PrintVkError(result1);
+			 	PrintVkError(result2);
+			 	PrintVkError(result3);
+				throw std::runtime_error("failed to create synchronization objects for a frame!!");
+			}
+		}
+	}
+    
+    // Lesson 22.6 --- Main Rendering Loop
+    void mainLoop() {
+        while (headless || !glfwWindowShouldClose(window)) {
+            if (!headless) {
+                PROFILE_SCOPE("glfwPollEvents");
+                glfwPollEvents();
+            }
+
+            auto frameStart = std::chrono::high_resolution_clock::now();
+            drawFrame();
+
+            if (benchFrames > 0) {
+                frameStats.add(std::chrono::duration<float, std::chrono::milliseconds::period>
+                    (std::chrono::high_resolution_clock::now() - frameStart).count());
+                cpuStats.add(lastCpuMs);
+                if (frameStats.count() >= (size_t)benchFrames) {
+                    break;
+                }
+            }
+        }
+        
+        vkDeviceWaitIdle(device);
+
+        if (gpuProfiler.enabled) {
+            for (uint32_t i = 0; i < swapChainImages.size(); i++) {
+                gpuProfiler.collect(i);
+            }
+            gpuProfiler.print();
+        }
+
+        if (benchFrames > 0) {
+            for (uint32_t i = 0; i < swapChainImages.size(); i++) {
+                collectGpuTime(i);
+            }
+            size_t warmup = std::min<size_t>(60, benchFrames / 10);
+            std::string label = hostVisibleMeshes ? "meshes in HOST_VISIBLE memory" :
+                                                    "meshes in DEVICE_LOCAL memory";
+            if (headless) {
+                label = "headless, " + label;
+            }
+            if (!replayFile.empty()) {
+                label = "replay of " + replayFile + ", " + label;
+            }
+            frameStats.print(label, warmup);
+            cpuStats.print("CPU time", warmup);
+            gpuStats.print("GPU time", warmup);
+            printWorkStats(warmup);
+            if (!benchCsvFile.empty()) {
+                writeBenchCsv();
+            }
+        }
+
+        if (!recordInputFile.empty()) {
+            saveInputRecording();
+        }
+    }
+
+    // Draw calls and bytes uploaded per frame, after the warmup frames
+    void printWorkStats(size_t warmup) {
+        if (frameDrawCounts.size() <= warmup) {
+            return;
+        }
+        uint64_t draws = 0, bytes = 0, triangles = 0;
+        uint32_t minDraws = frameDrawCounts[warmup], maxDraws = frameDrawCounts[warmup];
+        for (size_t i = warmup; i < frameDrawCounts.size(); i++) {
+            draws += frameDrawCounts[i];
+            bytes += frameUploadBytes[i];
+            triangles += frameTriangleCounts[i];
+            minDraws = std::min(minDraws, frameDrawCounts[i]);
+            maxDraws = std::max(maxDraws, frameDrawCounts[i]);
+        }
+        size_t frames = frameDrawCounts.size() - warmup;
+        std::cout << "Draw calls per frame: avg " << (double)draws / frames << ", min "
+                  << minDraws << ", max " << maxDraws << "\n";
+        std::cout << "Triangles per frame: avg " << (double)triangles / frames << "\n";
+        std::cout << "Uploaded per frame: avg " << (double)bytes / frames / 1024.0
+                  << " KB (" << bytes / 1024 << " KB in total)\n";
+        if (rerecordCommandBuffers && (frustumCulling || portalCulling)) {
+            uint64_t culled = 0;
+            for (size_t i = warmup; i < frameCulledCounts.size(); i++) {
+                culled += frameCulledCounts[i];
+            }
+            std::cout << "Culled per frame: avg " << (double)culled / frames
+                      << " (last frame: " << cullTested << " tested, " << cullCulled
+                      << " culled, " << portalCulled << " of them by portals, "
+                      << cullDrawn << " drawn)\n";
+            if (!roomGraph.rooms.empty()) {
+                std::cout << "Rooms visible in the last frame: " << roomGraph.visibleCount
+                          << " of " << roomGraph.rooms.size() << "\n";
+            }
+        }
+        if (recordedBinds + avoidedBinds > 0) {
+            std::cout << "State binds in the last command buffer: " << recordedBinds
+                      << " recorded, " << avoidedBinds << " redundant descriptor set binds skipped\n";
+        }
+        if (indirectRing.buffer != VK_NULL_HANDLE && meshletsTested > 0) {
+            std::cout << "Meshlets in the last frame: " << meshletsTested << " tested, "
+                      << meshletsCulled << " culled\n";
+        }
+        if (gpuCuller.countsBuffer != VK_NULL_HANDLE) {
+            const GpuDrawCounts& counts = gpuCuller.lastCounts;
+            std::cout << "Occlusion culling in the last frame: "
+                      << counts.drawCount + counts.lateDrawCount << " objects drawn ("
+                      << counts.lateDrawCount << " by the late pass), "
+                      << counts.occludedCount << " occluded\n";
+        }
+        if (sceneTarget) {
+            float sum = 0.0f, minScale = 1.0f;
+            for (size_t i = warmup; i < frameRenderScales.size(); i++) {
+                sum += frameRenderScales[i];
+                minScale = std::min(minScale, frameRenderScales[i]);
+            }
+            std::cout << "Render scale: avg " << sum / frames << ", min " << minScale << "\n";
+        }
+    }
+    
+    // Lesson 22.6
+    void drawFrame() {
+		PROFILE_SCOPE("drawFrame");
+		{
+			PROFILE_SCOPE("vkWaitForFences");
+			vkWaitForFences(device, 1, &inFlightFences[currentFrame],
+							VK_TRUE, UINT64_MAX);
+		}
+		
+		uint32_t imageIndex;
+		
+		VkResult result = VK_SUCCESS;
+		if (headless) {
+			imageIndex = frameNumber % swapChainImages.size();
+		} else {
+			destroyRetiredSwapChains(false);
+			{
+				PROFILE_SCOPE("vkAcquireNextImageKHR");
+				result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
+						imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+			}
+			if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+				recreateSwapChain();
+				return;
+			}
+			if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+			 	PrintVkError(result);
+				throw std::runtime_error("failed to acquire swap chain image!");
+			}
+		}
+
+		if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
+			PROFILE_SCOPE("vkWaitForFences (image)");
+			vkWaitForFences(device, 1, &imagesInFlight[imageIndex],
+							VK_TRUE, UINT64_MAX);
+		}
+		imagesInFlight[imageIndex] = inFlightFences[currentFrame];
+		updateRenderScale(collectGpuTime(imageIndex));
+		gpuProfiler.collect(imageIndex);
+		gpuCuller.collect(imageIndex);
+		if (gpuProfiler.enabled && frameNumber > 0 &&
+			frameNumber % gpuProfileInterval == 0) {
+			gpuProfiler.print();
+		}
+
+		auto cpuStart = std::chrono::high_resolution_clock::now();
+		VkDeviceSize uploadedBefore = uploadedBytes + writtenBytes;
+		beginInputFrame();
+		{
+			PROFILE_SCOPE("updateUniformBuffer");
+			updateUniformBuffer(imageIndex);
+		}
+		endInputFrame();
+		if (gpuCuller.cullPipeline != VK_NULL_HANDLE) {
+			gpuCuller.update(imageIndex, frustum, viewProj);
+		}
+
+		if (rerecordCommandBuffers) {
+			// The fence above guarantees the GPU is done with this pool
+			vkResetCommandPool(device, frameCommandPools[imageIndex], 0);
+			recordCommandBuffer(imageIndex);
+		}
+		
+		VkSubmitInfo submitInfo{};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
+		VkPipelineStageFlags waitStages[] =
+			{VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+		submitInfo.waitSemaphoreCount = 1;
+		submitInfo.pWaitSemaphores = waitSemaphores;
+		submitInfo.pWaitDstStageMask = waitStages;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+		VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = signalSemaphores;
+		if (headless) {
+			// Nothing to acquire or present
+			submitInfo.waitSemaphoreCount = 0;
+			submitInfo.signalSemaphoreCount = 0;
+		}
+		
+		vkResetFences(device, 1, &inFlightFences[currentFrame]);
+
+		{
+			PROFILE_SCOPE("vkQueueSubmit");
+			if (vkQueueSubmit(graphicsQueue, 1, &submitInfo,
+					inFlightFences[currentFrame]) != VK_SUCCESS) {
+				throw std::runtime_error("failed to submit draw command buffer!");
+			}
+		}
+		lastCpuMs = std::chrono::duration<float, std::chrono::milliseconds::period>
+				(std::chrono::high_resolution_clock::now() - cpuStart).count();
+		if (frameQueryPool != VK_NULL_HANDLE) {
+			frameQueriesPending[imageIndex] = true;
+			frameQueriesFrame[imageIndex] = frameNumber;
+		}
+		gpuProfiler.submitted(imageIndex);
+		if (occlusionCulling && gpuCuller.cullPipeline != VK_NULL_HANDLE) {
+			hiZ.ready = true;
+		}
+		if (benchFrames > 0) {
+			frameDrawCounts.push_back(imageIndex < imageDrawCounts.size() ?
+									  imageDrawCounts[imageIndex] : 0);
+			frameTriangleCounts.push_back(imageIndex < imageTriangleCounts.size() ?
+										  imageTriangleCounts[imageIndex] : 0);
+			frameUploadBytes.push_back(uploadedBytes + writtenBytes - uploadedBefore);
+			frameRenderScales.push_back(renderScale);
+			frameCulledCounts.push_back(cullCulled);
+		}
+		frameNumber++;
+
+		if (headless) {
+			currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+			return;
+		}
+		
+		VkPresentInfoKHR presentInfo{};
+		presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+		presentInfo.waitSemaphoreCount = 1;
+		presentInfo.pWaitSemaphores = signalSemaphores;
+		
+		VkSwapchainKHR swapChains[] = {swapChain};
+		presentInfo.swapchainCount = 1;
+		presentInfo.pSwapchains = swapChains;
+		presentInfo.pImageIndices = &imageIndex;
+		presentInfo.pResults = nullptr; // Optional
+		
+		{
+			PROFILE_SCOPE("vkQueuePresentKHR");
+			result = vkQueuePresentKHR(presentQueue, &presentInfo);
+		}
+		if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR ||
+			framebufferResized) {
+			recreateSwapChain();
+		} else if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to present swap chain image!");
+		}
+
+		currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+    }
+
+	virtual void updateUniformBuffer(uint32_t currentImage) = 0;
+
+	virtual void localCleanup() = 0;
+	
+	// All lessons
+
+	
+    void cleanup() {
+		cleanupSwapChain();
+		
+		if (rerecordCommandBuffers) {
+			destroyFrameCommandPools();
+		}
+
+		vkDestroyRenderPass(device, renderPass, nullptr);
+		if (lateRenderPass != VK_NULL_HANDLE) {
+			vkDestroyRenderPass(device, lateRenderPass, nullptr);
+		}
+		
+		if (headless) {
+			for (size_t i = 0; i < swapChainImages.size(); i++) {
+				vkDestroyImage(device, swapChainImages[i], nullptr);
+				allocator.free(offscreenImagesMemory[i]);
+			}
+		} else {
+			destroyRetiredSwapChains(true);
+			vkDestroySwapchainKHR(device, swapChain, nullptr);
+		}
+
+		if (frameQueryPool != VK_NULL_HANDLE) {
+			vkDestroyQueryPool(device, frameQueryPool, nullptr);
+		}
+		gpuProfiler.cleanup();
+		
+		vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+    	
+    	
+		localCleanup();
+
+		jobs.cleanup();
+		uniformRing.cleanup();
+		indirectRing.cleanup();
+		gpuCuller.cleanup();
+		hiZ.cleanup();
+		allocator.cleanup();
+
+		savePipelineCache();
+		vkDestroyPipelineCache(device, pipelineCache, nullptr);
+    	
+    	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+			vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
+			vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+			vkDestroyFence(device, inFlightFences[i], nullptr);
+    	}
+    	
+    	vkDestroyCommandPool(device, commandPool, nullptr);
+    	
+ 		vkDestroyDevice(device, nullptr);
+		
+		if (validationEnabled) {
+			DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
+		}
+		
+		if (!headless) {
+			vkDestroySurfaceKHR(instance, surface, nullptr);
+		}
+    	vkDestroyInstance(instance, nullptr);
+
+		if (!headless) {
+	        glfwDestroyWindow(window);
+
+	        glfwTerminate();
+		}
+    }
+};
+
+void Model::loadModel(std::string file) {
+	tinyobj::ObjReaderConfig reader_config;
+	reader_config.mtl_search_path = "./materials"; // Path to material files
+
+	tinyobj::ObjReader reader;
+
+	if (!reader.ParseFromFile(file, reader_config)) {
+		if (!reader.Error().empty()) {
+			std::cerr << "TinyObjReader: " << reader.Error();
+		}
+		exit(1);
+	}
+
+	if (!reader.Warning().empty()) {
+		std::cout << "TinyObjReader: " << reader.Warning();
+	}
+
+	auto& attrib = reader.GetAttrib();
+	auto& shapes = reader.GetShapes();
+	auto& materials = reader.GetMaterials();
+
+	// Shared-vertex mesh: identical (pos, norm, texCoord) corners are merged
+	std::unordered_map<Vertex, uint32_t> uniqueVertices{};
+	auto dedupStart = std::chrono::high_resolution_clock::now();
+	rawVertexCount = 0;
+
+	// Loop over shapes
+	for (size_t s = 0; s < shapes.size(); s++) {
+		// Loop over faces(polygon)
+		size_t index_offset = 0;
+		for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
+			size_t fv = size_t(shapes[s].mesh.num_face_vertices[f]);
+
+			// Loop over vertices in the face.
+			for (size_t v = 0; v < fv; v++) {
+				Vertex vertex{};
+
+				// access to vertex
+				tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
+				tinyobj::real_t vx = attrib.vertices[3 * size_t(idx.vertex_index) + 0];
+				tinyobj::real_t vy = attrib.vertices[3 * size_t(idx.vertex_index) + 1];
+				tinyobj::real_t vz = attrib.vertices[3 * size_t(idx.vertex_index) + 2];
+				vertex.pos = { vx, vy, vz };
+
+
+				// Check if `normal_index` is zero or positive. negative = no normal data
+				if (idx.normal_index >= 0) {
+					tinyobj::real_t nx = attrib.normals[3 * size_t(idx.normal_index) + 0];
+					tinyobj::real_t ny = attrib.normals[3 * size_t(idx.normal_index) + 1];
+					tinyobj::real_t nz = attrib.normals[3 * size_t(idx.normal_index) + 2];
+					vertex.norm = { nx, ny, nz };
+				}
+
+				// Check if `texcoord_index` is zero or positive. negative = no texcoord data
+				if (idx.texcoord_index >= 0) {
+					tinyobj::real_t tx = attrib.texcoords[2 * size_t(idx.texcoord_index) + 0];
+					tinyobj::real_t ty = 1 - attrib.texcoords[2 * size_t(idx.texcoord_index) + 1];
+					vertex.texCoord = { tx, ty };
+				}
+
+				auto found = uniqueVertices.find(vertex);
+				if (found == uniqueVertices.end()) {
+					uint32_t newIndex = static_cast<uint32_t>(vertices.size());
+					uniqueVertices.emplace(vertex, newIndex);
+					vertices.push_back(vertex);
+					indices.push_back(newIndex);
+				} else {
+					indices.push_back(found->second);
+				}
+				rawVertexCount++;
+			}
+			index_offset += fv;
+		}
+
+	}
+
+	dedupMs = std::chrono::duration<float, std::chrono::milliseconds::period>
+		(std::chrono::high_resolution_clock::now() - dedupStart).count();
+
+	std::cout << file << " -> vertices: " << rawVertexCount << " -> " << vertices.size()
+			  << " (" << (vertices.empty() ? 0.0f : (float)rawVertexCount / vertices.size())
+			  << "x), indices: " << indices.size()
+			  << ", saved " << (rawVertexCount - vertices.size()) * sizeof(Vertex) / 1024 << " KB"
+			  << ", dedup: " << dedupMs << " ms\n";
+}
+
+void GpuAllocator::init(BaseProject *bp) {
+	BP = bp;
+	vkGetPhysicalDeviceMemoryProperties(BP->physicalDevice, &memProperties);
+	pools.resize(memProperties.memoryTypeCount * 2);
+}
+
+VkDeviceSize GpuAllocator::blockSizeFor(uint32_t memoryType) {
+	const VkMemoryType& type = memProperties.memoryTypes[memoryType];
+	VkDeviceSize size = (type.propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ?
+						hostBlockSize : deviceBlockSize;
+	// Small heaps (e.g. the 256MB device local + host visible window)
+	// should not be eaten by a couple of blocks
+	return std::min(size, memProperties.memoryHeaps[type.heapIndex].size / 8);
+}
+
+bool GpuAllocator::suballocate(Block& block, const VkMemoryRequirements& req,
+							   Allocation& alloc) {
+	for (size_t i = 0; i < block.freeRanges.size(); i++) {
+		Range& range = block.freeRanges[i];
+		VkDeviceSize aligned = (range.offset + req.alignment - 1) /
+							   req.alignment * req.alignment;
+		VkDeviceSize padding = aligned - range.offset;
+		if (padding + req.size > range.size) {
+			continue;
+		}
+
+		alloc.memory = block.memory;
+		alloc.offset = aligned;
+		alloc.size = req.size;
+		alloc.mapped = block.mapped ?
+					   static_cast<char *>(block.mapped) + aligned : nullptr;
+		alloc.rangeOffset = range.offset;
+		alloc.rangeSize = padding + req.size;
+
+		range.offset += alloc.rangeSize;
+		range.size -= alloc.rangeSize;
+		if (range.size == 0) {
+			block.freeRanges.erase(block.freeRanges.begin() + i);
+		}
+		return true;
+	}
+	return false;
+}
+
+Allocation GpuAllocator::allocate(const VkMemoryRequirements& req,
+								  VkMemoryPropertyFlags properties, bool linear) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	uint32_t memoryType = BP->findMemoryType(req.memoryTypeBits, properties);
+	int poolIndex = memoryType * 2 + (linear ? 0 : 1);
+	std::vector<Block>& pool = pools[poolIndex];
+
+	Allocation alloc{};
+	int blockIndex = -1;
+	for (size_t b = 0; b < pool.size(); b++) {
+		if (pool[b].memory != VK_NULL_HANDLE && !pool[b].dedicated &&
+			suballocate(pool[b], req, alloc)) {
+			blockIndex = static_cast<int>(b);
+			break;
+		}
+	}
+
+	if (blockIndex < 0) {
+		// Reuse the slot of a released block so existing indices stay valid
+		for (size_t b = 0; b < pool.size(); b++) {
+			if (pool[b].memory == VK_NULL_HANDLE) {
+				blockIndex = static_cast<int>(b);
+				break;
+			}
+		}
+		if (blockIndex < 0) {
+			blockIndex = static_cast<int>(pool.size());
+			pool.emplace_back();
+		}
+
+		Block& block = pool[blockIndex];
+		VkDeviceSize blockSize = blockSizeFor(memoryType);
+		block = Block{};
+		block.dedicated = req.size > blockSize;
+		block.size = block.dedicated ? req.size : blockSize;
+
+		VkMemoryAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocInfo.allocationSize = block.size;
+		allocInfo.memoryTypeIndex = memoryType;
+
+		VkResult result = vkAllocateMemory(BP->device, &allocInfo, nullptr,
+										   &block.memory);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to allocate GPU memory block!");
+		}
+
+		if (memProperties.memoryTypes[memoryType].propertyFlags &
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+			result = vkMapMemory(BP->device, block.memory, 0, VK_WHOLE_SIZE, 0,
+								 &block.mapped);
+			if (result != VK_SUCCESS) {
+			 	PrintVkError(result);
+				throw std::runtime_error("failed to map GPU memory block!");
+			}
+		}
+
+		block.freeRanges.push_back({0, block.size});
+		bytesReserved += block.size;
+		blockCount++;
+
+		suballocate(block, req, alloc);
+	}
+
+	alloc.pool = poolIndex;
+	alloc.block = blockIndex;
+	pool[blockIndex].allocationCount++;
+	bytesUsed += alloc.size;
+	bytesWasted += alloc.rangeSize - alloc.size;
+	allocationCount++;
+	return alloc;
+}
+
+void GpuAllocator::free(Allocation& alloc) {
+	if (alloc.memory == VK_NULL_HANDLE) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+
+	Block& block = pools[alloc.pool][alloc.block];
+
+	// Insert sorted, then merge with the neighbours
+	auto it = block.freeRanges.begin();
+	while (it != block.freeRanges.end() && it->offset < alloc.rangeOffset) {
+		it++;
+	}
+	it = block.freeRanges.insert(it, {alloc.rangeOffset, alloc.rangeSize});
+	auto next = it + 1;
+	if (next != block.freeRanges.end() && it->offset + it->size == next->offset) {
+		it->size += next->size;
+		block.freeRanges.erase(next);
+	}
+	if (it != block.freeRanges.begin()) {
+		auto prev = it - 1;
+		if (prev->offset + prev->size == it->offset) {
+			prev->size += it->size;
+			block.freeRanges.erase(it);
+		}
+	}
+
+	block.allocationCount--;
+	bytesUsed -= alloc.size;
+	bytesWasted -= alloc.rangeSize - alloc.size;
+	allocationCount--;
+
+	// Dedicated blocks (large staging buffers, big images) go straight back
+	if (block.dedicated && block.allocationCount == 0) {
+		if (block.mapped) {
+			vkUnmapMemory(BP->device, block.memory);
+		}
+		vkFreeMemory(BP->device, block.memory, nullptr);
+		bytesReserved -= block.size;
+		blockCount--;
+		block = Block{};
+	}
+
+	alloc = Allocation{};
+}
+
+void GpuAllocator::printStats() {
+	std::cout << "GPU memory: " << bytesUsed / 1024 << " KB used by "
+			  << allocationCount << " allocations, " << bytesWasted / 1024
+			  << " KB wasted in padding, " << bytesReserved / 1024 << " KB reserved in "
+			  << blockCount << " blocks\n";
+}
+
+void GpuAllocator::cleanup() {
+	if (allocationCount > 0) {
+		std::cout << "GPU memory: " << allocationCount << " allocations ("
+				  << bytesUsed / 1024 << " KB) not freed\n";
+	}
+	for (std::vector<Block>& pool : pools) {
+		for (Block& block : pool) {
+			if (block.memory == VK_NULL_HANDLE) {
+				continue;
+			}
+			if (block.mapped) {
+				vkUnmapMemory(BP->device, block.memory);
+			}
+			vkFreeMemory(BP->device, block.memory, nullptr);
+		}
+	}
+	pools.clear();
+	bytesReserved = 0;
+	blockCount = 0;
+}
+
+void UniformRing::init(BaseProject *bp, VkDeviceSize size, uint32_t frames) {
+	BP = bp;
+	frameCount = frames;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	alignment = std::max<VkDeviceSize>(properties.limits.minUniformBufferOffsetAlignment, 16);
+	frameSize = (size + alignment - 1) / alignment * alignment;
+
+	BP->createBuffer(frameSize * frameCount, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 buffer, memory);
+	used = 0;
+	freeSlots.clear();
+}
+
+// A new buffer for another number of regions. Slots keep their offset in
+// a region; the uniforms have to be written again before they are used.
+void UniformRing::resize(uint32_t frames) {
+	vkDestroyBuffer(BP->device, buffer, nullptr);
+	BP->allocator.free(memory);
+	frameCount = frames;
+	BP->createBuffer(frameSize * frameCount, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 buffer, memory);
+}
+
+// Returns the offset of a new slot inside every frame region
+uint32_t UniformRing::reserve(VkDeviceSize size) {
+	size = (size + alignment - 1) / alignment * alignment;
+	for (auto it = freeSlots.begin(); it != freeSlots.end(); it++) {
+		if (it->size >= size) {
+			VkDeviceSize slot = it->offset;
+			it->offset += size;
+			it->size -= size;
+			if (it->size == 0) {
+				freeSlots.erase(it);
+			}
+			return static_cast<uint32_t>(slot);
+		}
+	}
+	VkDeviceSize slot = used;
+	used += size;
+	if (used > frameSize) {
+		throw std::runtime_error("uniform ring is full, raise uniformRingFrameSize!");
+	}
+	return static_cast<uint32_t>(slot);
+}
+
+// Gives back a slot of reserve(size). Free slots are merged with their
+// neighbours, and those at the end shrink used.
+void UniformRing::release(uint32_t slot, VkDeviceSize size) {
+	size = (size + alignment - 1) / alignment * alignment;
+	auto it = freeSlots.begin();
+	while (it != freeSlots.end() && it->offset < slot) {
+		it++;
+	}
+	it = freeSlots.insert(it, {slot, size});
+	auto next = it + 1;
+	if (next != freeSlots.end() && it->offset + it->size == next->offset) {
+		it->size += next->size;
+		freeSlots.erase(next);
+	}
+	if (it != freeSlots.begin()) {
+		auto prev = it - 1;
+		if (prev->offset + prev->size == it->offset) {
+			prev->size += it->size;
+			freeSlots.erase(it);
+		}
+	}
+	if (!freeSlots.empty() && freeSlots.back().offset + freeSlots.back().size == used) {
+		used = freeSlots.back().offset;
+		freeSlots.pop_back();
+	}
+}
+
+uint32_t UniformRing::offset(uint32_t currentImage, uint32_t slot) {
+	return static_cast<uint32_t>(currentImage * frameSize + slot);
+}
+
+void *UniformRing::data(uint32_t currentImage, uint32_t slot) {
+	return static_cast<char *>(memory.mapped) + offset(currentImage, slot);
+}
+
+void UniformRing::cleanup() {
+	vkDestroyBuffer(BP->device, buffer, nullptr);
+	BP->allocator.free(memory);
+}
+
+void IndirectRing::init(BaseProject *bp, uint32_t commands, uint32_t frames) {
+	BP = bp;
+	frameCommands = commands;
+	frameCount = frames;
+	BP->createBuffer(sizeof(VkDrawIndexedIndirectCommand) * frameCommands * frameCount,
+					 VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 buffer, memory);
+	used = 0;
+}
+
+void IndirectRing::begin() {
+	used = 0;
+}
+
+VkDrawIndexedIndirectCommand *IndirectRing::reserve(uint32_t currentImage, uint32_t count,
+													VkDeviceSize& offset) {
+	uint32_t first = used.fetch_add(count);
+	if (first + count > frameCommands) {
+		return nullptr;
+	}
+	uint32_t index = currentImage * frameCommands + first;
+	offset = sizeof(VkDrawIndexedIndirectCommand) * index;
+	return static_cast<VkDrawIndexedIndirectCommand *>(memory.mapped) + index;
+}
+
+void IndirectRing::cleanup() {
+	if (buffer == VK_NULL_HANDLE) {
+		return;
+	}
+	vkDestroyBuffer(BP->device, buffer, nullptr);
+	BP->allocator.free(memory);
+	buffer = VK_NULL_HANDLE;
+}
+
+uint32_t MeshRegistry::add(Model& model) {
+	RegisteredMesh mesh{};
+	mesh.center = (model.boundsMin + model.boundsMax) * 0.5f;
+	mesh.radius = model.boundsRadius;
+	mesh.firstIndex = static_cast<uint32_t>(indices.size());
+	mesh.indexCount = model.indexCount;
+	mesh.vertexOffset = static_cast<int32_t>(vertices.size());
+
+	const Vertex *modelVertices = static_cast<const Vertex *>(model.vertexSource());
+	const uint32_t *modelIndices = static_cast<const uint32_t *>(model.indexSource());
+	vertices.insert(vertices.end(), modelVertices, modelVertices + model.vertexCount);
+	indices.insert(indices.end(), modelIndices, modelIndices + model.totalIndexCount());
+	meshes.push_back(mesh);
+
+	model.registry = this;
+	model.registeredMesh = static_cast<uint32_t>(meshes.size() - 1);
+	model.vertexOffset = mesh.vertexOffset;
+	model.baseIndex = mesh.firstIndex;
+	models.push_back(&model);
+	return model.registeredMesh;
+}
+
+void MeshRegistry::upload(BaseProject *bp) {
+	BP = bp;
+	if (meshes.empty()) {
+		return;
+	}
+	VkDeviceSize vertexBytes = sizeof(Vertex) * vertices.size();
+	VkDeviceSize indexBytes = sizeof(uint32_t) * indices.size();
+	if (BP->hostVisibleMeshes) {
+		BP->createBuffer(vertexBytes, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+							VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+							VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+							vertexBuffer, vertexBufferMemory);
+		BP->createBuffer(indexBytes, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+							VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+							VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+							indexBuffer, indexBufferMemory);
+		memcpy(vertexBufferMemory.mapped, vertices.data(), (size_t)vertexBytes);
+		memcpy(indexBufferMemory.mapped, indices.data(), (size_t)indexBytes);
+	} else {
+		BP->createBuffer(vertexBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+							VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+							VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+							vertexBuffer, vertexBufferMemory);
+		BP->createBuffer(indexBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+							VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+							VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+							indexBuffer, indexBufferMemory);
+		BP->beginUploadBatch();
+		BP->uploadBuffer(vertexBuffer, vertices.data(), vertexBytes);
+		BP->uploadBuffer(indexBuffer, indices.data(), indexBytes);
+		BP->flushUploadBatch();
+	}
+	for (Model *model : models) {
+		model->vertexBuffer = vertexBuffer;
+		model->indexBuffer = indexBuffer;
+	}
+	models.clear();
+	std::cout << "Mesh registry: " << meshes.size() << " meshes, " << vertices.size()
+			  << " vertices, " << indices.size() << " indices\n";
+
+	vertices = std::vector<Vertex>();
+	indices = std::vector<uint32_t>();
+}
+
+void MeshRegistry::cleanup() {
+	if (vertexBuffer == VK_NULL_HANDLE) {
+		return;
+	}
+	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
+	BP->allocator.free(vertexBufferMemory);
+	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
+	BP->allocator.free(indexBufferMemory);
+	vertexBuffer = indexBuffer = VK_NULL_HANDLE;
+}
+
+void RenderQueue::sort(std::vector<DrawItem>& items, const glm::vec3& eye,
+					   const RoomGraph& rooms) {
+	pipelineRanks.clear();
+	materialRanks.clear();
+	meshRanks.clear();
+	auto rank = [](std::unordered_map<const void *, uint32_t>& ranks, const void *p,
+				   uint32_t limit) {
+		auto it = ranks.emplace(p, static_cast<uint32_t>(ranks.size())).first;
+		return std::min(it->second, limit);
+	};
+
+	entries.resize(items.size());
+	for (size_t d = 0; d < items.size(); d++) {
+		const DrawItem& item = items[d];
+		uint64_t pipeline = rank(pipelineRanks, item.pipeline, 0xff);
+		uint64_t material = item.setCount > 0 ?
+			rank(materialRanks, item.sets[item.setCount - 1], 0xffff) : 0;
+		const void *mesh = item.gpuObjects ? (const void *)item.gpuObjects : item.model;
+		uint64_t meshRank = rank(meshRanks, mesh, 0xffff);
+
+		uint32_t depth = 0;
+		if (item.world != nullptr && item.model != nullptr) {
+			glm::vec3 center;
+			if (item.room >= 0 && item.room < (int)rooms.rooms.size()) {
+				const Room& room = rooms.rooms[item.room];
+				glm::vec2 c = (room.boundsMin + room.boundsMax) * 0.5f;
+				center = glm::vec3(c.x, (rooms.floorY + rooms.ceilingY) * 0.5f, c.y);
+			} else {
+				const Model& model = *item.model;
+				center = glm::vec3(*item.world *
+					glm::vec4((model.boundsMin + model.boundsMax) * 0.5f, 1.0f));
+			}
+			float distance = glm::length(center - eye);
+			uint32_t bits;
+			std::memcpy(&bits, &distance, sizeof(bits));
+			depth = bits >> 7;		// sign bit is 0: 8 exponent, 16 mantissa bits
+		}
+		entries[d].key = pipeline << 56 | material << 40 | meshRank << 24 | depth;
+		entries[d].item = static_cast<uint32_t>(d);
+	}
+
+	radixSort(entries, scratch);
+
+	sorted.resize(items.size());
+	for (size_t d = 0; d < entries.size(); d++) {
+		sorted[d] = items[entries[d].item];
+	}
+	items.swap(sorted);
+}
+
+// LSD radix sort on the key, one byte per pass. The eight histograms are
+// counted in a single read of the keys, and the passes where every key has
+// the same byte (most of them: few pipelines, materials and meshes) are
+// skipped.
+void RenderQueue::radixSort(std::vector<Entry>& entries, std::vector<Entry>& scratch) {
+	if (entries.empty()) {
+		return;
+	}
+	const int PASSES = 8;
+	uint32_t counts[PASSES][256] = {};
+	for (const Entry& e : entries) {
+		for (int p = 0; p < PASSES; p++) {
+			counts[p][(e.key >> (8 * p)) & 0xff]++;
+		}
+	}
+
+	scratch.resize(entries.size());
+	for (int p = 0; p < PASSES; p++) {
+		uint32_t *count = counts[p];
+		if (count[(entries[0].key >> (8 * p)) & 0xff] == entries.size()) {
+			continue;
+		}
+		uint32_t offset = 0;
+		for (int b = 0; b < 256; b++) {
+			uint32_t c = count[b];
+			count[b] = offset;
+			offset += c;
+		}
+		for (const Entry& e : entries) {
+			scratch[count[(e.key >> (8 * p)) & 0xff]++] = e;
+		}
+		entries.swap(scratch);
+	}
+}
+
+void GpuCuller::initLayout(BaseProject *bp) {
+	BP = bp;
+	drawSetLayout.init(BP, {
+			{0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 1},
+			{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT,
+				GPU_CULLER_MAX_TEXTURES}
+		});
+}
+
+void GpuCuller::init(MeshRegistry *meshes, uint32_t capacity,
+					 const std::vector<Texture *>& textures) {
+	registry = meshes;
+	maxObjects = capacity;
+	this->textures = textures;
+	if (textures.empty() || textures.size() > GPU_CULLER_MAX_TEXTURES) {
+		throw std::runtime_error("GPU culling needs 1 to GPU_CULLER_MAX_TEXTURES textures!");
+	}
+
+	cmdDrawIndexedIndirectCount = reinterpret_cast<PFN_vkCmdDrawIndexedIndirectCountKHR>(
+			vkGetDeviceProcAddr(BP->device, "vkCmdDrawIndexedIndirectCountKHR"));
+	if (cmdDrawIndexedIndirectCount == nullptr) {
+		throw std::runtime_error("failed to load vkCmdDrawIndexedIndirectCountKHR!");
+	}
+
+	// Regions are bound at their offset, which must respect the alignment
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+	VkDeviceSize alignment = std::max<VkDeviceSize>(
+			properties.limits.minStorageBufferOffsetAlignment, 16);
+	objectRegionSize = (sizeof(GpuObjectsHeader) + sizeof(GpuObject) * maxObjects +
+						alignment - 1) / alignment * alignment;
+	flagsOffset = (sizeof(GpuDrawCounts) + 2 * sizeof(VkDrawIndexedIndirectCommand) * maxObjects +
+				   alignment - 1) / alignment * alignment;
+	drawRegionSize = (flagsOffset + sizeof(uint32_t) * maxObjects +
+					  alignment - 1) / alignment * alignment;
+
+	meshBytes = sizeof(RegisteredMesh) * registry->meshes.size();
+	BP->createBuffer(meshBytes, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 meshBuffer, meshBufferMemory);
+	memcpy(meshBufferMemory.mapped, registry->meshes.data(), (size_t)meshBytes);
+
+	bool occlusion = BP->occlusionCulling;
+
+	// Objects, meshes, draws, then Hi-Z pyramid and flags
+	std::array<VkDescriptorSetLayoutBinding, 5> bindings{};
+	for (uint32_t b = 0; b < bindings.size(); b++) {
+		bindings[b].binding = b;
+		bindings[b].descriptorType = b == 3 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER :
+											  VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		bindings[b].descriptorCount = 1;
+		bindings[b].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	}
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = occlusion ? 5 : 3;
+	layoutInfo.pBindings = bindings.data();
+	VkResult result = vkCreateDescriptorSetLayout(BP->device, &layoutInfo, nullptr,
+												  &cullSetLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create culling descriptor set layout!");
+	}
+
+	createImageResources(static_cast<uint32_t>(BP->swapChainImages.size()));
+	if (occlusion) {
+		writeHiZ();
+	}
+
+	// Same shader, compiled with OCCLUSION defined
+	auto cullShaderCode = Pipeline::readFile(occlusion ? "shaders/CullObjectsOcclusionComp.spv" :
+														 "shaders/CullObjectsComp.spv");
+	VkShaderModuleCreateInfo moduleInfo{};
+	moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	moduleInfo.codeSize = cullShaderCode.size();
+	moduleInfo.pCode = reinterpret_cast<const uint32_t*>(cullShaderCode.data());
+	VkShaderModule cullShaderModule;
+	result = vkCreateShaderModule(BP->device, &moduleInfo, nullptr, &cullShaderModule);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create culling shader module!");
+	}
+
+	// Pass, first late draw and depth size (see recordCull)
+	VkPushConstantRange pushConstants{};
+	pushConstants.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstants.offset = 0;
+	pushConstants.size = 4 * sizeof(uint32_t);
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &cullSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = occlusion ? 1 : 0;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstants;
+	result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
+									&cullPipelineLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create culling pipeline layout!");
+	}
+
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipelineInfo.stage.module = cullShaderModule;
+	pipelineInfo.stage.pName = "main";
+	pipelineInfo.layout = cullPipelineLayout;
+	result = vkCreateComputePipelines(BP->device, BP->pipelineCache, 1, &pipelineInfo,
+									  nullptr, &cullPipeline);
+	vkDestroyShaderModule(BP->device, cullShaderModule, nullptr);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create culling pipeline!");
+	}
+}
+
+// Buffer regions and descriptor sets of every swapchain image. The Hi-Z
+// binding is left to writeHiZ().
+void GpuCuller::createImageResources(uint32_t imageCount) {
+	dirtyObjects.assign(imageCount, {});
+	for (std::vector<uint32_t>& dirty : dirtyObjects) {
+		for (uint32_t object = 0; object < objects.size(); object++) {
+			dirty.push_back(object);
+		}
+	}
+
+	BP->createBuffer(objectRegionSize * imageCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 objectBuffer, objectBufferMemory);
+	memset(objectBufferMemory.mapped, 0, (size_t)(objectRegionSize * imageCount));
+
+	BP->createBuffer(drawRegionSize * imageCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+						VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+						VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+						VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+					 drawBuffer, drawBufferMemory);
+
+	bool occlusion = BP->occlusionCulling;
+	if (occlusion) {
+		BP->createBuffer(sizeof(GpuDrawCounts) * imageCount, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+						 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+						 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+						 countsBuffer, countsBufferMemory);
+		memset(countsBufferMemory.mapped, 0, sizeof(GpuDrawCounts) * imageCount);
+	}
+
+	std::array<VkDescriptorPoolSize, 2> poolSizes{};
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSizes[0].descriptorCount = 5 * imageCount;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSizes[1].descriptorCount = (GPU_CULLER_MAX_TEXTURES + 1) * imageCount;
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+	poolInfo.pPoolSizes = poolSizes.data();
+	poolInfo.maxSets = 2 * imageCount;
+	VkResult result = vkCreateDescriptorPool(BP->device, &poolInfo, nullptr, &descriptorPool);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create culling descriptor pool!");
+	}
+
+	cullSets.resize(imageCount);
+	drawSets.resize(imageCount);
+	std::vector<VkDescriptorSetLayout> cullLayouts(imageCount, cullSetLayout);
+	std::vector<VkDescriptorSetLayout> drawLayouts(imageCount, drawSetLayout.descriptorSetLayout);
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = descriptorPool;
+	allocInfo.descriptorSetCount = imageCount;
+	allocInfo.pSetLayouts = cullLayouts.data();
+	VkResult result1 = vkAllocateDescriptorSets(BP->device, &allocInfo, cullSets.data());
+	allocInfo.pSetLayouts = drawLayouts.data();
+	VkResult result2 = vkAllocateDescriptorSets(BP->device, &allocInfo, drawSets.data());
+	if (result1 != VK_SUCCESS || result2 != VK_SUCCESS) {
+		PrintVkError(result1);
+		PrintVkError(result2);
+		throw std::runtime_error("failed to allocate culling descriptor sets!");
+	}
+
+	// Unused texture slots repeat the last texture
+	std::array<VkDescriptorImageInfo, GPU_CULLER_MAX_TEXTURES> imageInfos{};
+	for (uint32_t t = 0; t < GPU_CULLER_MAX_TEXTURES; t++) {
+		Texture *texture = textures[std::min<size_t>(t, textures.size() - 1)];
+		imageInfos[t].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		imageInfos[t].imageView = texture->textureImageView;
+		imageInfos[t].sampler = texture->textureSampler;
+	}
+	for (uint32_t i = 0; i < imageCount; i++) {
+		std::array<VkDescriptorBufferInfo, 4> bufferInfos{};
+		bufferInfos[0] = { objectBuffer, objectRegionSize * i, objectRegionSize };
+		bufferInfos[1] = { meshBuffer, 0, meshBytes };
+		bufferInfos[2] = { drawBuffer, drawRegionSize * i, flagsOffset };
+		bufferInfos[3] = { drawBuffer, drawRegionSize * i + flagsOffset,
+						   sizeof(uint32_t) * maxObjects };
+
+		std::array<VkWriteDescriptorSet, 6> writes{};
+		for (uint32_t b = 0; b < 3; b++) {
+			writes[b].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writes[b].dstSet = cullSets[i];
+			writes[b].dstBinding = b;
+			writes[b].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			writes[b].descriptorCount = 1;
+			writes[b].pBufferInfo = &bufferInfos[b];
+		}
+		writes[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[3].dstSet = drawSets[i];
+		writes[3].dstBinding = 0;
+		writes[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		writes[3].descriptorCount = 1;
+		writes[3].pBufferInfo = &bufferInfos[0];
+		writes[4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[4].dstSet = drawSets[i];
+		writes[4].dstBinding = 1;
+		writes[4].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		writes[4].descriptorCount = GPU_CULLER_MAX_TEXTURES;
+		writes[4].pImageInfo = imageInfos.data();
+		writes[5].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[5].dstSet = cullSets[i];
+		writes[5].dstBinding = 4;
+		writes[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		writes[5].descriptorCount = 1;
+		writes[5].pBufferInfo = &bufferInfos[3];
+		vkUpdateDescriptorSets(BP->device, occlusion ? 6 : 5, writes.data(), 0, nullptr);
+	}
+}
+
+void GpuCuller::destroyImageResources() {
+	vkDestroyDescriptorPool(BP->device, descriptorPool, nullptr);
+	vkDestroyBuffer(BP->device, objectBuffer, nullptr);
+	BP->allocator.free(objectBufferMemory);
+	vkDestroyBuffer(BP->device, drawBuffer, nullptr);
+	BP->allocator.free(drawBufferMemory);
+	if (countsBuffer != VK_NULL_HANDLE) {
+		vkDestroyBuffer(BP->device, countsBuffer, nullptr);
+		BP->allocator.free(countsBufferMemory);
+		countsBuffer = VK_NULL_HANDLE;
+	}
+	cullSets.clear();
+	drawSets.clear();
+}
+
+// For a swapchain recreated with another image count: every region is
+// made again and all the objects are written to each of them
+void GpuCuller::resize(uint32_t imageCount) {
+	destroyImageResources();
+	createImageResources(imageCount);
+}
+
+uint32_t GpuCuller::addObject(uint32_t mesh, const glm::mat4& model, uint32_t texture) {
+	if (objects.size() == maxObjects) {
+		throw std::runtime_error("GPU culler is full, raise its capacity!");
+	}
+	GpuObject object{};
+	object.model = model;
+	object.mesh = mesh;
+	object.texture = texture;
+	objects.push_back(object);
+	uint32_t index = static_cast<uint32_t>(objects.size() - 1);
+	for (std::vector<uint32_t>& dirty : dirtyObjects) {
+		dirty.push_back(index);
+	}
+	return index;
+}
+
+void GpuCuller::setObject(uint32_t object, const glm::mat4& model) {
+	if (objects[object].model == model) {
+		return;
+	}
+	objects[object].model = model;
+	for (std::vector<uint32_t>& dirty : dirtyObjects) {
+		dirty.push_back(object);
+	}
+}
+
+// Writes the frustum and the objects changed since this image was last
+// used. Call it every frame before submitting the image's command buffer.
+void GpuCuller::update(uint32_t currentImage, const Frustum& frustum, const glm::mat4& viewProj) {
+	char *region = static_cast<char *>(objectBufferMemory.mapped) + objectRegionSize * currentImage;
+	GpuObjectsHeader *header = reinterpret_cast<GpuObjectsHeader *>(region);
+	for (int p = 0; p < 6; p++) {
+		header->planes[p] = frustum.valid ?
+				glm::vec4(frustum.nx[p], frustum.ny[p], frustum.nz[p], frustum.d[p]) :
+				glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+	}
+	header->viewProj = viewProj;
+	header->objectCount = static_cast<uint32_t>(objects.size());
+	header->hiZReady = BP->hiZ.ready && frustum.valid ? 1 : 0;
+
+	GpuObject *regionObjects = reinterpret_cast<GpuObject *>(region + sizeof(GpuObjectsHeader));
+	for (uint32_t object : dirtyObjects[currentImage]) {
+		regionObjects[object] = objects[object];
+	}
+	BP->writtenBytes += sizeof(GpuObjectsHeader) +
+						sizeof(GpuObject) * dirtyObjects[currentImage].size();
+	dirtyObjects[currentImage].clear();
+}
+
+// Outside the render pass: runs the culling shader and makes its output
+// visible to the indirect draw. The early pass (the only one without
+// occlusion culling) clears the counts first; the late pass, recorded
+// after BP->hiZ.record, also copies them for collect().
+void GpuCuller::recordCull(VkCommandBuffer commandBuffer, uint32_t currentImage,
+						   uint32_t pass) {
+	VkDeviceSize drawOffset = drawRegionSize * currentImage;
+
+	VkBufferMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = drawBuffer;
+	barrier.offset = drawOffset;
+	barrier.size = drawRegionSize;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	if (pass == EARLY_PASS) {
+		vkCmdFillBuffer(commandBuffer, drawBuffer, drawOffset, sizeof(GpuDrawCounts), 0);
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+							 0, nullptr, 1, &barrier, 0, nullptr);
+	} else {
+		// The flags and counts written by the early pass
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+							 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+							 0, nullptr, 1, &barrier, 0, nullptr);
+	}
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+							cullPipelineLayout, 0, 1, &cullSets[currentImage], 0, nullptr);
+	if (BP->occlusionCulling) {
+		// The pyramid the pass reads was built from this area of the depth
+		uint32_t constants[4] = { pass, maxObjects,
+								  BP->hiZ.builtExtent.width, BP->hiZ.builtExtent.height };
+		vkCmdPushConstants(commandBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+						   0, sizeof(constants), constants);
+	}
+	// Sized for the capacity, so that a command buffer recorded once still
+	// covers objects added later (the shader stops at objectCount)
+	vkCmdDispatch(commandBuffer, (maxObjects + 63) / 64, 1, 1);
+
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+	VkPipelineStageFlags dstStages = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+	if (pass == LATE_PASS) {
+		barrier.dstAccessMask |= VK_ACCESS_TRANSFER_READ_BIT;
+		dstStages |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+	}
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+						 dstStages, 0,
+						 0, nullptr, 1, &barrier, 0, nullptr);
+
+	if (pass == LATE_PASS) {
+		VkBufferCopy copy{};
+		copy.srcOffset = drawOffset;
+		copy.dstOffset = sizeof(GpuDrawCounts) * currentImage;
+		copy.size = sizeof(GpuDrawCounts);
+		vkCmdCopyBuffer(commandBuffer, drawBuffer, countsBuffer, 1, &copy);
+
+		VkBufferMemoryBarrier hostBarrier = barrier;
+		hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		hostBarrier.buffer = countsBuffer;
+		hostBarrier.offset = copy.dstOffset;
+		hostBarrier.size = copy.size;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+							 VK_PIPELINE_STAGE_HOST_BIT, 0,
+							 0, nullptr, 1, &hostBarrier, 0, nullptr);
+	}
+}
+
+// Inside the render pass, with pipeline bound and its sets before drawSet
+// already bound. Draws the objects the given pass found visible.
+void GpuCuller::draw(VkCommandBuffer commandBuffer, uint32_t currentImage,
+					 Pipeline& pipeline, uint32_t drawSet, uint32_t pass) {
+	VkDeviceSize offsets[] = { 0 };
+	vkCmdBindVertexBuffers(commandBuffer, 0, 1, &registry->vertexBuffer, offsets);
+	vkCmdBindIndexBuffer(commandBuffer, registry->indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+							pipeline.pipelineLayout, drawSet, 1, &drawSets[currentImage],
+							0, nullptr);
+	VkDeviceSize drawOffset = drawRegionSize * currentImage;
+	VkDeviceSize commandsOffset = drawOffset + sizeof(GpuDrawCounts);
+	VkDeviceSize countOffset = drawOffset + offsetof(GpuDrawCounts, drawCount);
+	if (pass == LATE_PASS) {
+		commandsOffset += sizeof(VkDrawIndexedIndirectCommand) * maxObjects;
+		countOffset = drawOffset + offsetof(GpuDrawCounts, lateDrawCount);
+	}
+	cmdDrawIndexedIndirectCount(commandBuffer, drawBuffer, commandsOffset,
+								drawBuffer, countOffset, maxObjects,
+								sizeof(VkDrawIndexedIndirectCommand));
+}
+
+// Points the culling sets to BP->hiZ, again whenever it is recreated
+void GpuCuller::writeHiZ() {
+	VkDescriptorImageInfo imageInfo{};
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	imageInfo.imageView = BP->hiZ.view;
+	imageInfo.sampler = BP->hiZ.sampler;
+	for (VkDescriptorSet set : cullSets) {
+		VkWriteDescriptorSet write{};
+		write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write.dstSet = set;
+		write.dstBinding = 3;
+		write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		write.descriptorCount = 1;
+		write.pImageInfo = &imageInfo;
+		vkUpdateDescriptorSets(BP->device, 1, &write, 0, nullptr);
+	}
+}
+
+// Reads the counts of the last frame of the image, once its fence has
+// signalled (occlusion culling only)
+void GpuCuller::collect(uint32_t currentImage) {
+	if (countsBuffer == VK_NULL_HANDLE) {
+		return;
+	}
+	memcpy(&lastCounts, static_cast<char *>(countsBufferMemory.mapped) +
+		   sizeof(GpuDrawCounts) * currentImage, sizeof(GpuDrawCounts));
+}
+
+void GpuCuller::cleanup() {
+	if (objectBuffer != VK_NULL_HANDLE) {
+		vkDestroyPipeline(BP->device, cullPipeline, nullptr);
+		vkDestroyPipelineLayout(BP->device, cullPipelineLayout, nullptr);
+		vkDestroyDescriptorSetLayout(BP->device, cullSetLayout, nullptr);
+		vkDestroyBuffer(BP->device, meshBuffer, nullptr);
+		BP->allocator.free(meshBufferMemory);
+		destroyImageResources();
+		objectBuffer = VK_NULL_HANDLE;
+	}
+	if (BP != nullptr) {
+		drawSetLayout.cleanup();
+	}
+}
+
+void HiZPyramid::init(BaseProject *bp) {
+	BP = bp;
+
+	VkSamplerCreateInfo samplerInfo{};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.anisotropyEnable = VK_FALSE;
+	samplerInfo.maxAnisotropy = 1;
+	samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+	samplerInfo.unnormalizedCoordinates = VK_FALSE;
+	samplerInfo.compareEnable = VK_FALSE;
+	samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.minLod = 0.0f;
+	samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+	VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr, &sampler);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create Hi-Z sampler!");
+	}
+
+	std::array<VkDescriptorSetLayoutBinding, 2> bindings{};
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindings[0].descriptorCount = 1;
+	bindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	bindings[1].binding = 1;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	bindings[1].descriptorCount = 1;
+	bindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+	layoutInfo.pBindings = bindings.data();
+	result = vkCreateDescriptorSetLayout(BP->device, &layoutInfo, nullptr, &setLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create Hi-Z descriptor set layout!");
+	}
+
+	auto shaderCode = Pipeline::readFile("shaders/HiZReduceComp.spv");
+	VkShaderModuleCreateInfo moduleInfo{};
+	moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	moduleInfo.codeSize = shaderCode.size();
+	moduleInfo.pCode = reinterpret_cast<const uint32_t*>(shaderCode.data());
+	VkShaderModule shaderModule;
+	result = vkCreateShaderModule(BP->device, &moduleInfo, nullptr, &shaderModule);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create Hi-Z shader module!");
+	}
+
+	// Source and destination size
+	VkPushConstantRange pushConstants{};
+	pushConstants.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstants.offset = 0;
+	pushConstants.size = 4 * sizeof(uint32_t);
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &setLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstants;
+	result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr, &pipelineLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create Hi-Z pipeline layout!");
+	}
+
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipelineInfo.stage.module = shaderModule;
+	pipelineInfo.stage.pName = "main";
+	pipelineInfo.layout = pipelineLayout;
+	result = vkCreateComputePipelines(BP->device, BP->pipelineCache, 1, &pipelineInfo,
+									  nullptr, &pipeline);
+	vkDestroyShaderModule(BP->device, shaderModule, nullptr);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create Hi-Z pipeline!");
+	}
+}
+
+// Image, views and sets for the current depth buffer (after every
+// swapchain recreation)
+void HiZPyramid::create() {
+	auto nextPowerOfTwo = [](uint32_t n) {
+		uint32_t p = 1;
+		while (p < n) {
+			p *= 2;
+		}
+		return p;
+	};
+	uint32_t width = nextPowerOfTwo((BP->swapChainExtent.width + 1) / 2);
+	uint32_t height = nextPowerOfTwo((BP->swapChainExtent.height + 1) / 2);
+	levels = static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
+
+	BP->createImage(width, height, levels, VK_FORMAT_R32_SFLOAT, VK_IMAGE_TILING_OPTIMAL,
+					VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, imageMemory);
+	view = BP->createImageView(image, VK_FORMAT_R32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, levels);
+	levelViews.resize(levels);
+	for (uint32_t l = 0; l < levels; l++) {
+		levelViews[l] = BP->createImageView(image, VK_FORMAT_R32_SFLOAT,
+											VK_IMAGE_ASPECT_COLOR_BIT, 1,
+											VK_IMAGE_VIEW_TYPE_2D, 1, l);
+	}
+
+	std::array<VkDescriptorPoolSize, 2> poolSizes{};
+	poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSizes[0].descriptorCount = levels;
+	poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	poolSizes[1].descriptorCount = levels;
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+	poolInfo.pPoolSizes = poolSizes.data();
+	poolInfo.maxSets = levels;
+	VkResult result = vkCreateDescriptorPool(BP->device, &poolInfo, nullptr, &descriptorPool);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create Hi-Z descriptor pool!");
+	}
+
+	sets.resize(levels);
+	std::vector<VkDescriptorSetLayout> layouts(levels, setLayout);
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = descriptorPool;
+	allocInfo.descriptorSetCount = levels;
+	allocInfo.pSetLayouts = layouts.data();
+	result = vkAllocateDescriptorSets(BP->device, &allocInfo, sets.data());
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate Hi-Z descriptor sets!");
+	}
+
+	// Level 0 reads the depth buffer, every other level the one before it
+	for (uint32_t l = 0; l < levels; l++) {
+		VkDescriptorImageInfo source{};
+		source.sampler = sampler;
+		source.imageView = l == 0 ? BP->depthImageView : levelViews[l - 1];
+		source.imageLayout = l == 0 ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL :
+									  VK_IMAGE_LAYOUT_GENERAL;
+		VkDescriptorImageInfo destination{};
+		destination.imageView = levelViews[l];
+		destination.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+		std::array<VkWriteDescriptorSet, 2> writes{};
+		writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[0].dstSet = sets[l];
+		writes[0].dstBinding = 0;
+		writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		writes[0].descriptorCount = 1;
+		writes[0].pImageInfo = &source;
+		writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writes[1].dstSet = sets[l];
+		writes[1].dstBinding = 1;
+		writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		writes[1].descriptorCount = 1;
+		writes[1].pImageInfo = &destination;
+		vkUpdateDescriptorSets(BP->device, static_cast<uint32_t>(writes.size()),
+							   writes.data(), 0, nullptr);
+	}
+
+	// The pyramid stays in GENERAL, read and written by compute shaders only
+	VkCommandBuffer commandBuffer = BP->beginSingleTimeCommands();
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = levels;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+						 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+						 0, nullptr, 0, nullptr, 1, &barrier);
+	BP->endSingleTimeCommands(commandBuffer);
+
+	builtExtent = BP->renderExtent();
+	ready = false;
+}
+
+void HiZPyramid::destroy() {
+	if (image == VK_NULL_HANDLE) {
+		return;
+	}
+	vkDestroyDescriptorPool(BP->device, descriptorPool, nullptr);
+	for (VkImageView levelView : levelViews) {
+		vkDestroyImageView(BP->device, levelView, nullptr);
+	}
+	levelViews.clear();
+	vkDestroyImageView(BP->device, view, nullptr);
+	vkDestroyImage(BP->device, image, nullptr);
+	BP->allocator.free(imageMemory);
+	image = VK_NULL_HANDLE;
+}
+
+// After the render pass: reduces the depth of the rendered area into the
+// pyramid, level by level, then gives the depth buffer back to the next
+// render pass. The last barrier makes the pyramid visible to the culling
+// shaders that follow, including those of the next frames.
+void HiZPyramid::record(VkCommandBuffer commandBuffer) {
+	builtExtent = BP->renderExtent();
+
+	VkImageMemoryBarrier depthBarrier{};
+	depthBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	depthBarrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	depthBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	depthBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	depthBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	depthBarrier.image = BP->depthImage;
+	depthBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+	depthBarrier.subresourceRange.baseMipLevel = 0;
+	depthBarrier.subresourceRange.levelCount = 1;
+	depthBarrier.subresourceRange.baseArrayLayer = 0;
+	depthBarrier.subresourceRange.layerCount = 1;
+	depthBarrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	depthBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	// COMPUTE as well: the culling of this frame reads the levels about
+	// to be overwritten
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+							VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+						 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+						 0, nullptr, 0, nullptr, 1, &depthBarrier);
+
+	VkImageMemoryBarrier levelBarrier{};
+	levelBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	levelBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+	levelBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	levelBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	levelBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	levelBarrier.image = image;
+	levelBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	levelBarrier.subresourceRange.levelCount = 1;
+	levelBarrier.subresourceRange.baseArrayLayer = 0;
+	levelBarrier.subresourceRange.layerCount = 1;
+	levelBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	levelBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+	uint32_t sourceWidth = builtExtent.width, sourceHeight = builtExtent.height;
+	for (uint32_t l = 0; l < levels; l++) {
+		uint32_t sizes[4] = { sourceWidth, sourceHeight,
+							  (sourceWidth + 1) / 2, (sourceHeight + 1) / 2 };
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+								pipelineLayout, 0, 1, &sets[l], 0, nullptr);
+		vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+						   0, sizeof(sizes), sizes);
+		vkCmdDispatch(commandBuffer, (sizes[2] + 7) / 8, (sizes[3] + 7) / 8, 1);
+
+		levelBarrier.subresourceRange.baseMipLevel = l;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+							 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+							 0, nullptr, 0, nullptr, 1, &levelBarrier);
+		sourceWidth = sizes[2];
+		sourceHeight = sizes[3];
+	}
+
+	depthBarrier.oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	depthBarrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	depthBarrier.srcAccessMask = 0;
+	depthBarrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+								 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+						 VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+							VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, 0,
+						 0, nullptr, 0, nullptr, 1, &depthBarrier);
+}
+
+void HiZPyramid::cleanup() {
+	if (BP == nullptr) {
+		return;
+	}
+	destroy();
+	vkDestroyPipeline(BP->device, pipeline, nullptr);
+	vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+	vkDestroyDescriptorSetLayout(BP->device, setLayout, nullptr);
+	vkDestroySampler(BP->device, sampler, nullptr);
+	BP = nullptr;
+}
+
+void GpuProfiler::init(BaseProject *bp, uint32_t imageCount, bool withStatistics) {
+	BP = bp;
+	sections.clear();
+	sections.push_back({"other"});
+	enabled = BP->gpuProfileInterval > 0;
+	if (!enabled) {
+		return;
+	}
+	if (BP->timestampMask == 0) {
+		std::cout << "Timestamps not supported, GPU profiler disabled\n";
+		enabled = false;
+		return;
+	}
+	statisticsEnabled = withStatistics;
+	createQueries(imageCount);
+}
+
+// The query pools and per image state, for imageCount swapchain images
+void GpuProfiler::createQueries(uint32_t imageCount) {
+	VkQueryPoolCreateInfo queryInfo{};
+	queryInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	queryInfo.queryCount = imageCount * MAX_RUNS * 2;
+
+	VkResult result = vkCreateQueryPool(BP->device, &queryInfo, nullptr, &timestampPool);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create timestamp query pool!");
+	}
+
+	if (statisticsEnabled) {
+		queryInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+		queryInfo.queryCount = imageCount * MAX_RUNS;
+		queryInfo.pipelineStatistics =
+				VK_QUERY_PIPELINE_STATISTIC_INPUT_ASSEMBLY_PRIMITIVES_BIT |
+				VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+				VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+				VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+
+		result = vkCreateQueryPool(BP->device, &queryInfo, nullptr, &statisticsPool);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to create pipeline statistics query pool!");
+		}
+	}
+
+	runSections.assign(imageCount, {});
+	runCounts.reset(new std::atomic<uint32_t>[imageCount]);
+	for (uint32_t i = 0; i < imageCount; i++) {
+		runCounts[i] = 0;
+	}
+	pending.assign(imageCount, false);
+	rollingFrame = rollingCount = 0;
+}
+
+// For a swapchain recreated with another image count. The sections and
+// their pipelines stay, the pending results are dropped.
+void GpuProfiler::resize(uint32_t imageCount) {
+	if (!enabled) {
+		return;
+	}
+	cleanup();
+	createQueries(imageCount);
+}
+
+// Registers a section and assigns it to the pipelines. Call it before the
+// command buffers are recorded (from localInit).
+int GpuProfiler::addSection(const std::string& name, std::initializer_list<Pipeline *> pipelines) {
+	int section = static_cast<int>(sections.size());
+	sections.push_back({name});
+	for (Pipeline *pipeline : pipelines) {
+		pipeline->profilerSection = section;
+	}
+	return section;
+}
+
+// Outside the render pass, before any run of the command buffer
+void GpuProfiler::beginFrame(VkCommandBuffer commandBuffer, uint32_t currentImage) {
+	if (!enabled) {
+		return;
+	}
+	vkCmdResetQueryPool(commandBuffer, timestampPool, currentImage * MAX_RUNS * 2, MAX_RUNS * 2);
+	if (statisticsEnabled) {
+		vkCmdResetQueryPool(commandBuffer, statisticsPool, currentImage * MAX_RUNS, MAX_RUNS);
+	}
+	runCounts[currentImage] = 0;
+}
+
+// Returns the run to pass to endRun, -1 when nothing was written
+int GpuProfiler::beginRun(VkCommandBuffer commandBuffer, uint32_t currentImage, int section) {
+	if (!enabled) {
+		return -1;
+	}
+	uint32_t run = runCounts[currentImage]++;
+	if (run >= MAX_RUNS) {
+		runCounts[currentImage] = MAX_RUNS;
+		return -1;
+	}
+	runSections[currentImage][run] = section;
+
+	// Top of pipe: the run starts when its first draw is reached, not once
+	// the work before it has drained (end, at bottom of pipe, waits for
+	// its own draws). Neighbouring runs may overlap by the drain time.
+	uint32_t query = currentImage * MAX_RUNS + run;
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+						timestampPool, query * 2);
+	if (statisticsEnabled) {
+		vkCmdBeginQuery(commandBuffer, statisticsPool, query, 0);
+	}
+	return static_cast<int>(run);
+}
+
+void GpuProfiler::endRun(VkCommandBuffer commandBuffer, uint32_t currentImage, int run) {
+	if (run < 0) {
+		return;
+	}
+	uint32_t query = currentImage * MAX_RUNS + run;
+	if (statisticsEnabled) {
+		vkCmdEndQuery(commandBuffer, statisticsPool, query);
+	}
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+						timestampPool, query * 2 + 1);
+}
+
+void GpuProfiler::submitted(uint32_t currentImage) {
+	if (enabled) {
+		pending[currentImage] = true;
+	}
+}
+
+// Adds the last submission of the image to the rolling averages. The
+// caller has waited on its fence: results that are still not available
+// are skipped rather than waited for.
+void GpuProfiler::collect(uint32_t currentImage) {
+	if (!enabled || !pending[currentImage]) {
+		return;
+	}
+	pending[currentImage] = false;
+
+	uint32_t runs = runCounts[currentImage];
+	if (runs == 0) {
+		return;
+	}
+	uint32_t first = currentImage * MAX_RUNS;
+	std::vector<uint64_t> ticks(runs * 2);
+	VkResult result = vkGetQueryPoolResults(BP->device, timestampPool, first * 2, runs * 2,
+			ticks.size() * sizeof(uint64_t), ticks.data(), sizeof(uint64_t),
+			VK_QUERY_RESULT_64_BIT);
+	if (result != VK_SUCCESS) {
+		return;
+	}
+	std::vector<Statistics> statistics(runs);
+	if (statisticsEnabled) {
+		result = vkGetQueryPoolResults(BP->device, statisticsPool, first, runs,
+				statistics.size() * sizeof(Statistics), statistics.data(),
+				sizeof(Statistics), VK_QUERY_RESULT_64_BIT);
+		if (result != VK_SUCCESS) {
+			return;
+		}
+	}
+
+	for (Section& section : sections) {
+		section.ms.resize(ROLLING_FRAMES);
+		section.statistics.resize(ROLLING_FRAMES);
+		section.ms[rollingFrame] = 0.0f;
+		section.statistics[rollingFrame] = {};
+	}
+	for (uint32_t run = 0; run < runs; run++) {
+		Section& section = sections[runSections[currentImage][run]];
+		section.ms[rollingFrame] += ((ticks[run * 2 + 1] - ticks[run * 2]) & BP->timestampMask) *
+									BP->timestampPeriod / 1e6f;
+		for (int s = 0; s < STATISTICS_COUNT; s++) {
+			section.statistics[rollingFrame][s] += statistics[run][s];
+		}
+	}
+	rollingFrame = (rollingFrame + 1) % ROLLING_FRAMES;
+	rollingCount = std::min(rollingCount + 1, ROLLING_FRAMES);
+}
+
+float GpuProfiler::averageMs(int section) const {
+	if (rollingCount == 0) {
+		return 0.0f;
+	}
+	float sum = 0.0f;
+	for (uint32_t f = 0; f < rollingCount; f++) {
+		sum += sections[section].ms[f];
+	}
+	return sum / rollingCount;
+}
+
+GpuProfiler::Statistics GpuProfiler::averageStatistics(int section) const {
+	Statistics average{};
+	if (rollingCount == 0) {
+		return average;
+	}
+	for (uint32_t f = 0; f < rollingCount; f++) {
+		for (int s = 0; s < STATISTICS_COUNT; s++) {
+			average[s] += sections[section].statistics[f][s];
+		}
+	}
+	for (int s = 0; s < STATISTICS_COUNT; s++) {
+		average[s] /= rollingCount;
+	}
+	return average;
+}
+
+void GpuProfiler::print() const {
+	if (!enabled || rollingCount == 0) {
+		return;
+	}
+	float total = 0.0f;
+	for (size_t i = 0; i < sections.size(); i++) {
+		total += averageMs(static_cast<int>(i));
+	}
+	std::cout << "GPU sections (average of the last " << rollingCount << " frames, "
+			  << total << " ms in total):\n";
+	for (size_t i = 0; i < sections.size(); i++) {
+		float ms = averageMs(static_cast<int>(i));
+		if (i == 0 && ms == 0.0f) {
+			continue;
+		}
+		std::cout << "  " << sections[i].name << ": " << ms << " ms";
+		if (statisticsEnabled) {
+			Statistics average = averageStatistics(static_cast<int>(i));
+			std::cout << ", " << average[0] << " primitives, " << average[1]
+					  << " vertex invocations, " << average[2] << " clipped primitives, "
+					  << average[3] << " fragment invocations";
+		}
+		std::cout << "\n";
+	}
+}
+
+void GpuProfiler::cleanup() {
+	if (timestampPool != VK_NULL_HANDLE) {
+		vkDestroyQueryPool(BP->device, timestampPool, nullptr);
+		timestampPool = VK_NULL_HANDLE;
+	}
+	if (statisticsPool != VK_NULL_HANDLE) {
+		vkDestroyQueryPool(BP->device, statisticsPool, nullptr);
+		statisticsPool = VK_NULL_HANDLE;
+	}
+}
+
+void FrameStats::print(const std::string& label, size_t warmup) const {
+	if (frameMs.size() <= warmup) {
+		return;
+	}
+	float sum = 0.0f;
+	float minMs = frameMs[warmup], maxMs = frameMs[warmup];
+	for (size_t i = warmup; i < frameMs.size(); i++) {
+		sum += frameMs[i];
+		minMs = std::min(minMs, frameMs[i]);
+		maxMs = std::max(maxMs, frameMs[i]);
+	}
+	float avg = sum / (frameMs.size() - warmup);
+
+	std::vector<float> sorted(frameMs.begin() + warmup, frameMs.end());
+	std::sort(sorted.begin(), sorted.end());
+	auto percentile = [&sorted](float p) {
+		return sorted[static_cast<size_t>(p * (sorted.size() - 1) + 0.5f)];
+	};
+
+	std::cout << "Benchmark (" << label << "): " << frameMs.size() - warmup
+			  << " frames, avg " << avg << " ms (" << 1000.0f / avg << " FPS), min "
+			  << minMs << " ms, max " << maxMs << " ms, p50 " << percentile(0.50f)
+			  << " ms, p95 " << percentile(0.95f) << " ms, p99 " << percentile(0.99f) << " ms\n";
+}
+
+// Gribb and Hartmann: each plane is the last row of the matrix plus or
+// minus another row (depth is 0 to 1, so near is the third row alone)
+void Frustum::update(const glm::mat4& viewProj) {
+	glm::vec4 row[4];
+	for (int r = 0; r < 4; r++) {
+		row[r] = glm::vec4(viewProj[0][r], viewProj[1][r], viewProj[2][r], viewProj[3][r]);
+	}
+	glm::vec4 planes[6] = {
+		row[3] + row[0], row[3] - row[0],
+		row[3] + row[1], row[3] - row[1],
+		row[2], row[3] - row[2]
+	};
+	for (int p = 0; p < PLANES; p++) {
+		glm::vec4 plane = p < 6 ? planes[p] / glm::length(glm::vec3(planes[p])) :
+								  glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+		nx[p] = plane.x;
+		ny[p] = plane.y;
+		nz[p] = plane.z;
+		d[p] = plane.w;
+	}
+	valid = true;
+}
+
+bool Frustum::sphereVisible(const glm::vec3& center, float radius) const {
+	if (!valid) {
+		return true;
+	}
+	int outside = 0;
+	for (int p = 0; p < PLANES; p++) {
+		float distance = nx[p] * center.x + ny[p] * center.y + nz[p] * center.z + d[p];
+		outside |= distance < -radius;
+	}
+	return !outside;
+}
+
+// Only the corner furthest along each plane normal is tested
+bool Frustum::boxVisible(const glm::vec3& boxMin, const glm::vec3& boxMax) const {
+	if (!valid) {
+		return true;
+	}
+	int outside = 0;
+	for (int p = 0; p < PLANES; p++) {
+		float x = nx[p] >= 0.0f ? boxMax.x : boxMin.x;
+		float y = ny[p] >= 0.0f ? boxMax.y : boxMin.y;
+		float z = nz[p] >= 0.0f ? boxMax.z : boxMin.z;
+		outside |= nx[p] * x + ny[p] * y + nz[p] * z + d[p] < 0.0f;
+	}
+	return !outside;
+}
+
+// The bounding sphere rejects most invisible models cheaply, the world
+// space box around the transformed bounding box then catches the long
+// and thin ones the sphere overestimates
+bool Frustum::modelVisible(const Model& model, const glm::mat4& world) const {
+	glm::vec3 center = glm::vec3(world * glm::vec4((model.boundsMin + model.boundsMax) * 0.5f, 1.0f));
+	float scale = std::sqrt(std::max({ glm::dot(glm::vec3(world[0]), glm::vec3(world[0])),
+									   glm::dot(glm::vec3(world[1]), glm::vec3(world[1])),
+									   glm::dot(glm::vec3(world[2]), glm::vec3(world[2])) }));
+	if (!sphereVisible(center, model.boundsRadius * scale)) {
+		return false;
+	}
+	glm::vec3 halfSize = (model.boundsMax - model.boundsMin) * 0.5f;
+	glm::vec3 extent = glm::abs(glm::vec3(world[0])) * halfSize.x +
+					   glm::abs(glm::vec3(world[1])) * halfSize.y +
+					   glm::abs(glm::vec3(world[2])) * halfSize.z;
+	return boxVisible(center - extent, center + extent);
+}
+
+void RoomGraph::addPortal(int a, int b, const glm::vec2& from, const glm::vec2& to) {
+	portals.push_back({ { a, b }, from, to });
+	rooms[a].portals.push_back(static_cast<int>(portals.size()) - 1);
+	rooms[b].portals.push_back(static_cast<int>(portals.size()) - 1);
+}
+
+int RoomGraph::roomAt(const glm::vec2& p) const {
+	glm::vec2 cell = glm::floor((p - cellOrigin) / cellSize);
+	if (cell.x < 0.0f || cell.y < 0.0f || cell.x >= cellColumns || cell.y >= cellRows) {
+		return -1;
+	}
+	return cells[cellColumns * static_cast<int>(cell.y) + static_cast<int>(cell.x)];
+}
+
+// The room holding the whole bounding sphere of the model, or -1. The
+// circle is sampled at the center and eight points of its rim, exact for
+// rectangular rooms.
+int RoomGraph::roomOf(const Model& model, const glm::mat4& world) const {
+	glm::vec3 center = glm::vec3(world * glm::vec4((model.boundsMin + model.boundsMax) * 0.5f, 1.0f));
+	float scale = std::sqrt(std::max({ glm::dot(glm::vec3(world[0]), glm::vec3(world[0])),
+									   glm::dot(glm::vec3(world[1]), glm::vec3(world[1])),
+									   glm::dot(glm::vec3(world[2]), glm::vec3(world[2])) }));
+	float radius = model.boundsRadius * scale;
+	glm::vec2 c = glm::vec2(center.x, center.z);
+	int r = roomAt(c);
+	if (r < 0) {
+		return -1;
+	}
+	for (int i = 0; i < 8; i++) {
+		float angle = glm::radians(45.0f * i);
+		if (roomAt(c + radius * glm::vec2(std::cos(angle), std::sin(angle))) != r) {
+			return -1;
+		}
+	}
+	return r;
+}
+
+// Reorders the triangles room by room, then the shared ones, and sets the
+// index ranges
+void RoomGraph::splitIndices(const Vertex *vertices, const uint32_t *indices,
+							 uint32_t indexCount, std::vector<uint32_t>& sorted) {
+	std::vector<std::vector<uint32_t>> buckets(rooms.size() + 1);
+	for (uint32_t t = 0; t + 2 < indexCount; t += 3) {
+		int room = -1;
+		for (int v = 0; v < 3; v++) {
+			const glm::vec3& pos = vertices[indices[t + v]].pos;
+			int r = roomAt(glm::vec2(pos.x, pos.z));
+			if (v == 0) {
+				room = r;
+			} else if (r != room) {
+				room = -1;
+			}
+		}
+		std::vector<uint32_t>& bucket = room < 0 ? buckets.back() : buckets[room];
+		bucket.insert(bucket.end(), indices + t, indices + t + 3);
+	}
+
+	sorted.clear();
+	sorted.reserve(indexCount);
+	for (size_t r = 0; r < rooms.size(); r++) {
+		rooms[r].firstIndex = static_cast<uint32_t>(sorted.size());
+		rooms[r].indexCount = static_cast<uint32_t>(buckets[r].size());
+		sorted.insert(sorted.end(), buckets[r].begin(), buckets[r].end());
+	}
+	sharedFirstIndex = static_cast<uint32_t>(sorted.size());
+	sharedIndexCount = static_cast<uint32_t>(buckets.back().size());
+	sorted.insert(sorted.end(), buckets.back().begin(), buckets.back().end());
+}
+
+void RoomGraph::findVisible(const glm::vec3& eye, const glm::mat4& viewProj) {
+	cameraRoom = roomAt(glm::vec2(eye.x, eye.z));
+	if (cameraRoom < 0) {
+		visible.assign(rooms.size(), true);
+	} else {
+		visible.assign(rooms.size(), false);
+		std::vector<bool> onPath(rooms.size(), false);
+		visit(cameraRoom, glm::vec4(-1.0f, -1.0f, 1.0f, 1.0f), eye, viewProj, onPath);
+	}
+	visibleCount = static_cast<uint32_t>(std::count(visible.begin(), visible.end(), true));
+}
+
+void RoomGraph::visit(int room, const glm::vec4& rect, const glm::vec3& eye,
+					  const glm::mat4& viewProj, std::vector<bool>& onPath) {
+	visible[room] = true;
+	onPath[room] = true;
+	for (int p : rooms[room].portals) {
+		const Portal& portal = portals[p];
+		int next = portal.rooms[0] == room ? portal.rooms[1] : portal.rooms[0];
+		if (onPath[next]) {
+			continue;
+		}
+
+		// Distance of the eye from the portal, on the ground plane
+		glm::vec2 e = glm::vec2(eye.x, eye.z);
+		glm::vec2 segment = portal.to - portal.from;
+		float t = glm::clamp(glm::dot(e - portal.from, segment) / glm::dot(segment, segment), 0.0f, 1.0f);
+		bool close = glm::length(e - (portal.from + t * segment)) < PORTAL_MARGIN;
+
+		glm::vec4 portalRect = rect;
+		if (!close) {
+			glm::vec3 corners[4] = {
+				glm::vec3(portal.from.x, floorY, portal.from.y),
+				glm::vec3(portal.to.x, floorY, portal.to.y),
+				glm::vec3(portal.to.x, ceilingY, portal.to.y),
+				glm::vec3(portal.from.x, ceilingY, portal.from.y)
+			};
+			glm::vec4 clip[4];
+			for (int c = 0; c < 4; c++) {
+				clip[c] = viewProj * glm::vec4(corners[c], 1.0f);
+			}
+			// Screen rectangle of the part of the portal in front of the
+			// camera: the corners and the points where edges cross w = NEAR_W
+			const float NEAR_W = 1e-3f;
+			glm::vec2 ndcMin = glm::vec2(1e30f), ndcMax = glm::vec2(-1e30f);
+			bool inFront = false;
+			for (int c = 0; c < 4; c++) {
+				const glm::vec4& a = clip[c];
+				const glm::vec4& b = clip[(c + 1) % 4];
+				glm::vec4 points[2];
+				int count = 0;
+				if (a.w > NEAR_W) {
+					points[count++] = a;
+				}
+				if ((a.w > NEAR_W) != (b.w > NEAR_W)) {
+					points[count++] = glm::mix(a, b, (NEAR_W - a.w) / (b.w - a.w));
+				}
+				for (int k = 0; k < count; k++) {
+					glm::vec2 ndc = glm::vec2(points[k]) / points[k].w;
+					ndcMin = glm::min(ndcMin, ndc);
+					ndcMax = glm::max(ndcMax, ndc);
+					inFront = true;
+				}
+			}
+			if (!inFront) {
+				continue;
+			}
+			portalRect = glm::vec4(glm::max(glm::vec2(rect), ndcMin),
+								   glm::min(glm::vec2(rect.z, rect.w), ndcMax));
+		}
+		if (portalRect.x < portalRect.z && portalRect.y < portalRect.w) {
+			visit(next, portalRect, eye, viewProj, onPath);
+		}
+	}
+	onPath[room] = false;
+}
+
+CpuProfiler::ThreadBuffer *CpuProfiler::threadBuffer() {
+	thread_local ThreadBuffer *buffer = nullptr;
+	if (buffer == nullptr) {
+		std::lock_guard<std::mutex> lock(mutex);
+		threads.emplace_back(new ThreadBuffer());
+		buffer = threads.back().get();
+		buffer->id = static_cast<uint32_t>(threads.size());
+		buffer->name = "thread " + std::to_string(buffer->id);
+		buffer->events.reserve(4096);
+	}
+	return buffer;
+}
+
+void CpuProfiler::setThreadName(const std::string& name) {
+	threadBuffer()->name = name;
+}
+
+void CpuProfiler::add(const char *name, std::string detail, uint64_t startNs, uint64_t endNs) {
+	ThreadBuffer *buffer = threadBuffer();
+	if (buffer->events.size() < MAX_EVENTS_PER_THREAD) {
+		buffer->events.push_back({name, std::move(detail), startNs, endNs - startNs});
+	}
+}
+
+// Chrome trace event format: complete ("X") events in microseconds, plus a
+// thread_name metadata event per thread
+void CpuProfiler::write(const std::string& file) {
+	nlohmann::json events = nlohmann::json::array();
+	size_t count = 0;
+	for (const std::unique_ptr<ThreadBuffer>& thread : threads) {
+		events.push_back({{"name", "thread_name"}, {"ph", "M"}, {"pid", 1},
+						  {"tid", thread->id}, {"args", {{"name", thread->name}}}});
+		for (const Event& event : thread->events) {
+			nlohmann::json e = {{"name", event.name}, {"cat", "cpu"}, {"ph", "X"},
+								{"pid", 1}, {"tid", thread->id},
+								{"ts", event.startNs / 1000.0},
+								{"dur", event.durationNs / 1000.0}};
+			if (!event.detail.empty()) {
+				e["args"] = {{"detail", event.detail}};
+			}
+			events.push_back(std::move(e));
+		}
+		count += thread->events.size();
+	}
+	nlohmann::json trace = {{"traceEvents", std::move(events)}, {"displayTimeUnit", "ms"}};
+
+	std::ofstream out(file);
+	out << trace.dump();
+	if (!out) {
+		std::cout << "Could not write " << file << "\n";
+		return;
+	}
+	std::cout << "CPU trace: " << count << " zones written to " << file << "\n";
+}
+
+void JobSystem::init(unsigned int threadCount) {
+	stopping = false;
+	for (unsigned int i = 0; i < threadCount; i++) {
+		workers.emplace_back([this, i]() {
+			if (cpuProfiler.enabled) {
+				cpuProfiler.setThreadName("worker " + std::to_string(i));
+			}
+			for (;;) {
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+					if (jobs.empty()) {
+						return;
+					}
+					job = std::move(jobs.front());
+					jobs.pop_front();
+				}
+				job();
+			}
+		});
+	}
+}
+
+std::future<void> JobSystem::submit(std::function<void()> job) {
+	// packaged_task forwards exceptions (e.g. a missing file) to future.get()
+	auto task = std::make_shared<std::packaged_task<void()>>(std::move(job));
+	std::future<void> done = task->get_future();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.emplace_back([task]() { (*task)(); });
+	}
+	wake.notify_one();
+	return done;
+}
+
+void JobSystem::cleanup() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	workers.clear();
+}
+
+void AssetLoader::begin(BaseProject *bp) {
+	BP = bp;
+	entries.clear();
+	start = std::chrono::high_resolution_clock::now();
+}
 
-        glfwDestroyWindow(window);
+float AssetLoader::elapsedMs() {
+	return std::chrono::duration<float, std::chrono::milliseconds::period>
+		(std::chrono::high_resolution_clock::now() - start).count();
+}
 
-        glfwTerminate();
-    }
-};
+void AssetLoader::add(const std::string& name, std::function<void()> decode,
+					  std::function<void()> upload) {
+	entries.emplace_back();
+	Entry& entry = entries.back();
+	entry.timing.name = name;
+	entry.upload = std::move(upload);
+
+	if (decode) {
+		AssetTiming *timing = &entry.timing;
+		entry.decoded = BP->jobs.submit([this, timing, decode]() {
+			PROFILE_SCOPE_DETAIL("decode asset", timing->name);
+			timing->decodeStart = elapsedMs();
+			decode();
+			timing->decodeEnd = elapsedMs();
+		});
+	}
+}
 
-void Model::loadModel(std::string file) {
-	tinyobj::ObjReaderConfig reader_config;
-	reader_config.mtl_search_path = "./materials"; // Path to material files
+void AssetLoader::finish() {
+	// All mesh staging copies go out in one submission at the end
+	BP->beginUploadBatch();
+	std::exception_ptr error;
+	for (Entry& entry : entries) {
+		try {
+			if (entry.decoded.valid()) {
+				PROFILE_SCOPE_DETAIL("wait for decode", entry.timing.name);
+				entry.decoded.get();
+			}
+			entry.timing.uploadStart = elapsedMs();
+			if (entry.upload) {
+				PROFILE_SCOPE_DETAIL("upload asset", entry.timing.name);
+				entry.upload();
+			}
+			entry.timing.uploadEnd = elapsedMs();
+		} catch (...) {
+			error = std::current_exception();
+			break;
+		}
+	}
+	if (error) {
+		// The decodes still running write into the entries and into the
+		// objects of the caller: they must be done before unwinding
+		for (Entry& entry : entries) {
+			if (entry.decoded.valid()) {
+				entry.decoded.wait();
+			}
+		}
+		std::rethrow_exception(error);
+	}
+	BP->flushUploadBatch();
+
+	std::cout << "Asset load timeline (ms since start, " << BP->jobs.size()
+			  << " worker threads)\n";
+	for (const Entry& entry : entries) {
+		const AssetTiming& t = entry.timing;
+		std::cout << "  " << t.name
+				  << "  decode " << t.decodeStart << " -> " << t.decodeEnd
+				  << " (" << t.decodeEnd - t.decodeStart << ")"
+				  << "  upload " << t.uploadStart << " -> " << t.uploadEnd
+				  << " (" << t.uploadEnd - t.uploadStart << ")\n";
+	}
+	std::cout << "  total: " << elapsedMs() << " ms\n";
+}
 
-	tinyobj::ObjReader reader;
+bool MappedFile::open(const std::string& path) {
+#ifdef _WIN32
+	fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+							 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(fileHandle, &fileSize);
+	size = static_cast<size_t>(fileSize.QuadPart);
+	if (size == 0) {
+		close();
+		return false;
+	}
+	mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mappingHandle == nullptr) {
+		close();
+		return false;
+	}
+	data = static_cast<const char*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+#else
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close();
+		return false;
+	}
+	size = static_cast<size_t>(st.st_size);
+	void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	data = (ptr == MAP_FAILED) ? nullptr : static_cast<const char*>(ptr);
+#endif
+	if (data == nullptr) {
+		close();
+		return false;
+	}
+	return true;
+}
 
-	if (!reader.ParseFromFile(file, reader_config)) {
-		if (!reader.Error().empty()) {
-			std::cerr << "TinyObjReader: " << reader.Error();
+void MappedFile::close() {
+#ifdef _WIN32
+	if (data != nullptr) UnmapViewOfFile(data);
+	if (mappingHandle != nullptr) CloseHandle(mappingHandle);
+	if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+	mappingHandle = nullptr;
+	fileHandle = INVALID_HANDLE_VALUE;
+#else
+	if (data != nullptr) munmap(const_cast<char*>(data), size);
+	if (fd >= 0) ::close(fd);
+	fd = -1;
+#endif
+	data = nullptr;
+	size = 0;
+}
+
+// FNV-1a over the whole file, used to detect stale mesh caches
+uint64_t Model::hashFile(const std::string& file) {
+	MappedFile source;
+	if (!source.open(file)) {
+		return 0;
+	}
+	uint64_t hash = hashBytes(source.data, source.size);
+	source.close();
+	return hash;
+}
+
+void Model::computeBounds() {
+	vertexCount = static_cast<uint32_t>(vertices.size());
+	indexCount = static_cast<uint32_t>(indices.size());
+	if (vertices.empty()) {
+		return;
+	}
+	boundsMin = boundsMax = vertices[0].pos;
+	for (const Vertex& v : vertices) {
+		boundsMin = glm::min(boundsMin, v.pos);
+		boundsMax = glm::max(boundsMax, v.pos);
+	}
+	glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+	float radius2 = 0.0f;
+	for (const Vertex& v : vertices) {
+		glm::vec3 d = v.pos - center;
+		radius2 = std::max(radius2, glm::dot(d, d));
+	}
+	boundsRadius = std::sqrt(radius2);
+}
+
+// Symmetric 4x4 matrix: the sum of the squared distances from a set of
+// planes, each weighted by the area of its triangle. error() divides by the
+// total weight, so it is a mean squared distance.
+struct Quadric {
+	double a[10] = {};	// xx xy xz xw yy yz yw zz zw ww
+	double weight = 0.0;
+
+	void addPlane(const glm::dvec3& n, double d, double w) {
+		a[0] += w * n.x * n.x; a[1] += w * n.x * n.y; a[2] += w * n.x * n.z; a[3] += w * n.x * d;
+		a[4] += w * n.y * n.y; a[5] += w * n.y * n.z; a[6] += w * n.y * d;
+		a[7] += w * n.z * n.z; a[8] += w * n.z * d;
+		a[9] += w * d * d;
+		weight += w;
+	}
+	void add(const Quadric& q) {
+		for (int i = 0; i < 10; i++) a[i] += q.a[i];
+		weight += q.weight;
+	}
+	double error(const glm::vec3& p) const {
+		double x = p.x, y = p.y, z = p.z;
+		double sum = a[0] * x * x + 2.0 * a[1] * x * y + 2.0 * a[2] * x * z + 2.0 * a[3] * x +
+					 a[4] * y * y + 2.0 * a[5] * y * z + 2.0 * a[6] * y +
+					 a[7] * z * z + 2.0 * a[8] * z + a[9];
+		return weight > 0.0 ? std::max(sum, 0.0) / weight : 0.0;
+	}
+};
+
+std::vector<uint32_t> simplifyMesh(const Vertex *vertices, size_t vertexCount,
+								   const uint32_t *indices, size_t indexCount,
+								   size_t targetIndexCount, float& error) {
+	std::vector<uint32_t> result(indices, indices + indexCount);
+	error = 0.0f;
+
+	// Vertices split by normals or UVs share a position: group them, a
+	// group with more than one vertex is a seam
+	std::vector<uint32_t> group(vertexCount);
+	std::vector<uint32_t> groupSize;
+	std::unordered_map<glm::vec3, uint32_t> groupAt;
+	for (size_t v = 0; v < vertexCount; v++) {
+		auto it = groupAt.emplace(vertices[v].pos, static_cast<uint32_t>(groupSize.size()));
+		if (it.second) {
+			groupSize.push_back(0);
 		}
-		exit(1);
+		group[v] = it.first->second;
+		groupSize[group[v]]++;
 	}
 
-	if (!reader.Warning().empty()) {
-		std::cout << "TinyObjReader: " << reader.Warning();
+	// An edge used by a single triangle is on an open border
+	std::vector<bool> locked(vertexCount, false);
+	std::unordered_map<uint64_t, uint32_t> edgeUse;
+	auto edgeKey = [&](uint32_t a, uint32_t b) {
+		uint64_t ga = group[a], gb = group[b];
+		return ga < gb ? (ga << 32) | gb : (gb << 32) | ga;
+	};
+	for (size_t t = 0; t < indexCount; t += 3) {
+		for (int e = 0; e < 3; e++) {
+			edgeUse[edgeKey(indices[t + e], indices[t + (e + 1) % 3])]++;
+		}
+	}
+	for (size_t t = 0; t < indexCount; t += 3) {
+		for (int e = 0; e < 3; e++) {
+			uint32_t a = indices[t + e], b = indices[t + (e + 1) % 3];
+			if (edgeUse[edgeKey(a, b)] == 1) {
+				locked[a] = locked[b] = true;
+			}
+		}
+	}
+	for (size_t v = 0; v < vertexCount; v++) {
+		if (groupSize[group[v]] > 1) {
+			locked[v] = true;
+		}
 	}
 
-	auto& attrib = reader.GetAttrib();
-	auto& shapes = reader.GetShapes();
-	auto& materials = reader.GetMaterials();
+	// Plane of every triangle, summed on its corners
+	std::vector<Quadric> groupQuadric(groupSize.size());
+	for (size_t t = 0; t < indexCount; t += 3) {
+		glm::dvec3 p0 = vertices[indices[t]].pos;
+		glm::dvec3 p1 = vertices[indices[t + 1]].pos;
+		glm::dvec3 p2 = vertices[indices[t + 2]].pos;
+		glm::dvec3 n = glm::cross(p1 - p0, p2 - p0);
+		double len = glm::length(n);
+		if (len == 0.0) {
+			continue;
+		}
+		n /= len;
+		Quadric q;
+		q.addPlane(n, -glm::dot(n, p0), len * 0.5);
+		for (int c = 0; c < 3; c++) {
+			groupQuadric[group[indices[t + c]]].add(q);
+		}
+	}
+	std::vector<Quadric> quadric(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++) {
+		quadric[v] = groupQuadric[group[v]];
+	}
 
-	// Loop over shapes
-	for (size_t s = 0; s < shapes.size(); s++) {
-		// Loop over faces(polygon)
-		size_t index_offset = 0;
-		for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-			size_t fv = size_t(shapes[s].mesh.num_face_vertices[f]);
-			Vertex vertex{};
+	struct Collapse {
+		double cost;
+		uint32_t from, to;
+	};
+	std::vector<Collapse> collapses;
+	std::vector<uint32_t> adjacencyStart(vertexCount + 1);
+	std::vector<uint32_t> adjacency;
+	std::vector<uint32_t> remap(vertexCount);
+	std::vector<bool> touched(vertexCount);
+
+	// Each pass collapses the cheapest edges whose neighbourhoods do not
+	// overlap, then rebuilds the triangle list
+	while (result.size() > targetIndexCount) {
+		size_t triangleCount = result.size() / 3;
+
+		std::fill(adjacencyStart.begin(), adjacencyStart.end(), 0);
+		for (uint32_t index : result) {
+			adjacencyStart[index + 1]++;
+		}
+		for (size_t v = 0; v < vertexCount; v++) {
+			adjacencyStart[v + 1] += adjacencyStart[v];
+		}
+		adjacency.resize(result.size());
+		std::vector<uint32_t> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+		for (size_t i = 0; i < result.size(); i++) {
+			adjacency[fill[result[i]]++] = static_cast<uint32_t>(i / 3);
+		}
 
-			// Loop over vertices in the face.
-			for (size_t v = 0; v < fv; v++) {
-				// access to vertex
-				tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-				tinyobj::real_t vx = attrib.vertices[3 * size_t(idx.vertex_index) + 0];
-				tinyobj::real_t vy = attrib.vertices[3 * size_t(idx.vertex_index) + 1];
-				tinyobj::real_t vz = attrib.vertices[3 * size_t(idx.vertex_index) + 2];
-				vertex.pos = { vx, vy, vz };
+		collapses.clear();
+		for (size_t t = 0; t < result.size(); t += 3) {
+			for (int e = 0; e < 3; e++) {
+				uint32_t a = result[t + e], b = result[t + (e + 1) % 3];
+				Quadric q = quadric[a];
+				q.add(quadric[b]);
+				if (!locked[a]) {
+					collapses.push_back({q.error(vertices[b].pos), a, b});
+				}
+				if (!locked[b]) {
+					collapses.push_back({q.error(vertices[a].pos), b, a});
+				}
+			}
+		}
+		std::sort(collapses.begin(), collapses.end(),
+				  [](const Collapse& x, const Collapse& y) { return x.cost < y.cost; });
 
+		for (size_t v = 0; v < vertexCount; v++) {
+			remap[v] = static_cast<uint32_t>(v);
+		}
+		std::fill(touched.begin(), touched.end(), false);
+		size_t removable = triangleCount - targetIndexCount / 3;
+		size_t removed = 0;
+		bool collapsed = false;
 
-				// Check if `normal_index` is zero or positive. negative = no normal data
-				if (idx.normal_index >= 0) {
-					tinyobj::real_t nx = attrib.normals[3 * size_t(idx.normal_index) + 0];
-					tinyobj::real_t ny = attrib.normals[3 * size_t(idx.normal_index) + 1];
-					tinyobj::real_t nz = attrib.normals[3 * size_t(idx.normal_index) + 2];
-					vertex.norm = { nx, ny, nz };
+		for (const Collapse& c : collapses) {
+			if (removed >= removable) {
+				break;
+			}
+			if (touched[c.from] || touched[c.to]) {
+				continue;
+			}
+
+			// Moving from onto to must not fold any triangle over
+			bool flips = false;
+			size_t dropped = 0;
+			for (uint32_t i = adjacencyStart[c.from]; i < adjacencyStart[c.from + 1] && !flips; i++) {
+				const uint32_t *tri = &result[adjacency[i] * 3];
+				if (tri[0] == c.to || tri[1] == c.to || tri[2] == c.to) {
+					dropped++;
+					continue;
 				}
+				glm::vec3 p[3], q[3];
+				for (int k = 0; k < 3; k++) {
+					p[k] = vertices[tri[k]].pos;
+					q[k] = tri[k] == c.from ? vertices[c.to].pos : p[k];
+				}
+				glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+				glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+				float lengths = glm::length(before) * glm::length(after);
+				flips = lengths == 0.0f || glm::dot(before, after) < 0.25f * lengths;
+			}
+			if (flips) {
+				continue;
+			}
 
-				// Check if `texcoord_index` is zero or positive. negative = no texcoord data
-				if (idx.texcoord_index >= 0) {
-					tinyobj::real_t tx = attrib.texcoords[2 * size_t(idx.texcoord_index) + 0];
-					tinyobj::real_t ty = 1 - attrib.texcoords[2 * size_t(idx.texcoord_index) + 1];
-					vertex.texCoord = { tx, ty };
+			remap[c.from] = c.to;
+			quadric[c.to].add(quadric[c.from]);
+			error = std::max(error, static_cast<float>(std::sqrt(c.cost)));
+			removed += dropped;
+			collapsed = true;
+			for (uint32_t i = adjacencyStart[c.from]; i < adjacencyStart[c.from + 1]; i++) {
+				const uint32_t *tri = &result[adjacency[i] * 3];
+				touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = true;
+			}
+		}
+		if (!collapsed) {
+			break;
+		}
+
+		size_t kept = 0;
+		for (size_t t = 0; t < result.size(); t += 3) {
+			uint32_t a = remap[result[t]], b = remap[result[t + 1]], c = remap[result[t + 2]];
+			if (a != b && b != c && a != c) {
+				result[kept++] = a;
+				result[kept++] = b;
+				result[kept++] = c;
+			}
+		}
+		result.resize(kept);
+	}
+	return result;
+}
+
+// Simplifies each level from the one before, halving the triangles, and
+// stops early once the simplifier gets stuck on locked vertices. The errors
+// add up, so each one bounds the distance from the full mesh.
+void Model::buildLods() {
+	const uint32_t MIN_LOD_TRIANGLES = 64;
+
+	lods.clear();
+	if (indexCount / 3 < MIN_LOD_TRIANGLES * 2) {
+		return;
+	}
+	lods.push_back({0, indexCount, 0.0f});
+	while (lods.size() < MAX_MODEL_LODS) {
+		const ModelLod previous = lods.back();
+		size_t target = (previous.indexCount / 6) * 3;
+		if (target / 3 < MIN_LOD_TRIANGLES) {
+			break;
+		}
+		float lodError;
+		std::vector<uint32_t> simplified =
+				simplifyMesh(vertices.data(), vertices.size(),
+							 indices.data() + previous.firstIndex, previous.indexCount,
+							 target, lodError);
+		if (simplified.size() > previous.indexCount * 8 / 10) {
+			break;
+		}
+		ModelLod next;
+		next.firstIndex = static_cast<uint32_t>(indices.size());
+		next.indexCount = static_cast<uint32_t>(simplified.size());
+		next.error = previous.error + lodError;
+		indices.insert(indices.end(), simplified.begin(), simplified.end());
+		lods.push_back(next);
+	}
+	if (lods.size() == 1) {
+		lods.clear();
+	}
+}
+
+uint32_t Model::cacheBuildFlags() const {
+	return (generateLods ? MESH_CACHE_LODS : 0) | (generateMeshlets ? MESH_CACHE_MESHLETS : 0);
+}
+
+uint32_t Model::totalIndexCount() const {
+	return lods.empty() ? indexCount : lods.back().firstIndex + lods.back().indexCount;
+}
+
+const ModelLod Model::lod(int level) const {
+	if (lods.empty()) {
+		return {0, indexCount, 0.0f};
+	}
+	return lods[std::min<size_t>(level, lods.size() - 1)];
+}
+
+// Grows each meshlet from a seed triangle through the triangles sharing a
+// corner position with it (across UV and normal seams), so meshlets are
+// compact patches (tight spheres, narrow cones), until MESHLET_MAX_VERTICES
+// or MESHLET_MAX_TRIANGLES is reached. Then rewrites the full mesh indices
+// in meshlet order.
+void Model::buildMeshlets() {
+	meshlets.clear();
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount == 0) {
+		return;
+	}
+
+	std::vector<uint32_t> position(vertexCount);
+	std::unordered_map<glm::vec3, uint32_t> positionAt;
+	for (uint32_t v = 0; v < vertexCount; v++) {
+		position[v] = positionAt.emplace(vertices[v].pos,
+										 static_cast<uint32_t>(positionAt.size())).first->second;
+	}
+	size_t positionCount = positionAt.size();
+
+	std::vector<uint32_t> adjacencyStart(positionCount + 1, 0);
+	for (uint32_t i = 0; i < indexCount; i++) {
+		adjacencyStart[position[indices[i]] + 1]++;
+	}
+	for (size_t p = 0; p < positionCount; p++) {
+		adjacencyStart[p + 1] += adjacencyStart[p];
+	}
+	std::vector<uint32_t> adjacency(indexCount);
+	std::vector<uint32_t> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+	for (uint32_t i = 0; i < indexCount; i++) {
+		adjacency[fill[position[indices[i]]]++] = i / 3;
+	}
+
+	std::vector<uint32_t> ordered;
+	ordered.reserve(indexCount);
+	std::vector<bool> used(triangleCount, false);
+	std::vector<uint32_t> vertexMeshlet(vertexCount, UINT32_MAX);
+	std::vector<uint32_t> frontier;
+	std::vector<uint32_t> meshletVertices;
+	size_t seed = 0;
+
+	while (true) {
+		while (seed < triangleCount && used[seed]) {
+			seed++;
+		}
+		if (seed == triangleCount) {
+			break;
+		}
+
+		Meshlet meshlet{};
+		meshlet.firstIndex = static_cast<uint32_t>(ordered.size());
+		uint32_t id = static_cast<uint32_t>(meshlets.size());
+		meshletVertices.clear();
+		frontier.assign(1, static_cast<uint32_t>(seed));
+		for (size_t f = 0; f < frontier.size() &&
+						   meshlet.indexCount < MESHLET_MAX_TRIANGLES * 3; f++) {
+			uint32_t t = frontier[f];
+			if (used[t]) {
+				continue;
+			}
+			const uint32_t *tri = &indices[t * 3];
+			uint32_t newVertices = 0;
+			for (int c = 0; c < 3; c++) {
+				newVertices += vertexMeshlet[tri[c]] != id;
+			}
+			if (meshletVertices.size() + newVertices > MESHLET_MAX_VERTICES) {
+				continue;
+			}
+
+			used[t] = true;
+			meshlet.indexCount += 3;
+			for (int c = 0; c < 3; c++) {
+				ordered.push_back(tri[c]);
+				if (vertexMeshlet[tri[c]] != id) {
+					vertexMeshlet[tri[c]] = id;
+					meshletVertices.push_back(tri[c]);
+				}
+				uint32_t p = position[tri[c]];
+				for (uint32_t a = adjacencyStart[p]; a < adjacencyStart[p + 1]; a++) {
+					if (!used[adjacency[a]]) {
+						frontier.push_back(adjacency[a]);
+					}
 				}
-				vertices.push_back(vertex);
-				indices.push_back(vertices.size() - 1);
 			}
-			index_offset += fv;
-			
-			// per-face material
-			shapes[s].mesh.material_ids[f];
+		}
 
+		// Bounding sphere around the center of the box of the vertices
+		glm::vec3 boxMin = vertices[meshletVertices[0]].pos, boxMax = boxMin;
+		for (uint32_t v : meshletVertices) {
+			boxMin = glm::min(boxMin, vertices[v].pos);
+			boxMax = glm::max(boxMax, vertices[v].pos);
+		}
+		meshlet.center = (boxMin + boxMax) * 0.5f;
+		for (uint32_t v : meshletVertices) {
+			meshlet.radius = std::max(meshlet.radius, glm::length(vertices[v].pos - meshlet.center));
+		}
 
+		// Normal cone: the average of the face normals, opened to the
+		// widest of them
+		std::vector<glm::vec3> normals;
+		glm::vec3 axis(0.0f);
+		for (uint32_t i = meshlet.firstIndex; i < meshlet.firstIndex + meshlet.indexCount; i += 3) {
+			glm::vec3 p0 = vertices[ordered[i]].pos;
+			glm::vec3 n = glm::cross(vertices[ordered[i + 1]].pos - p0,
+									 vertices[ordered[i + 2]].pos - p0);
+			float length = glm::length(n);
+			if (length > 0.0f) {
+				normals.push_back(n / length);
+				axis += n / length;
+			}
+		}
+		meshlet.coneAxis = glm::vec3(0.0f, 0.0f, 1.0f);
+		meshlet.coneCutoff = 1.0f;
+		if (glm::length(axis) > 0.0f) {
+			meshlet.coneAxis = glm::normalize(axis);
+			float minDot = 1.0f;
+			for (const glm::vec3& n : normals) {
+				minDot = std::min(minDot, glm::dot(n, meshlet.coneAxis));
+			}
+			if (minDot > 0.1f) {
+				meshlet.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+			}
 		}
+		meshlets.push_back(meshlet);
+	}
+
+	std::copy(ordered.begin(), ordered.end(), indices.begin());
+}
 
+bool Model::loadMeshCache(const std::string& file, uint64_t sourceHash) {
+	if (!meshCache.open(file + ".meshcache")) {
+		return false;
 	}
-	
-	
+
+	const MeshCacheHeader *header =
+			reinterpret_cast<const MeshCacheHeader*>(meshCache.data);
+	bool valid = meshCache.size >= sizeof(MeshCacheHeader) &&
+				 header->magic == MESH_CACHE_MAGIC &&
+				 header->version == MESH_CACHE_VERSION &&
+				 header->vertexSize == sizeof(Vertex) &&
+				 header->sourceHash == sourceHash &&
+				 header->lodCount <= MAX_MODEL_LODS &&
+				 // Keyed on what was requested, not on what was built: a
+				 // model that simplifies to a single level has no LODs
+				 header->buildFlags == cacheBuildFlags() &&
+				 meshCache.size == sizeof(MeshCacheHeader) +
+						(size_t)header->vertexCount * sizeof(Vertex) +
+						(size_t)header->indexCount * sizeof(uint32_t) +
+						(size_t)header->meshletCount * sizeof(Meshlet);
+	if (!valid) {
+		std::cout << file << " -> mesh cache out of date, rebuilding\n";
+		meshCache.close();
+		return false;
+	}
+
+	vertexCount = header->vertexCount;
+	indexCount = header->lodCount > 0 ? header->lodIndexCount[0] : header->indexCount;
+	lods.clear();
+	uint32_t firstIndex = 0;
+	for (uint32_t i = 0; i < header->lodCount; i++) {
+		lods.push_back({firstIndex, header->lodIndexCount[i], header->lodError[i]});
+		firstIndex += header->lodIndexCount[i];
+	}
+	const Meshlet *cachedMeshlets = reinterpret_cast<const Meshlet*>(meshCache.data +
+			sizeof(MeshCacheHeader) + sizeof(Vertex) * vertexCount +
+			sizeof(uint32_t) * header->indexCount);
+	meshlets.assign(cachedMeshlets, cachedMeshlets + header->meshletCount);
+	boundsMin = glm::vec3(header->boundsMin[0], header->boundsMin[1], header->boundsMin[2]);
+	boundsMax = glm::vec3(header->boundsMax[0], header->boundsMax[1], header->boundsMax[2]);
+	boundsRadius = header->boundsRadius;
+	std::cout << file << " -> mesh cache: " << vertexCount << " vertices, "
+			  << indexCount << " indices";
+	if (!lods.empty()) {
+		std::cout << ", " << lods.size() << " LODs";
+	}
+	if (!meshlets.empty()) {
+		std::cout << ", " << meshlets.size() << " meshlets";
+	}
+	std::cout << "\n";
+	return true;
+}
+
+void Model::writeMeshCache(const std::string& file, uint64_t sourceHash) {
+	MeshCacheHeader header{};
+	header.magic = MESH_CACHE_MAGIC;
+	header.version = MESH_CACHE_VERSION;
+	header.vertexSize = sizeof(Vertex);
+	header.vertexCount = vertexCount;
+	header.indexCount = totalIndexCount();
+	header.lodCount = static_cast<uint32_t>(lods.size());
+	for (size_t i = 0; i < lods.size(); i++) {
+		header.lodIndexCount[i] = lods[i].indexCount;
+		header.lodError[i] = lods[i].error;
+	}
+	header.meshletCount = static_cast<uint32_t>(meshlets.size());
+	header.buildFlags = cacheBuildFlags();
+	header.sourceHash = sourceHash;
+	header.boundsRadius = boundsRadius;
+	for (int i = 0; i < 3; i++) {
+		header.boundsMin[i] = boundsMin[i];
+		header.boundsMax[i] = boundsMax[i];
+	}
+
+	// Written beside the old cache and swapped, like the pipeline cache, so
+	// a crash or a full disk never leaves a truncated one behind
+	std::string cacheFile = file + ".meshcache";
+	std::string tmpFile = cacheFile + ".tmp";
+	std::ofstream out(tmpFile, std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(vertices.data()), sizeof(Vertex) * vertices.size());
+	out.write(reinterpret_cast<const char*>(indices.data()), sizeof(uint32_t) * indices.size());
+	out.write(reinterpret_cast<const char*>(meshlets.data()), sizeof(Meshlet) * meshlets.size());
+	out.close();
+	bool written = static_cast<bool>(out);
+	if (written) {
+		std::remove(cacheFile.c_str());
+		written = std::rename(tmpFile.c_str(), cacheFile.c_str()) == 0;
+	}
+	if (!written) {
+		std::cout << file << " -> could not write mesh cache\n";
+		std::remove(tmpFile.c_str());
+	}
+}
+
+const void *Model::vertexSource() {
+	if (meshCache.data != nullptr) {
+		return meshCache.data + sizeof(MeshCacheHeader);
+	}
+	return vertices.data();
+}
+
+// Indices set after decode (reordered, see RoomGraph::splitIndices) win
+// over the cache
+const void *Model::indexSource() {
+	if (meshCache.data != nullptr && indices.empty()) {
+		return meshCache.data + sizeof(MeshCacheHeader) + sizeof(Vertex) * vertexCount;
+	}
+	return indices.data();
 }
 
 // Lesson 21
 void Model::createVertexBuffer() {
-	VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
-	
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
-						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-						VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-						vertexBuffer, vertexBufferMemory);
+	VkDeviceSize bufferSize = sizeof(Vertex) * vertexCount;
+
+	if (dynamic || BP->hostVisibleMeshes) {
+		BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
+							VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+							VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+							vertexBuffer, vertexBufferMemory);
 
-	void* data;
-	vkMapMemory(BP->device, vertexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, vertices.data(), (size_t) bufferSize);
-	vkUnmapMemory(BP->device, vertexBufferMemory);			
+		memcpy(vertexBufferMemory.mapped, vertexSource(), (size_t) bufferSize);
+		return;
+	}
+
+	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+						VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+						VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+						vertexBuffer, vertexBufferMemory);
+	BP->uploadBuffer(vertexBuffer, vertexSource(), bufferSize);
 }
 
 void Model::createIndexBuffer() {
-	VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
+	VkDeviceSize bufferSize = sizeof(uint32_t) * totalIndexCount();
+
+	if (dynamic || BP->hostVisibleMeshes) {
+		BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+								 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+								 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+								 indexBuffer, indexBufferMemory);
 
-	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-							 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-							 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-							 indexBuffer, indexBufferMemory);
+		memcpy(indexBufferMemory.mapped, indexSource(), (size_t) bufferSize);
+		return;
+	}
 
-	void* data;
-	vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, indices.data(), (size_t) bufferSize);
-	vkUnmapMemory(BP->device, indexBufferMemory);
+	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+						VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+						VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+						indexBuffer, indexBufferMemory);
+	BP->uploadBuffer(indexBuffer, indexSource(), bufferSize);
 }
 
-void Model::init(BaseProject *bp, std::string file) {
-	BP = bp;
+void Model::decode(std::string file) {
 	if (!file.empty()) {
-		loadModel(file);
+		uint64_t sourceHash = hashFile(file);
+		if (!loadMeshCache(file, sourceHash)) {
+			loadModel(file);
+			computeBounds();
+			if (generateMeshlets) {
+				buildMeshlets();
+				std::cout << file << " -> " << meshlets.size() << " meshlets\n";
+			}
+			if (generateLods) {
+				buildLods();
+			}
+			if (!lods.empty()) {
+				std::cout << file << " -> LOD triangles:";
+				for (const ModelLod& l : lods) {
+					std::cout << " " << l.indexCount / 3;
+				}
+				std::cout << "\n";
+			}
+			writeMeshCache(file, sourceHash);
+		}
+	} else {
+		computeBounds();
 	}
-		
-	createVertexBuffer();
-	createIndexBuffer();
+}
+
+void Model::upload(BaseProject *bp) {
+	BP = bp;
+	if (registry != nullptr) {
+		registry->add(*this);
+	} else {
+		createVertexBuffer();
+		createIndexBuffer();
+	}
+	meshCache.close();
+}
+
+void Model::init(BaseProject *bp, std::string file) {
+	decode(file);
+	upload(bp);
 }
 
 void Model::cleanup() {
+	if (registry != nullptr) {
+		return;		// the buffers are the registry's
+	}
    	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
-   	vkFreeMemory(BP->device, indexBufferMemory, nullptr);
+   	BP->allocator.free(indexBufferMemory);
 	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
-   	vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
+   	BP->allocator.free(vertexBufferMemory);
 }
 
 
 
-void Texture::createTextureImage(std::string file) {
-	int texWidth, texHeight, texChannels;
-	stbi_uc* pixels = stbi_load(file.c_str(), &texWidth, &texHeight,
+void InstanceBuffer::init(BaseProject *bp, const std::vector<InstanceData>& instances) {
+	BP = bp;
+	this->instances = instances;
+	instanceCount = static_cast<uint32_t>(instances.size());
+	VkDeviceSize bufferSize = sizeof(InstanceData) * instances.size();
+
+	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+						VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+						VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+						buffer, bufferMemory);
+	BP->uploadBuffer(buffer, instances.data(), bufferSize);
+}
+
+void InstanceBuffer::cleanup() {
+	vkDestroyBuffer(BP->device, buffer, nullptr);
+	BP->allocator.free(bufferMemory);
+}
+
+void Texture::decode(std::string file) {
+	int texChannels;
+	pixels = stbi_load(file.c_str(), &texWidth, &texHeight,
 						&texChannels, STBI_rgb_alpha);
 	if (!pixels) {
-		throw std::runtime_error("failed to load texture image!");
+		throw std::runtime_error("failed to load texture image: " + file);
 	}
+}
 
+void Texture::createTextureImage() {
 	VkDeviceSize imageSize = texWidth * texHeight * 4;
 	mipLevels = static_cast<uint32_t>(std::floor(
 					std::log2(std::max(texWidth, texHeight)))) + 1;
 	
 	VkBuffer stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
+	Allocation stagingBufferMemory;
 	 
 	BP->createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 	  						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 	  						VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 	  						stagingBuffer, stagingBufferMemory);
-	void* data;
-	vkMapMemory(BP->device, stagingBufferMemory, 0, imageSize, 0, &data);
-	memcpy(data, pixels, static_cast<size_t>(imageSize));
-	vkUnmapMemory(BP->device, stagingBufferMemory);
+	memcpy(stagingBufferMemory.mapped, pixels, static_cast<size_t>(imageSize));
 	
 	stbi_image_free(pixels);
+	pixels = nullptr;
 	
 	BP->createImage(texWidth, texHeight, mipLevels, VK_FORMAT_R8G8B8A8_SRGB,
 				VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
@@ -1663,7 +7110,7 @@ void Texture::createTextureImage(std::string file) {
 					texWidth, texHeight, mipLevels);
 
 	vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-	vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
+	BP->allocator.free(stagingBufferMemory);
 }
 
 void Texture::createTextureImageView() {
@@ -1701,24 +7148,38 @@ void Texture::createTextureSampler() {
 }
 
 
-void Texture::init(BaseProject *bp, std::string file) {
+void Texture::upload(BaseProject *bp) {
 	BP = bp;
-	createTextureImage(file);
+	createTextureImage();
 	createTextureImageView();
 	createTextureSampler();
 }
 
+void Texture::init(BaseProject *bp, std::string file) {
+	decode(file);
+	upload(bp);
+}
+
 void Texture::cleanup() {
    	vkDestroySampler(BP->device, textureSampler, nullptr);
    	vkDestroyImageView(BP->device, textureImageView, nullptr);
 	vkDestroyImage(BP->device, textureImage, nullptr);
-	vkFreeMemory(BP->device, textureImageMemory, nullptr);
+	BP->allocator.free(textureImageMemory);
 }
 
 
 void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
-					std::vector<DescriptorSetLayout *> D, int pushConstantRangeCount =  0) {
+					std::vector<DescriptorSetLayout *> D, int pushConstantRangeCount =  0,
+					bool instanced = false) {
 	BP = bp;
+	vertShaderFile = VertShader;
+	fragShaderFile = FragShader;
+	setLayouts = D;
+	pushConstantRanges = pushConstantRangeCount;
+	instancedInput = instanced;
+	if (std::find(BP->pipelines.begin(), BP->pipelines.end(), this) == BP->pipelines.end()) {
+		BP->pipelines.push_back(this);
+	}
 	
 	auto vertShaderCode = readFile(VertShader);
 	auto fragShaderCode = readFile(FragShader);
@@ -1756,13 +7217,25 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 			VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 	auto bindingDescription = Vertex::getBindingDescription();
 	auto attributeDescriptions = Vertex::getAttributeDescriptions();
+	auto instancedBindingDescriptions = Vertex::getInstancedBindingDescriptions();
+	auto instancedAttributeDescriptions = Vertex::getInstancedAttributeDescriptions();
 			
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
-	vertexInputInfo.vertexAttributeDescriptionCount =
-			static_cast<uint32_t>(attributeDescriptions.size());
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-	vertexInputInfo.pVertexAttributeDescriptions =
-			attributeDescriptions.data();		
+	if (instanced) {
+		vertexInputInfo.vertexBindingDescriptionCount =
+				static_cast<uint32_t>(instancedBindingDescriptions.size());
+		vertexInputInfo.vertexAttributeDescriptionCount =
+				static_cast<uint32_t>(instancedAttributeDescriptions.size());
+		vertexInputInfo.pVertexBindingDescriptions = instancedBindingDescriptions.data();
+		vertexInputInfo.pVertexAttributeDescriptions =
+				instancedAttributeDescriptions.data();
+	} else {
+		vertexInputInfo.vertexBindingDescriptionCount = 1;
+		vertexInputInfo.vertexAttributeDescriptionCount =
+				static_cast<uint32_t>(attributeDescriptions.size());
+		vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+		vertexInputInfo.pVertexAttributeDescriptions =
+				attributeDescriptions.data();
+	}
 
 	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
 	inputAssembly.sType =
@@ -1771,25 +7244,24 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 	inputAssembly.primitiveRestartEnable = VK_FALSE;
 
 	// Lesson 19
-	VkViewport viewport{};
-	viewport.x = 0.0f;
-	viewport.y = 0.0f;
-	viewport.width = (float) BP->swapChainExtent.width;
-	viewport.height = (float) BP->swapChainExtent.height;
-	viewport.minDepth = 0.0f;
-	viewport.maxDepth = 1.0f;
-	
-	VkRect2D scissor{};
-	scissor.offset = {0, 0};
-	scissor.extent = BP->swapChainExtent;
-	
+	// Viewport and scissor are dynamic (set by BaseProject::setViewport when
+	// recording), so the pipeline does not depend on the resolution
 	VkPipelineViewportStateCreateInfo viewportState{};
 	viewportState.sType =
 			VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 	viewportState.viewportCount = 1;
-	viewportState.pViewports = &viewport;
+	viewportState.pViewports = nullptr;
 	viewportState.scissorCount = 1;
-	viewportState.pScissors = &scissor;
+	viewportState.pScissors = nullptr;
+
+	VkDynamicState dynamicStates[] = {
+		VK_DYNAMIC_STATE_VIEWPORT,
+		VK_DYNAMIC_STATE_SCISSOR
+	};
+	VkPipelineDynamicStateCreateInfo dynamicState{};
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.dynamicStateCount = 2;
+	dynamicState.pDynamicStates = dynamicStates;
 	
 	VkPipelineRasterizationStateCreateInfo rasterizer{};
 	rasterizer.sType =
@@ -1904,19 +7376,23 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 	pipelineInfo.pMultisampleState = &multisampling;
 	pipelineInfo.pDepthStencilState = &depthStencil;
 	pipelineInfo.pColorBlendState = &colorBlending;
-	pipelineInfo.pDynamicState = nullptr; // Optional
+	pipelineInfo.pDynamicState = &dynamicState;
 	pipelineInfo.layout = pipelineLayout;
 	pipelineInfo.renderPass = BP->renderPass;
 	pipelineInfo.subpass = 0;
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 	pipelineInfo.basePipelineIndex = -1; // Optional
 	
-	result = vkCreateGraphicsPipelines(BP->device, VK_NULL_HANDLE, 1,
+	auto createStart = std::chrono::high_resolution_clock::now();
+	result = vkCreateGraphicsPipelines(BP->device, BP->pipelineCache, 1,
 			&pipelineInfo, nullptr, &graphicsPipeline);
 	if (result != VK_SUCCESS) {
 	 	PrintVkError(result);
 		throw std::runtime_error("failed to create graphics pipeline!");
 	}
+	BP->pipelineCreationMs += std::chrono::duration<double, std::milli>(
+			std::chrono::high_resolution_clock::now() - createStart).count();
+	BP->pipelineCount++;
 	
 	vkDestroyShaderModule(BP->device, fragShaderModule, nullptr);
 	vkDestroyShaderModule(BP->device, vertShaderModule, nullptr);
@@ -1961,9 +7437,33 @@ VkShaderModule Pipeline::createShaderModule(const std::vector<char>& code) {
 	return shaderModule;
 }
 
+// Same shaders and layouts, current render pass
+void Pipeline::rebuild() {
+	vkDestroyPipeline(BP->device, graphicsPipeline, nullptr);
+	vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+	init(BP, vertShaderFile, fragShaderFile, setLayouts, pushConstantRanges, instancedInput);
+}
+
 void Pipeline::cleanup() {
 		vkDestroyPipeline(BP->device, graphicsPipeline, nullptr);
 		vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+		BP->pipelines.erase(std::remove(BP->pipelines.begin(), BP->pipelines.end(), this),
+							BP->pipelines.end());
+}
+
+// Number of the first sets whose bindings survive a switch between the two
+// pipelines: Vulkan keeps set N bound when both layouts have the same set
+// layouts for 0 ... N and the same push constant ranges
+int Pipeline::compatibleSets(const Pipeline& other) const {
+	if (pushConstantRanges != other.pushConstantRanges) {
+		return 0;
+	}
+	size_t n = std::min(setLayouts.size(), other.setLayouts.size());
+	int sets = 0;
+	while (sets < (int)n && setLayouts[sets] == other.setLayouts[sets]) {
+		sets++;
+	}
+	return sets;
 }
 
 void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutBinding> B) {
@@ -1992,40 +7492,6 @@ void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutB
 	}
 }
 
-void DescriptorSetLayout::initSkybox(BaseProject* bp) {
-	BP = bp;
-
-	VkDescriptorSetLayoutBinding uboLayoutBinding{};
-	uboLayoutBinding.binding = 0;
-	uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	uboLayoutBinding.descriptorCount = 1;
-	uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-	uboLayoutBinding.pImmutableSamplers = nullptr;
-
-	VkDescriptorSetLayoutBinding samplerLayoutBinding{};
-	samplerLayoutBinding.binding = 1;
-	samplerLayoutBinding.descriptorType =
-		VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-	samplerLayoutBinding.descriptorCount = 1;
-	samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
-	samplerLayoutBinding.pImmutableSamplers = nullptr;
-
-	std::array<VkDescriptorSetLayoutBinding, 2> bindings =
-	{ uboLayoutBinding, samplerLayoutBinding };
-
-	VkDescriptorSetLayoutCreateInfo layoutInfo{};
-	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-	layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
-	layoutInfo.pBindings = bindings.data();
-
-	VkResult result = vkCreateDescriptorSetLayout(BP->device, &layoutInfo,
-		nullptr, &descriptorSetLayout);
-	if (result != VK_SUCCESS) {
-		PrintVkError(result);
-		throw std::runtime_error("failed to create SkyBox descriptor set layout!");
-	}
-}
-
 void DescriptorSetLayout::cleanup() {
     	vkDestroyDescriptorSetLayout(BP->device, descriptorSetLayout, nullptr);	
 }
@@ -2034,32 +7500,48 @@ void DescriptorSetLayout::cleanup() {
 void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 						 std::vector<DescriptorSetElement> E) {
 	BP = bp;
+	layout = DSL;
+	elements = E;
 	
-	// Create uniform buffer
-	uniformBuffers.resize(E.size());
-	uniformBuffersMemory.resize(E.size());
-	toFree.resize(E.size());
-
+	// Reserve the uniform slots
+	uniformSlots.resize(E.size());
+	uniformSizes.resize(E.size());
 	for (int j = 0; j < E.size(); j++) {
-		uniformBuffers[j].resize(BP->swapChainImages.size());
-		uniformBuffersMemory[j].resize(BP->swapChainImages.size());
 		if(E[j].type == UNIFORM) {
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				VkDeviceSize bufferSize = E[j].size;
-				BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-									 	 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-									 	 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-									 	 uniformBuffers[j][i], uniformBuffersMemory[j][i]);
-			}
-			toFree[j] = true;
+			uniformSlots[j] = BP->uniformRing.reserve(E[j].size);
+			uniformSizes[j] = E[j].size;
 		} else {
-			toFree[j] = false;
+			uniformSlots[j] = 0;
+			uniformSizes[j] = 0;
+		}
+	}
+	BP->descriptorSets.push_back(this);
+	allocateSets();
+}
+
+// One set per swapchain image from BP->descriptorPool, pointing at the
+// uniform ring and textures, and the dynamic offsets of each image. The
+// sets of a former pool are simply forgotten (the pool frees them).
+void DescriptorSet::allocateSets() {
+	const std::vector<DescriptorSetElement>& E = elements;
+	std::vector<std::pair<int, uint32_t>> dynamicBindings;
+	for (int j = 0; j < E.size(); j++) {
+		if(E[j].type == UNIFORM) {
+			dynamicBindings.push_back({E[j].binding, uniformSlots[j]});
+		}
+	}
+	// Dynamic offsets are consumed in binding order
+	std::sort(dynamicBindings.begin(), dynamicBindings.end());
+	dynamicOffsets.assign(BP->swapChainImages.size(), {});
+	for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+		for (auto& b : dynamicBindings) {
+			dynamicOffsets[i].push_back(BP->uniformRing.offset(i, b.second));
 		}
 	}
 	
 	// Create Descriptor set
 	std::vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
-											   DSL->descriptorSetLayout);
+											   layout->descriptorSetLayout);
 	VkDescriptorSetAllocateInfo allocInfo{};
 	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	allocInfo.descriptorPool = BP->descriptorPool;
@@ -2077,10 +7559,16 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 	
 	for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
 		std::vector<VkWriteDescriptorSet> descriptorWrites(E.size());
+		// The infos must outlive the vkUpdateDescriptorSets call
+		std::vector<VkDescriptorBufferInfo> bufferInfos(E.size());
+		std::vector<VkDescriptorImageInfo> imageInfos(E.size());
+		std::vector<std::array<VkDescriptorImageInfo, TEXTURE_ARRAY_SIZE>>
+				arrayInfos(E.size());
 		for (int j = 0; j < E.size(); j++) {
 			if(E[j].type == UNIFORM) {
-				VkDescriptorBufferInfo bufferInfo{};
-				bufferInfo.buffer = uniformBuffers[j][i];
+				// Offset 0: the slot and frame come from the dynamic offset
+				VkDescriptorBufferInfo& bufferInfo = bufferInfos[j];
+				bufferInfo.buffer = BP->uniformRing.buffer;
 				bufferInfo.offset = 0;
 				bufferInfo.range = E[j].size;
 				
@@ -2088,11 +7576,11 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 				descriptorWrites[j].dstSet = descriptorSets[i];
 				descriptorWrites[j].dstBinding = E[j].binding;
 				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 				descriptorWrites[j].descriptorCount = 1;
 				descriptorWrites[j].pBufferInfo = &bufferInfo;
 			} else if(E[j].type == TEXTURE) {
-				VkDescriptorImageInfo imageInfo{};
+				VkDescriptorImageInfo& imageInfo = imageInfos[j];
 				imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 				imageInfo.imageView = E[j].tex->textureImageView;
 				imageInfo.sampler = E[j].tex->textureSampler;
@@ -2108,7 +7596,7 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 
 			} else if (E[j].type == TEXTURE_ARRAY) {
 
-				VkDescriptorImageInfo descriptorImageInfos[TEXTURE_ARRAY_SIZE];
+				VkDescriptorImageInfo *descriptorImageInfos = arrayInfos[j].data();
 
 				for (uint32_t i = 0; i < TEXTURE_ARRAY_SIZE; i++)
 				{
@@ -2127,7 +7615,7 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 				descriptorWrites[j].pImageInfo = descriptorImageInfos;
 
 			} else if (E[j].type == SAMPLER) {
-				VkDescriptorImageInfo imageInfo{};
+				VkDescriptorImageInfo& imageInfo = imageInfos[j];
 				imageInfo.sampler = E[j].tex->textureSampler;
 
 				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
@@ -2146,15 +7634,37 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 
 }
 
+// The caller writes the whole element, counted in BP->writtenBytes
+void *DescriptorSet::uniformData(int element, int currentImage) {
+	BP->writtenBytes += uniformSizes[element];
+	return BP->uniformRing.data(currentImage, uniformSlots[element]);
+}
+
+void DescriptorSet::bind(VkCommandBuffer commandBuffer, Pipeline &P, int setId,
+						 int currentImage) {
+	vkCmdBindDescriptorSets(commandBuffer,
+		VK_PIPELINE_BIND_POINT_GRAPHICS,
+		P.pipelineLayout, setId, 1, &descriptorSets[currentImage],
+		static_cast<uint32_t>(dynamicOffsets[currentImage].size()),
+		dynamicOffsets[currentImage].data());
+}
+
 void DescriptorSet::cleanup() {
-	for(int j = 0; j < uniformBuffers.size(); j++) {
-		if(toFree[j]) {
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
-				vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
-			}
+	// The descriptor sets are freed with the pool
+	for (size_t j = 0; j < uniformSlots.size(); j++) {
+		if (uniformSizes[j] > 0) {
+			BP->uniformRing.release(uniformSlots[j], uniformSizes[j]);
 		}
 	}
+	if (BP != nullptr) {
+		BP->descriptorSets.erase(std::remove(BP->descriptorSets.begin(),
+											 BP->descriptorSets.end(), this),
+								 BP->descriptorSets.end());
+	}
+	uniformSlots.clear();
+	uniformSizes.clear();
+	descriptorSets.clear();
+	dynamicOffsets.clear();
 }
 
 
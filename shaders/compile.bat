@@ -4,6 +4,12 @@ C:/VulkanSDK/1.3.204.1/Bin/glslc.exe shaderCard.frag -o CardFrag.spv
 C:/VulkanSDK/1.3.204.1/Bin/glslc.exe shaderCard.vert -o CardVert.spv
 C:/VulkanSDK/1.3.204.1/Bin/glslc.exe shaderMarble.frag -o MarbleFrag.spv
 C:/VulkanSDK/1.3.204.1/Bin/glslc.exe shaderMarble.vert -o MarbleVert.spv
+C:/VulkanSDK/1.3.204.1/Bin/glslc.exe shaderMarbleInstanced.vert -o MarbleInstancedVert.spv
 C:/VulkanSDK/1.3.204.1/Bin/glslc.exe SkyBoxShader.frag -o SkyBoxFrag.spv
 C:/VulkanSDK/1.3.204.1/Bin/glslc.exe SkyBoxShader.vert -o SkyBoxVert.spv
+C:/VulkanSDK/1.3.204.1/Bin/glslc.exe CullObjects.comp -o CullObjectsComp.spv
+C:/VulkanSDK/1.3.204.1/Bin/glslc.exe -DOCCLUSION CullObjects.comp -o CullObjectsOcclusionComp.spv
+C:/VulkanSDK/1.3.204.1/Bin/glslc.exe HiZReduce.comp -o HiZReduceComp.spv
+C:/VulkanSDK/1.3.204.1/Bin/glslc.exe shaderMarbleIndirect.vert -o MarbleIndirectVert.spv
+C:/VulkanSDK/1.3.204.1/Bin/glslc.exe shaderMarbleIndirect.frag -o MarbleIndirectFrag.spv
 PAUSE
\ No newline at end of file
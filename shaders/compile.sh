@@ -0,0 +1,58 @@
+#!/bin/sh
+# Compiles every shader to the SPIR-V the application loads, like
+# compile.bat, with the glslc of $VULKAN_SDK or the one on the PATH.
+#   ./compile.sh           rebuild the .spv files
+#   ./compile.sh --check   only report the .spv files that differ from
+#                          their source (for CI), exit status 1 if any
+set -e
+cd "$(dirname "$0")"
+
+GLSLC=glslc
+if [ -n "$VULKAN_SDK" ] && [ -x "$VULKAN_SDK/bin/glslc" ]; then
+	GLSLC="$VULKAN_SDK/bin/glslc"
+fi
+if ! command -v "$GLSLC" > /dev/null 2>&1; then
+	echo "glslc not found: install the Vulkan SDK or shaderc, or set VULKAN_SDK" >&2
+	exit 2
+fi
+
+CHECK=0
+if [ "$1" = "--check" ]; then
+	CHECK=1
+	TMP=$(mktemp -d)
+	trap 'rm -rf "$TMP"' EXIT
+fi
+STALE=0
+
+# output source [glslc options]
+shader() {
+	out=$1
+	src=$2
+	shift 2
+	if [ $CHECK -eq 1 ]; then
+		"$GLSLC" "$@" "$src" -o "$TMP/$out"
+		if ! cmp -s "$TMP/$out" "$out"; then
+			echo "$out is out of date (or missing)"
+			STALE=1
+		fi
+	else
+		"$GLSLC" "$@" "$src" -o "$out"
+	fi
+}
+
+shader frag.spv shader.frag
+shader vert.spv shader.vert
+shader CardFrag.spv shaderCard.frag
+shader CardVert.spv shaderCard.vert
+shader MarbleFrag.spv shaderMarble.frag
+shader MarbleVert.spv shaderMarble.vert
+shader MarbleInstancedVert.spv shaderMarbleInstanced.vert
+shader SkyBoxFrag.spv SkyBoxShader.frag
+shader SkyBoxVert.spv SkyBoxShader.vert
+shader CullObjectsComp.spv CullObjects.comp
+shader CullObjectsOcclusionComp.spv CullObjects.comp -DOCCLUSION
+shader HiZReduceComp.spv HiZReduce.comp
+shader MarbleIndirectVert.spv shaderMarbleIndirect.vert
+shader MarbleIndirectFrag.spv shaderMarbleIndirect.frag
+
+exit $STALE
@@ -0,0 +1,48 @@
+#version 450
+
+// shaderMarble.vert for the objects drawn by GpuCuller: the model matrix
+// comes from the object buffer, gl_InstanceIndex is the object index
+
+layout(set = 1, binding = 0) uniform GlobalUniformBufferObject {
+	mat4 view;
+	mat4 proj;
+} gubo;
+
+struct Object {
+	mat4 model;
+	uint mesh;
+	uint texture;
+	uint pad0;
+	uint pad1;
+};
+
+layout(std430, set = 2, binding = 0) readonly buffer Objects {
+	vec4 planes[6];
+	mat4 viewProj;
+	uint objectCount;
+	uint hiZReady;
+	uint objectsPad0;
+	uint objectsPad1;
+	Object objects[];
+};
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texCoord;
+
+layout(location = 0) out vec3 fragViewDir;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragTexCoord;
+layout(location = 3) out vec3 fragPos;
+layout(location = 4) flat out uint fragTexture;
+
+
+void main() {
+	mat4 model = objects[gl_InstanceIndex].model;
+	gl_Position = gubo.proj * gubo.view * model * vec4(pos, 1.0);
+	fragViewDir  = (gubo.view[3]).xyz - (model * vec4(pos,  1.0)).xyz;
+	fragNorm     = (model * vec4(norm, 0.0)).xyz;
+	fragTexCoord = texCoord;
+	fragPos = (model * vec4(pos, 1.0)).xyz;
+	fragTexture = objects[gl_InstanceIndex].texture;
+}
@@ -0,0 +1,27 @@
+#version 450
+
+layout(set = 1, binding = 0) uniform GlobalUniformBufferObject {
+	mat4 view;
+	mat4 proj;
+} gubo;
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texCoord;
+
+// Per instance (binding 1): the model matrix takes locations 3 to 6
+layout(location = 3) in mat4 inModel;
+
+layout(location = 0) out vec3 fragViewDir;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragTexCoord;
+layout(location = 3) out vec3 fragPos;
+
+
+void main() {
+	gl_Position = gubo.proj * gubo.view * inModel * vec4(pos, 1.0);
+	fragViewDir  = (gubo.view[3]).xyz - (inModel * vec4(pos,  1.0)).xyz;
+	fragNorm     = (inModel * vec4(norm, 0.0)).xyz;
+	fragTexCoord = texCoord;
+	fragPos = (inModel * vec4(pos, 1.0)).xyz;
+}